@@ -0,0 +1,81 @@
+#include "capture.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils/xalloc.h"
+
+void capture_open(struct capture_t *capture, const char *path, size_t size)
+{
+    memset(capture, 0, sizeof(struct capture_t));
+    uint64_t cap = size / sizeof(struct capture_record_t);
+    if (cap == 0)
+        errx(1, "capture ring smaller than a record");
+    size_t len = sizeof(struct capture_header_t)
+        + cap * sizeof(struct capture_record_t);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, len) == -1)
+        errx(1, "cannot create the capture file %s", path);
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        errx(1, "cannot map the capture file %s", path);
+
+    capture->map = map;
+    capture->ring = (struct capture_record_t *)(capture->map + 1);
+    capture->map->magic = CAPTURE_MAGIC;
+    capture->map->record_size = sizeof(struct capture_record_t);
+    capture->map->cap = cap;
+    capture->start_ns = trace_now();
+}
+
+static void record(struct capture_t *capture, uint32_t conn, uint32_t type,
+                   uint32_t info)
+{
+    struct capture_header_t *map = capture->map;
+    struct capture_record_t *rec = &capture->ring[map->head % map->cap];
+    rec->ns = trace_now() - capture->start_ns;
+    rec->conn = conn;
+    rec->info = type << CAPTURE_TYPE_SHIFT | info;
+    /* a reader of the live file sees whole records only */
+    __atomic_store_n(&map->head, map->head + 1, __ATOMIC_RELEASE);
+}
+
+void capture_connect(struct capture_t *capture, int fd, uint32_t flags)
+{
+    if ((size_t)fd >= capture->by_fd_cap)
+    {
+        size_t cap = capture->by_fd_cap ? capture->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        capture->by_fd = xrealloc_tag(MEM_CONNECTIONS, capture->by_fd,
+                                      cap * sizeof(uint32_t));
+        memset(capture->by_fd + capture->by_fd_cap, 0,
+               (cap - capture->by_fd_cap) * sizeof(uint32_t));
+        capture->by_fd_cap = cap;
+    }
+    capture->by_fd[fd] = ++capture->next_conn;
+    record(capture, capture->by_fd[fd], CAPTURE_CONNECT, flags);
+}
+
+void capture_line(struct capture_t *capture, int fd, size_t len)
+{
+    /* the clients taken over by an upgrade appear with their first line */
+    if ((size_t)fd >= capture->by_fd_cap || capture->by_fd[fd] == 0)
+        capture_connect(capture, fd, 0);
+    record(capture, capture->by_fd[fd], CAPTURE_LINE,
+           len > CAPTURE_LEN_MASK ? CAPTURE_LEN_MASK : len);
+}
+
+void capture_disconnect(struct capture_t *capture, int fd)
+{
+    if ((size_t)fd >= capture->by_fd_cap || capture->by_fd[fd] == 0)
+        return;
+    record(capture, capture->by_fd[fd], CAPTURE_DISCONNECT, 0);
+    capture->by_fd[fd] = 0;
+}
@@ -0,0 +1,118 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief First word of a capture file, changed with its layout
+ */
+#define CAPTURE_MAGIC 0x43415031
+
+/**
+ * \brief Size of the ring of a capture file when -e is not given
+ */
+#define DEFAULT_CAPTURE_SIZE (64 * 1024 * 1024)
+
+/**
+ * \brief Kinds of records, in the two high bits of their info field
+ */
+#define CAPTURE_CONNECT 0x1u
+#define CAPTURE_LINE 0x2u
+#define CAPTURE_DISCONNECT 0x3u
+
+#define CAPTURE_TYPE_SHIFT 30
+#define CAPTURE_LEN_MASK ((1u << CAPTURE_TYPE_SHIFT) - 1)
+
+/**
+ * \brief The info of a CAPTURE_CONNECT from the WebSocket listener
+ */
+#define CAPTURE_WEBSOCKET 0x1u
+
+/**
+ * \brief Start of a capture file, followed by the ring of records
+ */
+struct capture_header_t
+{
+    uint32_t magic; /**< CAPTURE_MAGIC */
+
+    uint32_t record_size; /**< sizeof(struct capture_record_t) */
+
+    uint64_t cap; /**< number of records of the ring */
+
+    uint64_t head; /**< records written, the last one at (head - 1) % cap */
+};
+
+/**
+ * \brief One event of the traffic, the payloads are not kept
+ */
+struct capture_record_t
+{
+    uint64_t ns; /**< nanoseconds since the capture started */
+
+    uint32_t conn; /**< number of the connection, from 1 in the capture */
+
+    uint32_t info; /**< CAPTURE_* type, then the line length or the flags */
+};
+
+/**
+ * \brief Recorder of the connection events and of the received lines
+ *
+ * The records go to a file mapped in memory, the oldest ones overwritten
+ * once the ring is full. Connections are numbered as they appear, the
+ * socket fds being reused. A line is recorded with its length, '\n'
+ * included, clamped to CAPTURE_LEN_MASK.
+ */
+struct capture_t
+{
+    struct capture_header_t *map; /**< the mapped file, NULL when off */
+
+    struct capture_record_t *ring; /**< the records, after the header */
+
+    uint64_t start_ns; /**< CLOCK_MONOTONIC time of the start */
+
+    uint32_t *by_fd; /**< number of the connection of every fd, or 0 */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    uint32_t next_conn; /**< last number given to a connection */
+};
+
+/**
+ * \brief Create a capture file and start recording
+ *
+ * \param capture: the recorder to initialize
+ * \param path: the file, truncated if it exists
+ * \param size: bytes of the ring, rounded down to whole records
+ *
+ * Exits if the file cannot be created and mapped.
+ */
+void capture_open(struct capture_t *capture, const char *path, size_t size);
+
+/**
+ * \brief Record a new connection
+ *
+ * \param capture: the recorder
+ * \param fd: the socket of the client
+ * \param flags: CAPTURE_WEBSOCKET or 0
+ */
+void capture_connect(struct capture_t *capture, int fd, uint32_t flags);
+
+/**
+ * \brief Record a complete line received from a client
+ *
+ * \param capture: the recorder
+ * \param fd: the socket of the client
+ * \param len: the length of the line
+ */
+void capture_line(struct capture_t *capture, int fd, size_t len);
+
+/**
+ * \brief Record the end of a connection
+ *
+ * \param capture: the recorder
+ * \param fd: the socket of the client
+ */
+void capture_disconnect(struct capture_t *capture, int fd);
+
+#endif /* CAPTURE_H_ */
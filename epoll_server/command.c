@@ -0,0 +1,362 @@
+#include "command.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "epoll-server.h"
+
+/**
+ * \brief Handler of a command
+ *
+ * \param server: the server state
+ * \param fd: the socket of the sender
+ * \param args: what follows the command and its space, without the '\n'
+ * \param len: the length of args
+ */
+typedef void (*command_fn)(struct server_t *server, int fd, const char *args,
+                           size_t len);
+
+static void notice(struct server_t *server, int fd, const char *text)
+{
+    send_direct(server, fd, message_new(text, strlen(text)));
+}
+
+static void nick(struct server_t *server, int fd, const char *args,
+                 size_t len)
+{
+    char buf[NICK_MAX + 64];
+    if (!nick_valid(args, len))
+    {
+        notice(server, fd,
+               "* A nick has up to 32 letters, digits, '-' or '_'\n");
+        return;
+    }
+    /* a change of case renames the entry in place, keep the old name */
+    char old[NICK_MAX + 1] = "";
+    const char *current = nick_of(&server->nicks, fd);
+    if (current != NULL)
+        strcpy(old, current);
+    if (nick_set(&server->nicks, fd, args, len) == -1)
+    {
+        snprintf(buf, sizeof(buf), "* Nick %.*s is taken\n", (int)len, args);
+        notice(server, fd, buf);
+        return;
+    }
+    if (strlen(old) != len || memcmp(old, args, len) != 0)
+    {
+        if (old[0] != '\0')
+            presence_leave(&server->presence, old);
+        presence_join(&server->presence, nick_of(&server->nicks, fd));
+    }
+    snprintf(buf, sizeof(buf), "* You are now known as %.*s\n", (int)len,
+             args);
+    notice(server, fd, buf);
+}
+
+static void msg(struct server_t *server, int fd, const char *args, size_t len)
+{
+    const char *from = nick_of(&server->nicks, fd);
+    if (from == NULL)
+    {
+        notice(server, fd, "* Set a nick with /nick first\n");
+        return;
+    }
+    const char *space = memchr(args, ' ', len);
+    if (space == NULL || space == args || space + 1 == args + len)
+    {
+        notice(server, fd, "* Usage: /msg nick text\n");
+        return;
+    }
+    size_t to_len = space - args;
+    int to = nick_find(&server->nicks, args, to_len);
+    if (to == -1)
+    {
+        char buf[NICK_MAX + 64];
+        snprintf(buf, sizeof(buf), "* No such nick %.*s\n",
+                 (int)(to_len > NICK_MAX ? NICK_MAX : to_len), args);
+        notice(server, fd, buf);
+        return;
+    }
+
+    /* the text goes through the plugins and the filter like a broadcast */
+    const char *text = space + 1;
+    size_t text_len = args + len - text;
+    struct message_t *body = message_new(NULL, text_len + 1);
+    memcpy(body->data, text, text_len);
+    body->data[text_len] = '\n';
+    if (server->executor.nb_hooks != 0)
+        body = executor_run(&server->executor, fd, body);
+    if (body == NULL)
+        return;
+
+    size_t from_len = strlen(from);
+    struct message_t *direct = message_new(NULL, from_len + 3 + body->len);
+    char *out = direct->data;
+    *out++ = '*';
+    memcpy(out, from, from_len);
+    out += from_len;
+    *out++ = '*';
+    *out++ = ' ';
+    memcpy(out, body->data, body->len);
+    message_unref(body);
+    send_direct(server, to, direct);
+}
+
+static void session(struct server_t *server, int fd, const char *args,
+                    size_t len)
+{
+    (void)args;
+    (void)len;
+    if (server->history.cap == 0)
+    {
+        notice(server, fd, "* Sessions are disabled\n");
+        return;
+    }
+    struct session_t *own = session_of(&server->sessions, fd);
+    if (own == NULL)
+        own = session_open(&server->sessions, fd, NULL);
+    if (own == NULL)
+    {
+        notice(server, fd, "* Too many sessions, try again later\n");
+        return;
+    }
+    sequence_client(server, fd, server->history.count);
+
+    char token[2 * SESSION_TOKEN + 1];
+    char buf[2 * SESSION_TOKEN + 64];
+    session_token(own, token);
+    snprintf(buf, sizeof(buf), "* Session %s %llu\n", token,
+             (unsigned long long)server->history.seq);
+    notice(server, fd, buf);
+}
+
+static void resume(struct server_t *server, int fd, const char *args,
+                   size_t len)
+{
+    if (server->history.cap == 0)
+    {
+        notice(server, fd, "* Sessions are disabled\n");
+        return;
+    }
+    const char *space = memchr(args, ' ', len);
+    char digits[24];
+    size_t digits_len = space ? (size_t)(args + len - space - 1) : 0;
+    if (space == NULL || digits_len == 0 || digits_len >= sizeof(digits))
+    {
+        notice(server, fd, "* Usage: /resume token seq\n");
+        return;
+    }
+    memcpy(digits, space + 1, digits_len);
+    digits[digits_len] = '\0';
+    char *end = NULL;
+    unsigned long long last = strtoull(digits, &end, 10);
+    if (*end != '\0' || digits[0] < '0' || digits[0] > '9')
+    {
+        notice(server, fd, "* Usage: /resume token seq\n");
+        return;
+    }
+
+    session_expire(&server->sessions, time(NULL));
+    struct session_t *found =
+        session_find(&server->sessions, args, space - args);
+    if (found == NULL)
+    {
+        notice(server, fd, "* No such session\n");
+        return;
+    }
+    struct session_t *own = session_of(&server->sessions, fd);
+    if (own != NULL && own != found)
+        session_detach(&server->sessions, fd, nick_of(&server->nicks, fd),
+                       time(NULL));
+    /* the previous connection of the client may not have timed out yet */
+    const char *held = found->fd != -1 && found->fd != fd
+        ? nick_of(&server->nicks, found->fd)
+        : NULL;
+    if (held != NULL)
+    {
+        strcpy(found->nick, held);
+        presence_leave(&server->presence, found->nick);
+        nick_remove(&server->nicks, found->fd);
+    }
+    session_attach(&server->sessions, found, fd);
+
+    char buf[NICK_MAX + 64];
+    size_t nick_len = strlen(found->nick);
+    if (nick_len != 0 && nick_of(&server->nicks, fd) == NULL)
+    {
+        if (nick_set(&server->nicks, fd, found->nick, nick_len) == -1)
+        {
+            snprintf(buf, sizeof(buf), "* Nick %s is taken\n", found->nick);
+            notice(server, fd, buf);
+        }
+        else
+            presence_join(&server->presence, found->nick);
+        found->nick[0] = '\0';
+    }
+
+    /* past the history, the client has to fetch the whole state again */
+    long from = history_find(&server->history, last);
+    if (from == -1)
+    {
+        sequence_client(server, fd, server->history.count);
+        snprintf(buf, sizeof(buf), "* Resync %llu\n",
+                 (unsigned long long)server->history.seq);
+        server->metrics.sessions_resynced++;
+    }
+    else
+    {
+        sequence_client(server, fd, from);
+        snprintf(buf, sizeof(buf), "* Resumed %llu\n",
+                 (unsigned long long)server->history.seq);
+        server->metrics.sessions_resumed++;
+    }
+    notice(server, fd, buf);
+}
+
+static int parse_seq(const char *args, size_t len, uint64_t *seq)
+{
+    char digits[24];
+    if (len == 0 || len >= sizeof(digits) || args[0] < '0' || args[0] > '9')
+        return -1;
+    memcpy(digits, args, len);
+    digits[len] = '\0';
+    char *end = NULL;
+    *seq = strtoull(digits, &end, 10);
+    return *end == '\0' ? 0 : -1;
+}
+
+/* the missed datagrams of a multicast subscriber, as sequenced lines */
+static void gapfill(struct server_t *server, int fd, const char *args,
+                    size_t len)
+{
+    if (server->history.cap == 0)
+    {
+        notice(server, fd, "* History is disabled\n");
+        return;
+    }
+    const char *space = memchr(args, ' ', len);
+    uint64_t from = 0;
+    uint64_t to = 0;
+    if (space == NULL || parse_seq(args, space - args, &from) == -1
+        || parse_seq(space + 1, args + len - space - 1, &to) == -1
+        || from > to)
+    {
+        notice(server, fd, "* Usage: /gapfill from to\n");
+        return;
+    }
+
+    char buf[64];
+    struct history_t *history = &server->history;
+    if (to - from >= GAPFILL_MAX)
+        to = from + GAPFILL_MAX - 1;
+    if (to > history->seq)
+        to = history->seq;
+    size_t end = 0;
+    long first = from <= to ? history_range(history, from, to, &end) : -1;
+    if (first == -1)
+    {
+        snprintf(buf, sizeof(buf), "* Resync %llu\n",
+                 (unsigned long long)history->seq);
+        notice(server, fd, buf);
+        return;
+    }
+
+    /* one message, so that the lines are not split by the broadcasts */
+    int notice_len = snprintf(
+        buf, sizeof(buf), "* Gapfill %llu %llu\n",
+        (unsigned long long)history_at(history, first)->seq,
+        (unsigned long long)history_at(history, end - 1)->seq);
+    char prefix[HISTORY_PREFIX];
+    size_t total = notice_len;
+    for (size_t pos = first; pos < end; pos++)
+    {
+        const struct history_entry_t *entry = history_at(history, pos);
+        total += history_prefix(entry, prefix) + entry->msg->len;
+    }
+    struct message_t *reply = message_new(NULL, total);
+    char *out = reply->data;
+    for (size_t pos = first; pos < end; pos++)
+    {
+        const struct history_entry_t *entry = history_at(history, pos);
+        size_t prefix_len = history_prefix(entry, prefix);
+        memcpy(out, prefix, prefix_len);
+        out += prefix_len;
+        memcpy(out, entry->msg->data, entry->msg->len);
+        out += entry->msg->len;
+    }
+    memcpy(out, buf, notice_len);
+    send_direct(server, fd, reply);
+    server->metrics.gapfills++;
+    server->metrics.gapfill_lines += end - first;
+}
+
+/* the list of the users, "on" to follow their joins and leaves after it */
+static void who(struct server_t *server, int fd, const char *args,
+                size_t len)
+{
+    if (len == 3 && memcmp(args, "off", 3) == 0)
+    {
+        presence_unsubscribe(&server->presence, fd);
+        notice(server, fd, "* Presence off\n");
+        return;
+    }
+    int follow = len == 2 && memcmp(args, "on", 2) == 0;
+    if (len != 0 && !follow)
+    {
+        notice(server, fd, "* Usage: /who [on|off]\n");
+        return;
+    }
+    send_direct(server, fd,
+                presence_snapshot(&server->presence, &server->nicks));
+    if (follow)
+        presence_subscribe(&server->presence, fd);
+}
+
+static const struct
+{
+    const char *name;
+    command_fn run;
+} commands[] = {
+    { "nick", nick },
+    { "msg", msg },
+    { "session", session },
+    { "resume", resume },
+    { "gapfill", gapfill },
+    { "who", who },
+};
+
+int command_run(struct server_t *server, int fd, const char *line,
+                size_t len)
+{
+    /* neither is the '\n' part of the arguments, nor the '\r' before it */
+    len--;
+    if (len != 0 && line[len - 1] == '\r')
+        len--;
+    size_t name_len = 0;
+    while (1 + name_len < len && line[1 + name_len] >= 'a'
+           && line[1 + name_len] <= 'z')
+        name_len++;
+    if (name_len == 0 || (1 + name_len < len && line[1 + name_len] != ' '))
+        return 0;
+
+    const char *args = line + 1 + name_len;
+    size_t args_len = len - 1 - name_len;
+    if (args_len != 0)
+    {
+        args++;
+        args_len--;
+    }
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        if (strlen(commands[i].name) == name_len
+            && memcmp(commands[i].name, line + 1, name_len) == 0)
+        {
+            commands[i].run(server, fd, args, args_len);
+            return 1;
+        }
+    }
+    /* like "/shrug", an unknown command is an ordinary line */
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef COMMAND_H_
+#define COMMAND_H_
+
+#include <stddef.h>
+
+struct server_t;
+
+/**
+ * \brief Run the command of a line starting with '/'
+ *
+ * \param server: the server state
+ * \param fd: the socket of the sender
+ * \param line: the line, ending with '\n'
+ * \param len: the length of line
+ *
+ * \return 1 if the line was a command, 0 if it must be broadcast
+ *
+ * A command is a '/' followed by the lowercase name of a known command, then
+ * a space or the end of the line, a "\r\n" end included. Other lines, unknown
+ * commands among them, are broadcast. The answers go to the sender alone
+ * through send_direct().
+ */
+int command_run(struct server_t *server, int fd, const char *line,
+                size_t len);
+
+#endif /* COMMAND_H_ */
@@ -0,0 +1,288 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "executor.h"
+#include "history.h"
+#include "pipeline.h"
+
+static int parse_size(const char *arg, size_t *res)
+{
+    char *end = NULL;
+    unsigned long long val = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0')
+        return -1;
+    *res = val;
+    return 0;
+}
+
+static int parse_rate(const char *arg, struct rate_t *rate)
+{
+    char *end = NULL;
+    unsigned long long lines = strtoull(arg, &end, 10);
+    if (end == arg || *end != ':')
+        return -1;
+    if (parse_size(end + 1, &rate->bytes) == -1 || lines > MAX_RATE
+        || rate->bytes > MAX_RATE)
+        return -1;
+    rate->lines = lines;
+    return 0;
+}
+
+void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage : %s [options] ip_address port\n"
+            "        %s [options] ip:port...\n"
+            "  every address an ip resolves to is listened on, * for all\n"
+            "  -i id         origin id in the federation, random by default\n"
+            "  -L ip:port    accept peer links on this address\n"
+            "  -P ip:port    dial a peer link (repeatable)\n"
+            "  -B bytes      pending bytes per peer link before pushing back\n"
+            "  -b usecs      spin on epoll_wait and set SO_BUSY_POLL\n"
+            "  -z bytes      send messages this large with MSG_ZEROCOPY\n"
+            "  -m bytes      truncate longer lines\n"
+            "  -c bytes      forward partial lines this long as they arrive\n"
+            "  -r l:b        lines:bytes per second read from a client\n"
+            "  -R l:b        lines:bytes per second read from the clients of an "
+            "IP\n"
+            "  -q backlog    listen(2) backlog, SOMAXCONN by default\n"
+            "  -a count      connections accepted per loop iteration\n"
+            "  -o l:b        lines:bytes read from a client per loop "
+            "iteration\n"
+            "  -C count      refuse connections above this number\n"
+            "  -I count      refuse connections of an IP above this number\n"
+            "  -U path       take over from the server listening on this Unix "
+            "socket,\n"
+            "                then listen on it for the next upgrade\n"
+            "  -T threads    fan messages out on this many threads\n"
+            "  -W threads    run the plugins on this many threads\n"
+            "  -X plugin     transform the lines with a plugin (repeatable)\n"
+            "  -F path       filter the lines with the terms of this file,\n"
+            "                reloaded on SIGHUP\n"
+            "  -H lines      broadcasts kept for /resume, 0 disables sessions\n"
+            "  -w ip:port    accept WebSocket clients on these addresses\n"
+            "  -S path       serve TLS with this PEM certificate chain\n"
+            "  -K path       PEM private key of -S, the -S file by default\n"
+            "  -M group:port publish the broadcasts on this multicast group\n"
+            "  -G ifname     interface of the multicast group\n"
+            "  -E path       record the traffic to this capture file\n"
+            "  -e bytes      bytes of the capture ring (default 64 MiB)\n",
+            name, name);
+}
+
+int parse_config(struct config_t *cfg, int argc, char **argv)
+{
+    memset(cfg, 0, sizeof(struct config_t));
+    cfg->link_buffer = DEFAULT_LINK_BUFFER;
+    cfg->max_line = DEFAULT_MAX_LINE;
+    cfg->backlog = SOMAXCONN;
+    cfg->accept_budget = DEFAULT_ACCEPT_BUDGET;
+    cfg->read_budget.lines = DEFAULT_READ_LINES;
+    cfg->read_budget.bytes = DEFAULT_READ_BYTES;
+    cfg->history_lines = DEFAULT_HISTORY_LINES;
+    cfg->capture_size = DEFAULT_CAPTURE_SIZE;
+
+    int opt = 0;
+    size_t val = 0;
+    while ((opt = getopt(argc, argv,
+                         "i:L:P:B:b:z:m:c:r:R:q:a:C:I:U:T:W:X:F:H:w:S:K:M:G:"
+                         "E:e:o:"))
+           != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            if (parse_size(optarg, &val) == -1 || val == 0 || val > UINT32_MAX)
+                return -1;
+            cfg->origin_id = val;
+            break;
+        case 'L':
+            cfg->peer_listen = optarg;
+            break;
+        case 'P':
+            if (cfg->nb_peers == MAX_PEERS)
+                return -1;
+            cfg->peers[cfg->nb_peers++] = optarg;
+            break;
+        case 'B':
+            if (parse_size(optarg, &cfg->link_buffer) == -1)
+                return -1;
+            break;
+        case 'b':
+            if (parse_size(optarg, &val) == -1 || val > 1000000)
+                return -1;
+            cfg->busy_poll = val;
+            break;
+        case 'z':
+            if (parse_size(optarg, &cfg->zerocopy_threshold) == -1)
+                return -1;
+            break;
+        case 'm':
+            if (parse_size(optarg, &cfg->max_line) == -1 || cfg->max_line == 0
+                || cfg->max_line > DEFAULT_MAX_LINE)
+                return -1;
+            break;
+        case 'c':
+            if (parse_size(optarg, &cfg->cut_through) == -1)
+                return -1;
+            break;
+        case 'r':
+            if (parse_rate(optarg, &cfg->client_rate) == -1)
+                return -1;
+            break;
+        case 'R':
+            if (parse_rate(optarg, &cfg->ip_rate) == -1)
+                return -1;
+            break;
+        case 'q':
+            if (parse_size(optarg, &val) == -1 || val == 0 || val > INT32_MAX)
+                return -1;
+            cfg->backlog = val;
+            break;
+        case 'a':
+            if (parse_size(optarg, &cfg->accept_budget) == -1
+                || cfg->accept_budget == 0)
+                return -1;
+            break;
+        case 'o':
+            /* no line limit at 0, but the bytes bound every round */
+            if (parse_rate(optarg, &cfg->read_budget) == -1
+                || cfg->read_budget.bytes == 0)
+                return -1;
+            break;
+        case 'C':
+            if (parse_size(optarg, &cfg->max_clients) == -1)
+                return -1;
+            break;
+        case 'I':
+            if (parse_size(optarg, &cfg->max_per_ip) == -1)
+                return -1;
+            break;
+        case 'U':
+            cfg->upgrade_path = optarg;
+            break;
+        case 'T':
+            if (parse_size(optarg, &cfg->broadcasters) == -1
+                || cfg->broadcasters > PIPELINE_MAX_STAGES)
+                return -1;
+            break;
+        case 'W':
+            if (parse_size(optarg, &cfg->workers) == -1
+                || cfg->workers > EXECUTOR_MAX_WORKERS)
+                return -1;
+            break;
+        case 'X':
+            if (cfg->nb_plugins == MAX_PLUGINS)
+                return -1;
+            cfg->plugins[cfg->nb_plugins++] = optarg;
+            break;
+        case 'F':
+            cfg->filter_path = optarg;
+            break;
+        case 'H':
+            if (parse_size(optarg, &cfg->history_lines) == -1)
+                return -1;
+            break;
+        case 'w':
+            cfg->ws_listen = optarg;
+            break;
+        case 'S':
+            cfg->tls_cert = optarg;
+            break;
+        case 'K':
+            cfg->tls_key = optarg;
+            break;
+        case 'M':
+            cfg->mcast_group = optarg;
+            break;
+        case 'G':
+            cfg->mcast_if = optarg;
+            break;
+        case 'E':
+            cfg->capture_path = optarg;
+            break;
+        case 'e':
+            if (parse_size(optarg, &cfg->capture_size) == -1
+                || cfg->capture_size < sizeof(struct capture_record_t))
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    /* the broadcasters own the output queues a handover would need */
+    if (cfg->broadcasters != 0 && cfg->upgrade_path != NULL)
+        return -1;
+    /* nor do they frame the messages of the WebSocket clients */
+    if (cfg->broadcasters != 0 && cfg->ws_listen != NULL)
+        return -1;
+    /* nor do they hold the TLS sessions the kernel did not take */
+    if (cfg->broadcasters != 0 && cfg->tls_cert != NULL)
+        return -1;
+    if (cfg->tls_key != NULL && cfg->tls_cert == NULL)
+        return -1;
+    if (cfg->tls_key == NULL)
+        cfg->tls_key = cfg->tls_cert;
+    /* the datagrams are numbered and filled again from the history */
+    if (cfg->mcast_group != NULL && cfg->history_lines == 0)
+        return -1;
+    if (cfg->mcast_if != NULL && cfg->mcast_group == NULL)
+        return -1;
+    if (cfg->capture_size != DEFAULT_CAPTURE_SIZE && cfg->capture_path == NULL)
+        return -1;
+    /* not the pid, every server of a container fleet may be pid 1 */
+    while (cfg->origin_id == 0)
+    {
+        if (getrandom(&cfg->origin_id, sizeof(uint32_t), 0)
+            != sizeof(uint32_t))
+            errx(1, "cannot draw an origin id");
+    }
+    /* the historical "ip port", or addresses carrying their port */
+    if (argc - optind == 2 && strchr(argv[optind + 1], ':') == NULL)
+    {
+        cfg->ip = argv[optind];
+        cfg->port = argv[optind + 1];
+        return 0;
+    }
+    if (argc == optind || argc - optind > MAX_LISTEN)
+        return -1;
+    for (int i = optind; i < argc; i++)
+    {
+        if (strchr(argv[i], ':') == NULL)
+            return -1;
+        cfg->listen[cfg->nb_listen++] = argv[i];
+    }
+    return 0;
+}
+
+int split_host_port(const char *spec, char *host, size_t host_size,
+                    char *port, size_t port_size)
+{
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon[1] == '\0')
+        return -1;
+
+    const char *begin = spec;
+    size_t len = colon - spec;
+    if (len >= 2 && begin[0] == '[' && begin[len - 1] == ']')
+    {
+        begin++;
+        len -= 2;
+    }
+    if (len >= host_size || strlen(colon + 1) >= port_size)
+        return -1;
+
+    memcpy(host, begin, len);
+    host[len] = '\0';
+    strcpy(port, colon + 1);
+    return 0;
+}
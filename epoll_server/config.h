@@ -0,0 +1,174 @@
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief Maximum number of peer links given with -P
+ */
+#define MAX_PEERS 16
+
+/**
+ * \brief Maximum number of ip:port arguments
+ */
+#define MAX_LISTEN 8
+
+/**
+ * \brief Maximum number of plugins given with -X
+ */
+#define MAX_PLUGINS 8
+
+/**
+ * \brief Size of the buffers receiving the parts of an "ip:port" string
+ */
+#define HOST_SIZE 256
+#define PORT_SIZE 32
+
+/**
+ * \brief Default size in bytes of the pending output of a peer link
+ */
+#define DEFAULT_LINK_BUFFER (4 * 1024 * 1024)
+
+/**
+ * \brief Longest line accepted when -m is not given
+ */
+#define DEFAULT_MAX_LINE (UINT32_MAX - 1)
+
+/**
+ * \brief Connections accepted per loop iteration when -a is not given
+ */
+#define DEFAULT_ACCEPT_BUDGET 64
+
+/**
+ * \brief What a connection reads per loop iteration when -o is not given
+ */
+#define DEFAULT_READ_LINES 64
+#define DEFAULT_READ_BYTES (64 * 1024)
+
+/**
+ * \brief Highest rate accepted by -r and -R
+ */
+#define MAX_RATE 1000000000000ULL
+
+/**
+ * \brief Token bucket rates, a zero rate is not limited
+ */
+struct rate_t
+{
+    size_t lines; /**< lines per second */
+
+    size_t bytes; /**< bytes per second */
+};
+
+/**
+ * \brief Contain the runtime options of the server
+ */
+struct config_t
+{
+    const char *ip; /**< address of the "ip port" form, or NULL */
+
+    const char *port; /**< port of the "ip port" form */
+
+    const char *listen[MAX_LISTEN]; /**< ip:port of the chat listeners */
+
+    size_t nb_listen; /**< number of elements in listen */
+
+    uint32_t origin_id; /**< id of this server in the federation, never 0 */
+
+    const char *peer_listen; /**< ip:port accepting peer links, or NULL */
+
+    const char *peers[MAX_PEERS]; /**< ip:port of the peers to dial */
+
+    size_t nb_peers; /**< number of elements in peers */
+
+    size_t link_buffer; /**< pending bytes after which a link pushes back */
+
+    long busy_poll; /**< busy poll budget in microseconds, 0 to disable */
+
+    size_t zerocopy_threshold; /**< smallest MSG_ZEROCOPY message, 0 never */
+
+    size_t max_line; /**< longest line, the rest of longer lines is dropped */
+
+    size_t cut_through; /**< partial line forwarded as it arrives, 0 never */
+
+    struct rate_t client_rate; /**< read rate of every connection */
+
+    struct rate_t ip_rate; /**< read rate of all the connections of an IP */
+
+    int backlog; /**< listen(2) backlog of the listeners */
+
+    size_t accept_budget; /**< connections accepted per loop iteration */
+
+    struct rate_t read_budget; /**< read from a connection per iteration */
+
+    size_t max_clients; /**< connections refused above this, 0 no limit */
+
+    size_t max_per_ip; /**< connections of an address, 0 no limit */
+
+    const char *upgrade_path; /**< Unix socket of the hot upgrades, or NULL */
+
+    size_t broadcasters; /**< fan-out threads, 0 to fan out in the loop */
+
+    size_t workers; /**< threads running the plugins, 0 to run them inline */
+
+    const char *plugins[MAX_PLUGINS]; /**< names of the plugins, in order */
+
+    size_t nb_plugins; /**< number of plugins */
+
+    const char *filter_path; /**< banned terms file, or NULL */
+
+    size_t history_lines; /**< broadcasts kept for resumes, 0 no sessions */
+
+    const char *ws_listen; /**< ip:port of the WebSocket listener, or NULL */
+
+    const char *tls_cert; /**< certificate chain of the listeners, or NULL */
+
+    const char *tls_key; /**< private key, tls_cert if not given */
+
+    const char *mcast_group; /**< group:port the broadcasts go to, or NULL */
+
+    const char *mcast_if; /**< interface of the multicast group, or NULL */
+
+    const char *capture_path; /**< file the traffic is recorded to, or NULL */
+
+    size_t capture_size; /**< bytes of the capture ring */
+};
+
+/**
+ * \brief Parse the command line into a config_t
+ *
+ * \param cfg: the config_t to fill
+ * \param argc: argument count given to main()
+ * \param argv: argument vector given to main()
+ *
+ * \return 0 on success, -1 if the command line is invalid
+ *
+ * Options are parsed with getopt(3), the remaining arguments are up to
+ * MAX_LISTEN "host:port" addresses of the chat listeners. The two argument
+ * form "ip port" of a single listener is kept for compatibility.
+ */
+int parse_config(struct config_t *cfg, int argc, char **argv);
+
+/**
+ * \brief Print the usage of the server on stderr
+ *
+ * \param name: the program name
+ */
+void print_usage(const char *name);
+
+/**
+ * \brief Split an "ip:port" string in two
+ *
+ * \param spec: the string to split, IPv6 addresses may be written [addr]:port
+ * \param host: buffer receiving the address
+ * \param host_size: size of host
+ * \param port: buffer receiving the port
+ * \param port_size: size of port
+ *
+ * \return 0 on success, -1 if spec has no port or does not fit the buffers
+ */
+int split_host_port(const char *spec, char *host, size_t host_size,
+                    char *port, size_t port_size);
+
+#endif /* CONFIG_H_ */
@@ -1,61 +1,276 @@
 #include "connection.h"
 
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "tls.h"
+#include "trace.h"
+#include "transport.h"
 #include "utils/xalloc.h"
+#include "zerocopy.h"
 
-struct connection_t *add_client(struct connection_t *connection,
+#ifndef IOV_MAX
+#    define IOV_MAX 1024
+#endif /* !IOV_MAX */
+
+void init_clients(struct client_table_t *table)
+{
+    memset(table, 0, sizeof(struct client_table_t));
+    table->transport = &socket_transport;
+    pool_init(&table->connections, sizeof(struct connection_t),
+              CONNECTION_SLAB, 0, MEM_CONNECTIONS);
+    pool_init(&table->buffers, INPUT_CHUNK, 1, POOL_MAX_FREE, MEM_INPUT);
+    pool_init(&table->queues, sizeof(struct outq_t), 1, POOL_MAX_FREE,
+              MEM_OUTPUT);
+}
+
+struct connection_t *add_client(struct client_table_t *table,
                                 int client_socket)
 {
-    struct connection_t *new_connection = xmalloc(sizeof(struct connection_t));
+    if ((size_t)client_socket >= table->by_fd_cap)
+    {
+        size_t cap = table->by_fd_cap ? table->by_fd_cap : 64;
+        while (cap <= (size_t)client_socket)
+            cap *= 2;
+        table->by_fd = xrealloc_tag(MEM_CONNECTIONS, table->by_fd,
+                                    cap * sizeof(struct connection_t *));
+        memset(table->by_fd + table->by_fd_cap, 0,
+               (cap - table->by_fd_cap) * sizeof(struct connection_t *));
+        table->by_fd_cap = cap;
+    }
+    if (table->count == table->cap)
+    {
+        table->cap = table->cap ? table->cap * 2 : 64;
+        table->all = xrealloc_tag(MEM_CONNECTIONS, table->all,
+                                  table->cap * sizeof(struct connection_t *));
+    }
 
+    struct connection_t *new_connection = pool_get(&table->connections);
+    memset(new_connection, 0, sizeof(struct connection_t));
     new_connection->client_socket = client_socket;
-    new_connection->buffer = NULL;
-    new_connection->nb_read = 0;
-    new_connection->next = connection;
+    new_connection->index = table->count;
+
+    table->by_fd[client_socket] = new_connection;
+    table->all[table->count++] = new_connection;
 
     return new_connection;
 }
 
-struct connection_t *remove_client(struct connection_t *connection,
-                                   int client_socket)
+void remove_client(struct client_table_t *table,
+                   struct connection_t *connection)
+{
+    if (table->transport->close(table->transport->ctx,
+                                connection->client_socket)
+        == -1)
+        errx(1, "Failed to close socket");
+    detach_client(table, connection);
+}
+
+void detach_client(struct client_table_t *table,
+                   struct connection_t *connection)
 {
-    if (connection && connection->client_socket == client_socket)
+    drop_output(table, connection);
+    release_input(table, connection);
+
+    struct connection_t *last = table->all[--table->count];
+    table->all[connection->index] = last;
+    last->index = connection->index;
+    table->by_fd[connection->client_socket] = NULL;
+    pool_put(&table->connections, connection);
+}
+
+struct connection_t *find_client(const struct client_table_t *table,
+                                 int client_socket)
+{
+    if (client_socket < 0 || (size_t)client_socket >= table->by_fd_cap)
+        return NULL;
+
+    return table->by_fd[client_socket];
+}
+
+static size_t input_capacity(size_t len)
+{
+    if (len <= INPUT_CHUNK)
+        return INPUT_CHUNK;
+    size_t cap = INPUT_CHUNK;
+    while (cap < len)
+        cap *= 2;
+    return cap;
+}
+
+static void free_input(struct client_table_t *table, char *buffer, size_t len)
+{
+    if (len <= INPUT_CHUNK)
+        pool_put(&table->buffers, buffer);
+    else
+        xfree_tag(MEM_INPUT, buffer);
+}
+
+void save_data(struct client_table_t *table, struct connection_t *connection,
+               const char *data, size_t len)
+{
+    size_t needed = connection->nb_read + len;
+    size_t cap = connection->buffer ? input_capacity(connection->nb_read) : 0;
+    if (needed > cap)
     {
-        struct connection_t *client_connection = connection->next;
-        if (close(connection->client_socket) == -1)
-            errx(1, "Failed to close socket");
-        free(connection->buffer);
-        free(connection);
-        return client_connection;
+        char *bigger = needed <= INPUT_CHUNK
+            ? pool_get(&table->buffers)
+            : xmalloc_tag(MEM_INPUT, input_capacity(needed));
+        if (connection->buffer != NULL)
+        {
+            memcpy(bigger, connection->buffer, connection->nb_read);
+            free_input(table, connection->buffer, connection->nb_read);
+        }
+        connection->buffer = bigger;
     }
 
-    struct connection_t *tmp = connection;
-    while (tmp->next)
+    memcpy(connection->buffer + connection->nb_read, data, len);
+    connection->nb_read = needed;
+}
+
+void release_input(struct client_table_t *table,
+                   struct connection_t *connection)
+{
+    if (connection->buffer == NULL)
+        return;
+    free_input(table, connection->buffer, connection->nb_read);
+    connection->buffer = NULL;
+    connection->nb_read = 0;
+}
+
+void queue_message(struct client_table_t *table,
+                   struct connection_t *connection, struct message_t *msg)
+{
+    struct outq_t *out = connection->out;
+    if (out == NULL)
+    {
+        out = pool_get(&table->queues);
+        memset(out, 0, sizeof(struct outq_t));
+        out->ring = out->slots;
+        out->cap = OUTQ_INLINE;
+        connection->out = out;
+    }
+    if (out->count == out->cap)
+    {
+        struct message_t **ring = xmalloc_tag(
+            MEM_OUTPUT, out->cap * 2 * sizeof(struct message_t *));
+        for (size_t i = 0; i < out->count; i++)
+            ring[i] = out->ring[(out->first + i) % out->cap];
+        if (out->ring != out->slots)
+            xfree_tag(MEM_OUTPUT, out->ring);
+        out->ring = ring;
+        out->cap *= 2;
+        out->first = 0;
+    }
+
+    out->ring[(out->first + out->count) % out->cap] = message_ref(msg);
+    out->count++;
+    out->bytes += msg->len;
+    TRACE4(enqueue, connection->client_socket, msg->len, out->bytes,
+           out->count);
+}
+
+static void pop_message(struct outq_t *out)
+{
+    struct message_t *msg = out->ring[out->first];
+    out->bytes -= msg->len - out->off;
+    out->off = 0;
+    out->first = (out->first + 1) % out->cap;
+    out->count--;
+    message_unref(msg);
+}
+
+void release_output(struct client_table_t *table,
+                    struct connection_t *connection)
+{
+    struct outq_t *out = connection->out;
+    if (out == NULL || out->count != 0 || out->pin_count != 0)
+        return;
+    if (out->ring != out->slots)
+        xfree_tag(MEM_OUTPUT, out->ring);
+    xfree_tag(MEM_OUTPUT, out->pins);
+    pool_put(&table->queues, out);
+    connection->out = NULL;
+}
+
+int flush_client(struct client_table_t *table, struct connection_t *connection)
+{
+    struct iovec iov[IOV_MAX];
+    struct outq_t *out = connection->out;
+    while (out != NULL && out->count != 0)
     {
-        if (tmp->next->client_socket == client_socket)
+        ssize_t w = 0;
+        struct message_t *head = out->ring[out->first];
+        if (zerocopy_eligible(table, connection, head))
+            w = zerocopy_send(table, connection, head, out->off);
+        else
+        {
+            size_t nb = 0;
+            while (nb < out->count && nb < IOV_MAX)
+            {
+                struct message_t *msg =
+                    out->ring[(out->first + nb) % out->cap];
+                if (nb != 0 && zerocopy_eligible(table, connection, msg))
+                    break;
+                size_t off = nb == 0 ? out->off : 0;
+                iov[nb].iov_base = msg->data + off;
+                iov[nb].iov_len = msg->len - off;
+                nb++;
+            }
+            w = connection->tls_write
+                ? tls_send(table->tls, connection->client_socket, iov, nb)
+                : table->transport->writev(table->transport->ctx,
+                                           connection->client_socket, iov,
+                                           nb);
+        }
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (w == -1)
+            return -1;
+        TRACE4(flush, connection->client_socket, w, out->bytes - w,
+               trace_now());
+
+        size_t written = w;
+        while (written != 0)
         {
-            struct connection_t *client_connection = tmp->next;
-            tmp->next = client_connection->next;
-            if (close(client_connection->client_socket) == -1)
-                errx(1, "Failed to close socket");
-            free(client_connection->buffer);
-            free(client_connection);
-            break;
+            size_t left = out->ring[out->first]->len - out->off;
+            if (written < left)
+            {
+                out->off += written;
+                out->bytes -= written;
+                return 1;
+            }
+            written -= left;
+            pop_message(out);
         }
-        tmp = tmp->next;
     }
+    release_output(table, connection);
+    return 0;
+}
 
-    return connection;
+void drop_output(struct client_table_t *table, struct connection_t *connection)
+{
+    if (connection->out == NULL)
+        return;
+    while (connection->out->count != 0)
+        pop_message(connection->out);
+    zerocopy_drop(connection);
+    release_output(table, connection);
 }
 
-struct connection_t *find_client(struct connection_t *connection,
-                                 int client_socket)
+size_t pending_output(const struct connection_t *connection)
 {
-    while (connection != NULL && connection->client_socket != client_socket)
-        connection = connection->next;
+    return connection->out ? connection->out->bytes : 0;
+}
 
-    return connection;
+size_t idle_connection_size(void)
+{
+    return sizeof(struct connection_t) + 2 * sizeof(struct connection_t *);
 }
@@ -1,62 +1,308 @@
 #ifndef CONNECTION_H_
 #define CONNECTION_H_
 
+#include <stdint.h>
 #include <sys/types.h>
 
+#include "message.h"
+#include "pool.h"
+
+struct tls_t;
+struct transport_t;
+
+/**
+ * \brief Pending output after which a client is dropped as too slow
+ */
+#define MAX_PENDING_OUTPUT (16 * 1024 * 1024)
+
+/**
+ * \brief Size of the input buffers lent by the pool
+ *
+ * Longer partial lines move to a private allocation sized to the next power
+ * of two, the capacity is always derived from nb_read.
+ */
+#define INPUT_CHUNK 2048
+
 /**
- * \brief Contain all the information about all clients (linked list)
+ * \brief Messages an output queue holds before allocating a bigger ring
+ */
+#define OUTQ_INLINE 14
+
+/**
+ * \brief Free input buffers and output queues kept for reuse
+ */
+#define POOL_MAX_FREE 1024
+
+/**
+ * \brief Connections allocated at once
+ */
+#define CONNECTION_SLAB 256
+
+/**
+ * \brief Number of bits kept of the MSG_ZEROCOPY notification ids
+ */
+#define ZC_ID_BITS 18
+#define ZC_ID_MASK ((1u << ZC_ID_BITS) - 1)
+
+/**
+ * \brief Messages waiting to be written to a client
+ *
+ * Only lent to a connection while it has pending output or messages pinned
+ * by MSG_ZEROCOPY sends not yet completed by the kernel.
+ */
+struct outq_t
+{
+    uint32_t first; /**< index in ring of the oldest message */
+
+    uint32_t count; /**< number of messages in ring */
+
+    uint32_t cap; /**< length of ring */
+
+    uint32_t off; /**< bytes of the oldest message already sent */
+
+    size_t bytes; /**< total number of bytes waiting */
+
+    struct message_t **ring; /**< slots, or a bigger allocation once full */
+
+    struct message_t *slots[OUTQ_INLINE]; /**< inline ring */
+
+    struct message_t **pins; /**< messages of uncompleted zerocopy sends */
+
+    uint32_t pin_first; /**< index in pins of the oldest send */
+
+    uint32_t pin_count; /**< number of sends in pins, completed or not */
+
+    uint32_t pin_cap; /**< length of pins */
+
+    uint32_t pin_id; /**< notification id of pins[pin_first] */
+};
+
+/**
+ * \brief Contain the information about one client
+ *
+ * Kept small for mostly idle clients: the input buffer and the output queue
+ * are only lent by the pools while a partial line or pending output exists.
  */
 struct connection_t
 {
     int client_socket; /**< socket fd of the client */
 
-    char *buffer; /**< buffer containing all the data received by this client */
+    uint32_t index; /**< position in the dense array of the table */
+
+    uint32_t nb_read; /**< bytes of the partial line, in buffer or streamed */
+
+    unsigned paused : 1; /**< EPOLLIN removed while the peer links push back */
+
+    unsigned throttled : 1; /**< EPOLLIN removed until the buckets refill */
+
+    unsigned want_write : 1; /**< EPOLLOUT registered for pending output */
+
+    unsigned closing : 1; /**< socket shut down after a write error */
+
+    unsigned zerocopy : 1; /**< SO_ZEROCOPY enabled on the socket */
+
+    unsigned no_zerocopy : 1; /**< SO_ZEROCOPY refused, always copy */
+
+    unsigned streaming : 1; /**< the partial line is cut through, no buffer */
+
+    unsigned discarding : 1; /**< dropping the end of a truncated line */
+
+    unsigned sequenced : 1; /**< receives the lines prefixed with "@seq " */
+
+    unsigned websocket : 1; /**< speaks WebSocket, its output is framed */
+
+    unsigned handshaking : 1; /**< TLS handshake in progress, no output yet */
+
+    unsigned tls_read : 1; /**< input decrypted by OpenSSL, not the kernel */
+
+    unsigned tls_write : 1; /**< output encrypted by OpenSSL, not the kernel */
+
+    unsigned scheduled : 1; /**< in the read list of the next round */
+
+    unsigned zc_next : ZC_ID_BITS; /**< id of the next zerocopy send */
+
+    char *buffer; /**< partial line received from this client, or NULL */
+
+    struct outq_t *out; /**< pending output, or NULL */
+};
+
+/**
+ * \brief Contain all the clients
+ *
+ * Clients are found by socket fd in by_fd and iterated through the dense
+ * array all, an idle client costs its connection_t and two pointers.
+ */
+struct client_table_t
+{
+    struct connection_t **by_fd; /**< connection of every socket fd */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    struct connection_t **all; /**< the clients, without holes */
 
-    ssize_t nb_read; /**< number of bytes read (also size of the buffer) */
+    size_t count; /**< number of clients */
 
-    struct connection_t *next; /**< next connection_t for another client */
+    size_t cap; /**< length of all */
+
+    struct pool_t connections; /**< slabs of connection_t */
+
+    struct pool_t buffers; /**< INPUT_CHUNK input buffers */
+
+    struct pool_t queues; /**< output queues */
+
+    struct tls_t *tls; /**< sessions of the TLS clients, NULL without TLS */
+
+    const struct transport_t *transport; /**< socket calls, of the kernel */
+
+    size_t zerocopy_threshold; /**< smallest MSG_ZEROCOPY message, 0 never */
+
+    uint64_t zc_sends; /**< sendmsg(2) calls with MSG_ZEROCOPY */
+
+    uint64_t zc_bytes; /**< bytes sent with MSG_ZEROCOPY */
+
+    uint64_t zc_copied; /**< completions the kernel had to copy anyway */
+
+    uint64_t zc_fallbacks; /**< large messages sent by copy */
 };
 
 /**
- * \brief Add a new client connection_t to the linked list connection
+ * \brief Initialize an empty table
+ *
+ * \param table: the table
+ */
+void init_clients(struct client_table_t *table);
+
+/**
+ * \brief Add a new client to the table
  *
- * \param connection: the connection_t linked list with all the clients
+ * \param table: the table with all the clients
  *
  * \param client_socket: the client socket fd to add
  *
- * \return The connection_t linked list with the element added
- *
- * Add the new connection_t element with a head insert
+ * \return The connection_t of the new client
  */
-struct connection_t *add_client(struct connection_t *connection,
+struct connection_t *add_client(struct client_table_t *table,
                                 int client_socket);
 
 /**
- * \brief Remove the client connection_t from the linked list connection
+ * \brief Remove a client from the table without closing its socket
  *
- * \param connection: the connection_t linked list with all the clients
+ * \param table: the table with all the clients
  *
- * \param client_socket: the client socket fd to remove
+ * \param connection: the client to remove
  *
- * \return The connection_t linked list with element removed
+ * The last client of the dense array takes the place of the removed one.
+ */
+void detach_client(struct client_table_t *table,
+                   struct connection_t *connection);
+
+/**
+ * \brief Close the socket of a client and remove it from the table
+ *
+ * \param table: the table with all the clients
  *
- * Iterate over the linked list to find the right connection_t and remove it
+ * \param connection: the client to remove
  */
-struct connection_t *remove_client(struct connection_t *connection,
-                                   int client_socket);
+void remove_client(struct client_table_t *table,
+                   struct connection_t *connection);
+
 /**
- * \brief Find the connection_t element where the socket is equal to client sock
+ * \brief Find the connection_t of a socket
  *
- * \param connection: the connection_t linked list with all the clients
+ * \param table: the table with all the clients
  *
  * \param client_socket: the client socket to find
  *
- * \return The connection_t element of the specific client
- *
- * Iterate over the linked list until it finds the connection_t. If the client
- * is not in the linked list returns NULL
+ * \return The connection_t of the client, NULL if the socket is not a client
  */
-struct connection_t *find_client(struct connection_t *connection,
+struct connection_t *find_client(const struct client_table_t *table,
                                  int client_socket);
 
-#endif /* CONNECTION_H */
\ No newline at end of file
+/**
+ * \brief Append received bytes to the partial line of a client
+ *
+ * \param table: the table with all the clients
+ *
+ * \param connection: the client
+ *
+ * \param data: the received bytes
+ *
+ * \param len: the number of bytes
+ */
+void save_data(struct client_table_t *table, struct connection_t *connection,
+               const char *data, size_t len);
+
+/**
+ * \brief Forget the partial line of a client and give its buffer back
+ *
+ * \param table: the table with all the clients
+ *
+ * \param connection: the client
+ */
+void release_input(struct client_table_t *table,
+                   struct connection_t *connection);
+
+/**
+ * \brief Append a message to the output queue of a client
+ *
+ * \param table: the table with all the clients
+ *
+ * \param connection: the client
+ *
+ * \param msg: the message, a reference is taken on it
+ */
+void queue_message(struct client_table_t *table,
+                   struct connection_t *connection, struct message_t *msg);
+
+/**
+ * \brief Write as much of the output queue of a client as possible
+ *
+ * \param table: the table with all the clients
+ *
+ * \param connection: the client, its socket must be non blocking
+ *
+ * \return -1 on a write error, 1 if data is still pending, 0 otherwise
+ *
+ * The queued messages are written with writev(2), at most IOV_MAX of them per
+ * call, so a client receives everything queued during a loop iteration with a
+ * single system call. Messages of at least zerocopy_threshold bytes are sent
+ * alone with MSG_ZEROCOPY. The queue goes back to the pool once empty.
+ */
+int flush_client(struct client_table_t *table, struct connection_t *connection);
+
+/**
+ * \brief Give the output queue back to the pool if nothing uses it anymore
+ *
+ * \param table: the table with all the clients
+ *
+ * \param connection: the client
+ */
+void release_output(struct client_table_t *table,
+                    struct connection_t *connection);
+
+/**
+ * \brief Release every message of the output queue of a client
+ *
+ * \param table: the table with all the clients
+ *
+ * \param connection: the client
+ */
+void drop_output(struct client_table_t *table, struct connection_t *connection);
+
+/**
+ * \brief Number of bytes waiting in the output queue of a client
+ *
+ * \param connection: the client
+ *
+ * \return The number of bytes
+ */
+size_t pending_output(const struct connection_t *connection);
+
+/**
+ * \brief Memory held by a client with no partial line and no pending output
+ *
+ * \return The size of a connection_t and of its two table slots
+ */
+size_t idle_connection_size(void);
+
+#endif /* CONNECTION_H */
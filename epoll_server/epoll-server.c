@@ -3,12 +3,22 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "command.h"
+#include "plugin.h"
+#include "trace.h"
+#include "upgrade.h"
+#include "utils/xalloc.h"
+#include "zerocopy.h"
+
 int create_and_bind(struct addrinfo *addrinfo)
 {
     int sockfd = 0;
@@ -37,7 +47,7 @@ int create_and_bind(struct addrinfo *addrinfo)
     return sockfd;
 }
 
-int prepare_socket(const char *ip, const char *port)
+int prepare_socket(const char *ip, const char *port, int backlog)
 {
     struct addrinfo *addr = NULL;
     struct addrinfo hints;
@@ -51,119 +61,1153 @@ int prepare_socket(const char *ip, const char *port)
         errx(EXIT_FAILURE, "fail getting address");
 
     int sockfd = create_and_bind(addr);
-    if (listen(sockfd, 10) == -1)
+    if (listen(sockfd, backlog) == -1)
         errx(1, "cannot listen on this socket");
     return sockfd;
 }
 
-struct connection_t *accept_client(int epli, int serv_fd,
-                                   struct connection_t *connection)
+size_t prepare_sockets(const char *ip, const char *port, int backlog,
+                       int *socks, size_t max)
 {
-    int sfd_client = accept(serv_fd, NULL, NULL);
-    if (sfd_client == -1)
+    struct addrinfo *addr = NULL;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (strcmp(ip, "*") == 0)
+        ip = NULL;
+    if (getaddrinfo(ip, port, &hints, &addr) != 0)
+        errx(EXIT_FAILURE, "fail getting address");
+
+    size_t nb = 0;
+    for (struct addrinfo *cur = addr; cur != NULL; cur = cur->ai_next)
+    {
+        if (nb == max)
+            errx(1, "too many addresses to listen on");
+        int sockfd =
+            socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+        if (sockfd == -1)
+            continue;
+        int enable = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))
+                == -1
+            || (cur->ai_family == AF_INET6
+                && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &enable,
+                              sizeof(int))
+                    == -1))
+            errx(1, "set socketoption failed");
+        if (bind(sockfd, cur->ai_addr, cur->ai_addrlen) == -1
+            || listen(sockfd, backlog) == -1)
+        {
+            char host[HOST_SIZE];
+            getnameinfo(cur->ai_addr, cur->ai_addrlen, host, sizeof(host),
+                        NULL, 0, NI_NUMERICHOST);
+            fprintf(stderr, "Cannot listen on %s port %s: %s\n", host, port,
+                    strerror(errno));
+            close(sockfd);
+            continue;
+        }
+        socks[nb++] = sockfd;
+    }
+
+    freeaddrinfo(addr);
+    if (nb == 0)
+        errx(EXIT_FAILURE, "Couldn't listen on %s:%s", ip ? ip : "*", port);
+    return nb;
+}
+
+void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        errx(1, "cannot set socket non blocking");
+}
+
+static void refuse(int sock, const char *reason)
+{
+    if (reason != NULL)
+        send(sock, reason, strlen(reason), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sock);
+}
+
+/* a TLS client could not read the reason before its handshake */
+static const char *refusal(const struct server_t *server, int websocket,
+                           const char *reason)
+{
+    if (server->tls.ctx != NULL)
         return NULL;
+    return websocket ? WS_UNAVAILABLE : reason;
+}
+
+static int shed_connection(struct server_t *server, int listener)
+{
+    if (server->spare_fd == -1)
+        return 0;
+    close(server->spare_fd);
+    int sock = accept(listener, NULL, NULL);
+    if (sock != -1)
+        close(sock);
+    server->spare_fd = open("/dev/null", O_RDONLY);
+    return sock != -1;
+}
+
+int accept_client(struct server_t *server, const struct listener_t *listener)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int sfd_client =
+        accept(listener->sock, (struct sockaddr *)&addr, &addr_len);
+    if (sfd_client == -1)
+    {
+        if (errno == ECONNABORTED || errno == EPROTO || errno == EINTR)
+            return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        server->metrics.accept_errors++;
+        if (errno == EMFILE || errno == ENFILE)
+            return shed_connection(server, listener->sock);
+        return 0;
+    }
+
+    int websocket = listener->websocket;
+    if (server->cfg->max_clients != 0
+        && server->clients.count >= server->cfg->max_clients)
+    {
+        refuse(sfd_client,
+               refusal(server, websocket, "Server full, try again later\n"));
+        server->metrics.refused_full++;
+        return 1;
+    }
+    set_nonblocking(sfd_client);
+    poller_socket(&server->poller, sfd_client, &server->metrics);
+    if (admit_client(server, sfd_client, (struct sockaddr *)&addr, websocket)
+        == -1)
+    {
+        refuse(sfd_client,
+               refusal(server, websocket,
+                       "Too many connections from your address\n"));
+        server->metrics.refused_address++;
+        return 1;
+    }
+    TRACE3(accept, sfd_client, listener->sock, trace_now());
+    return 1;
+}
+
+int admit_client(struct server_t *server, int sfd_client,
+                 const struct sockaddr *addr, int websocket)
+{
+    if (limiter_add(&server->limiter, sfd_client, addr) == -1)
+        return -1;
+
     printf("Client connected\n");
-    connection = add_client(connection, sfd_client);
-    struct epoll_event evt;
-    evt.data.fd = sfd_client;
-    evt.events = EPOLLIN;
-    if (epoll_ctl(epli, EPOLL_CTL_ADD, sfd_client, &evt) == -1)
+    struct connection_t *cc = add_client(&server->clients, sfd_client);
+    if (server->capture.map != NULL)
+        capture_connect(&server->capture, sfd_client,
+                        websocket ? CAPTURE_WEBSOCKET : 0);
+    if (websocket)
+    {
+        cc->websocket = 1;
+        ws_add(&server->websockets, sfd_client);
+    }
+    if (server->tls.ctx != NULL)
+    {
+        /* the TLS ULP does not take MSG_ZEROCOPY sends */
+        tls_add(&server->tls, sfd_client);
+        cc->handshaking = 1;
+        cc->no_zerocopy = 1;
+    }
+    if (server->pipeline.nb_stages != 0)
+        pipeline_add(&server->pipeline, sfd_client);
+    server->metrics.clients++;
+    const struct transport_t *transport = server->clients.transport;
+    if (transport->ctl(transport->ctx, server->epoll_instance, EPOLL_CTL_ADD,
+                       sfd_client, EPOLLIN)
+        == -1)
         errx(1, "cannot add to epoll instancd client fd");
-    return connection;
+    return 0;
 }
 
-static void Networks(int sender_fd, struct connection_t *clients, int pass)
+static void update_events(struct server_t *server, struct connection_t *in)
 {
-    struct connection_t *in = find_client(clients, sender_fd);
-    if (in == NULL)
+    const struct transport_t *transport = server->clients.transport;
+    uint32_t events = in->paused || in->throttled ? 0 : EPOLLIN;
+    if (in->want_write)
+        events |= EPOLLOUT;
+    if (transport->ctl(transport->ctx, server->epoll_instance, EPOLL_CTL_MOD,
+                       in->client_socket, events)
+        == -1)
+        errx(1, "cannot modify client fd in epoll instance");
+    if (in->tls_read && (events & EPOLLIN))
+        tls_mark(&server->tls, in->client_socket);
+}
+
+static void send_pending(struct server_t *server, struct connection_t *cc)
+{
+    int res = flush_client(&server->clients, cc);
+    if (res == -1 || pending_output(cc) > MAX_PENDING_OUTPUT)
+    {
+        /* the next recv(2) returns 0 and goes through disconnect() */
+        server->clients.transport->shutdown(server->clients.transport->ctx,
+                                            cc->client_socket);
+        drop_output(&server->clients, cc);
+        cc->closing = 1;
+        res = 0;
+    }
+    if (res != cc->want_write)
+    {
+        cc->want_write = res;
+        update_events(server, cc);
+    }
+}
+
+/* the frames are built once for all the WebSocket clients */
+static void frame_batch(struct server_t *server)
+{
+    struct batch_t *batch = &server->batch;
+    struct batch_t *tagged = &server->tagged;
+    for (size_t i = 0; i < batch->len; i++)
+    {
+        struct message_t *msg = batch->items[i];
+        int first = !server->mid_line;
+        server->mid_line = msg->len == 0 || msg->data[msg->len - 1] != '\n';
+        if (server->websockets.count == 0)
+            continue;
+        batch_add(&server->framed, ws_frame(msg, first));
+        if (tagged->len != 0)
+            batch_add(&server->framed_tagged,
+                      ws_frame(tagged->items[i], first));
+    }
+}
+
+static struct batch_t *batch_for(struct server_t *server,
+                                 const struct connection_t *cc)
+{
+    int sequenced = cc->sequenced && server->tagged.len != 0;
+    if (cc->websocket)
+        return sequenced ? &server->framed_tagged : &server->framed;
+    return sequenced ? &server->tagged : &server->batch;
+}
+
+/* a WebSocket client joining inside a cut through line waits for its end */
+static size_t first_for(struct server_t *server, const struct connection_t *cc,
+                        const struct batch_t *own)
+{
+    if (!cc->websocket)
+        return 0;
+    struct ws_conn_t *ws = ws_get(&server->websockets, cc->client_socket);
+    if (!ws->open)
+        return own->len;
+    size_t first = 0;
+    while (ws->joining && first < own->len
+           && (own->items[first]->data[0] & 0x0f) == WS_CONTINUATION)
+        first++;
+    ws->joining = first == own->len && ws->joining;
+    return first;
+}
+
+static void unref_batch(struct batch_t *batch)
+{
+    for (size_t i = 0; i < batch->len; i++)
+        message_unref(batch->items[i]);
+    batch->len = 0;
+}
+
+static void fan_out(struct server_t *server)
+{
+    struct batch_t *batch = &server->batch;
+    struct batch_t *tagged = &server->tagged;
+    if (batch->len == 0)
         return;
-    if (pass == -1)
+    TRACE3(fanout, batch->len, server->clients.count, trace_now());
+    for (size_t i = 0; server->history.cap != 0 && i < batch->len; i++)
     {
-        for (struct connection_t *cc = clients; cc != NULL; cc = cc->next)
-            send(cc->client_socket, in->buffer, in->nb_read, MSG_NOSIGNAL);
+        history_add(&server->history, batch->items[i]);
+        const struct history_entry_t *entry =
+            history_at(&server->history, server->history.count - 1);
+        /* the prefixed copies, only if a client receives them */
+        if (server->nb_sequenced != 0)
+            batch_add(tagged, history_sequenced(entry));
+        if (server->mcast.sock != -1)
+            mcast_add(&server->mcast, entry->seq, batch->items[i],
+                      entry->line_start);
     }
+    /* sent once for all the subscribers, before the TCP fan-out */
+    if (server->mcast.sock != -1)
+        mcast_flush(&server->mcast);
+    frame_batch(server);
+    if (server->pipeline.nb_stages != 0)
+    {
+        pipeline_publish(&server->pipeline, batch,
+                         tagged->len != 0 ? tagged : NULL);
+        return;
+    }
+    for (size_t c = 0; c < server->clients.count; c++)
+    {
+        struct connection_t *cc = server->clients.all[c];
+        if (cc->closing || cc->handshaking)
+            continue;
+        struct batch_t *own = batch_for(server, cc);
+        for (size_t i = first_for(server, cc, own); i < own->len; i++)
+            queue_message(&server->clients, cc, own->items[i]);
+        if (!cc->want_write)
+            send_pending(server, cc);
+    }
+    unref_batch(batch);
+    unref_batch(tagged);
+    unref_batch(&server->framed);
+    unref_batch(&server->framed_tagged);
+}
+
+/* lines for a single client, framed if it speaks WebSocket */
+static void queue_line(struct server_t *server, struct connection_t *cc,
+                       struct message_t *msg, int first)
+{
+    if (!cc->websocket)
+    {
+        queue_message(&server->clients, cc, msg);
+        return;
+    }
+    struct message_t *frame = ws_frame(msg, first);
+    queue_message(&server->clients, cc, frame);
+    message_unref(frame);
+}
+
+void send_direct(struct server_t *server, int fd, struct message_t *msg)
+{
+    if (server->nb_directs == server->directs_cap)
+    {
+        server->directs_cap = server->directs_cap ? server->directs_cap * 2 : 16;
+        server->directs =
+            xrealloc_tag(MEM_OUTPUT, server->directs,
+                         server->directs_cap * sizeof(struct direct_t));
+    }
+    struct direct_t *direct = &server->directs[server->nb_directs++];
+    direct->fd = fd;
+    direct->gen = nick_gen(&server->nicks, fd);
+    direct->msg = msg;
+}
+
+void sequence_client(struct server_t *server, int fd, size_t from)
+{
+    struct history_t *history = &server->history;
+    if (server->pipeline.nb_stages != 0)
+    {
+        for (size_t pos = from; pos < history->count; pos++)
+            pipeline_send(&server->pipeline, fd,
+                          history_sequenced(history_at(history, pos)));
+        pipeline_sequence(&server->pipeline, fd);
+    }
+    struct connection_t *cc = find_client(&server->clients, fd);
+    if (cc == NULL || cc->closing)
+        return;
+    server->nb_sequenced += !cc->sequenced;
+    cc->sequenced = 1;
+    if (server->pipeline.nb_stages != 0 || from == history->count)
+        return;
+    /* the replay brings the client to the live stream, even inside a line */
+    if (cc->websocket)
+        ws_get(&server->websockets, fd)->joining = 0;
+    for (size_t pos = from; pos < history->count; pos++)
+    {
+        const struct history_entry_t *entry = history_at(history, pos);
+        struct message_t *copy = history_sequenced(entry);
+        queue_line(server, cc, copy, entry->line_start);
+        message_unref(copy);
+    }
+    if (!cc->want_write)
+        send_pending(server, cc);
+}
+
+static void deliver_directs(struct server_t *server)
+{
+    for (size_t i = 0; i < server->nb_directs; i++)
+    {
+        struct direct_t *direct = &server->directs[i];
+        if (direct->gen != nick_gen(&server->nicks, direct->fd))
+        {
+            message_unref(direct->msg);
+            continue;
+        }
+        if (server->pipeline.nb_stages != 0)
+        {
+            pipeline_send(&server->pipeline, direct->fd, direct->msg);
+            continue;
+        }
+        struct connection_t *cc = find_client(&server->clients, direct->fd);
+        if (cc != NULL && !cc->closing)
+        {
+            queue_line(server, cc, direct->msg, 1);
+            if (!cc->want_write)
+                send_pending(server, cc);
+        }
+        message_unref(direct->msg);
+    }
+    server->nb_directs = 0;
+}
+
+/* the joins and leaves of the iteration, one message for all subscribers */
+static void publish_presence(struct server_t *server)
+{
+    struct presence_t *presence = &server->presence;
+    struct message_t *msg = presence_take(presence);
+    if (msg == NULL)
+        return;
+    for (size_t i = 0; i < presence->nb_subscribers; i++)
+        send_direct(server, presence->subscribers[i], message_ref(msg));
+    message_unref(msg);
+}
+
+static void Networks(struct server_t *server)
+{
+    publish_presence(server);
+    fan_out(server);
+    /* the chunks of the pinned line must reach the clients back to back */
+    if (!server->stream.active)
+        deliver_directs(server);
+}
+
+static void release(uint64_t owner, struct message_t *msg, int more,
+                    void *data)
+{
+    struct server_t *server = data;
+    batch_add(&server->batch, msg);
+    if (owner < STREAM_REMOTE)
+        peer_forward(&server->fed, msg->data, msg->len, more);
+}
+
+static void processed(int owner, struct message_t *msg, int more, void *data)
+{
+    struct server_t *server = data;
+    if (msg != NULL)
+        stream_submit(&server->stream, owner, msg, more);
+    /* the rejected end of the pinned line still ends it */
+    else if (!more && server->stream.active
+             && server->stream.owner == (uint64_t)owner)
+        stream_end(&server->stream);
+}
+
+static void emit(struct server_t *server, struct connection_t *in,
+                 const char *data, size_t len, int more)
+{
+    if (server->executor.nb_hooks != 0)
+        executor_submit(&server->executor, in->client_socket,
+                        message_new(data, len), more);
     else
+        stream_submit(&server->stream, in->client_socket,
+                      message_new(data, len), more);
+}
+
+static void disconnect(struct server_t *server,
+                       struct connection_t *disconnecting_client)
+{
+    TRACE3(disconnect, disconnecting_client->client_socket,
+           pending_output(disconnecting_client), trace_now());
+    if (server->capture.map != NULL)
+        capture_disconnect(&server->capture,
+                           disconnecting_client->client_socket);
+    struct ws_conn_t *ws =
+        ws_get(&server->websockets, disconnecting_client->client_socket);
+    /* the partial handshake is not a line */
+    if (ws != NULL && !ws->open)
+        release_input(&server->clients, disconnecting_client);
+    ws_remove(&server->websockets, disconnecting_client->client_socket);
+    tls_remove(&server->tls, disconnecting_client->client_socket);
+    if (disconnecting_client->streaming)
+        emit(server, disconnecting_client, "\n", 1, 0);
+    else if (disconnecting_client->nb_read != 0)
+        emit(server, disconnecting_client, disconnecting_client->buffer,
+             disconnecting_client->nb_read, 0);
+    server->clients.transport->ctl(server->clients.transport->ctx,
+                                   server->epoll_instance, EPOLL_CTL_DEL,
+                                   disconnecting_client->client_socket, 0);
+    limiter_remove(&server->limiter, disconnecting_client->client_socket);
+    session_detach(&server->sessions, disconnecting_client->client_socket,
+                   nick_of(&server->nicks,
+                           disconnecting_client->client_socket),
+                   time(NULL));
+    const char *name =
+        nick_of(&server->nicks, disconnecting_client->client_socket);
+    if (name != NULL)
+        presence_leave(&server->presence, name);
+    presence_unsubscribe(&server->presence,
+                         disconnecting_client->client_socket);
+    nick_remove(&server->nicks, disconnecting_client->client_socket);
+    server->nb_sequenced -= disconnecting_client->sequenced;
+    if (server->pipeline.nb_stages != 0)
     {
-        for (struct connection_t *cc = clients; cc != NULL; cc = cc->next)
+        /* the broadcaster closes the socket once it let go of it */
+        pipeline_remove(&server->pipeline, disconnecting_client->client_socket);
+        detach_client(&server->clients, disconnecting_client);
+    }
+    else
+        remove_client(&server->clients, disconnecting_client);
+    server->metrics.clients--;
+    printf("Client disconnected\n");
+}
+
+static void deliver_remote(const char *msg, size_t len, uint32_t origin,
+                           int more, void *data)
+{
+    struct server_t *server = data;
+    stream_submit(&server->stream, STREAM_REMOTE | origin,
+                  message_new(msg, len), more);
+}
+
+static void resume_clients(struct server_t *server)
+{
+    for (size_t c = 0; c < server->clients.count; c++)
+    {
+        struct connection_t *cc = server->clients.all[c];
+        if (cc->paused)
         {
-            if (cc->client_socket != pass)
-                send(cc->client_socket, in->buffer, in->nb_read, MSG_NOSIGNAL);
+            cc->paused = 0;
+            update_events(server, cc);
         }
     }
 }
 
-void save_data(struct connection_t *in, char *recv_msg, size_t len)
+static void pause_client(struct server_t *server, struct connection_t *in)
 {
-    if (in == NULL)
+    in->paused = 1;
+    update_events(server, in);
+}
+
+static void take_line(struct server_t *server, struct connection_t *in,
+                      const char *data, size_t len, int complete)
+{
+    if (in->discarding)
+    {
+        in->discarding = !complete;
         return;
-    in->buffer = realloc(in->buffer, (in->nb_read + len) * sizeof(char));
-    if (in->buffer == NULL)
+    }
+    if (len - complete > server->cfg->max_line - in->nb_read)
+    {
+        /* keep what fits and end the line, drop the rest until '\n' */
+        size_t room = server->cfg->max_line - in->nb_read;
+        if (room != 0)
+            take_line(server, in, data, room, 0);
+        take_line(server, in, "\n", 1, 1);
+        in->discarding = !complete;
+        server->metrics.lines_truncated++;
+        return;
+    }
+
+    if (in->streaming)
+    {
+        if (complete)
+        {
+            TRACE3(frame, in->client_socket, in->nb_read + len, trace_now());
+            if (server->capture.map != NULL)
+                capture_line(&server->capture, in->client_socket,
+                             in->nb_read + len);
+        }
+        emit(server, in, data, len, !complete);
+        in->streaming = !complete;
+        in->nb_read = complete ? 0 : in->nb_read + len;
+        server->metrics.lines_in += complete;
         return;
-    memcpy(in->buffer + in->nb_read, recv_msg, len);
-    in->nb_read += len;
+    }
+
+    save_data(&server->clients, in, data, len);
+    if (complete)
+    {
+        TRACE3(frame, in->client_socket, in->nb_read, trace_now());
+        if (server->capture.map != NULL)
+            capture_line(&server->capture, in->client_socket, in->nb_read);
+        if (in->buffer[0] != '/'
+            || !command_run(server, in->client_socket, in->buffer,
+                            in->nb_read))
+            emit(server, in, in->buffer, in->nb_read, 0);
+        server->metrics.lines_in++;
+        release_input(&server->clients, in);
+    }
+    else if (server->cfg->cut_through != 0
+             && in->nb_read >= server->cfg->cut_through
+             && !stream_pinned(&server->stream, in->client_socket))
+    {
+        uint32_t streamed = in->nb_read;
+        emit(server, in, in->buffer, in->nb_read, 1);
+        release_input(&server->clients, in);
+        in->nb_read = streamed;
+        in->streaming = 1;
+        server->metrics.lines_cut_through++;
+    }
 }
 
-static void disconnect(int epli, struct connection_t **clients, int cur_fd)
+static size_t take_data(struct server_t *server, struct connection_t *in,
+                        const char *data, size_t left)
 {
-    struct connection_t *disconnecting_client = find_client(*clients, cur_fd);
-    if (disconnecting_client->nb_read != 0)
-        Networks(cur_fd, *clients, cur_fd);
-    epoll_ctl(epli, EPOLL_CTL_DEL, cur_fd, NULL);
-    *clients = remove_client(*clients, cur_fd);
-    printf("Client disconnected\n");
+    size_t lines = 0;
+    while (left != 0)
+    {
+        const char *end = memchr(data, '\n', left);
+        size_t len = end ? (size_t)(end - data) + 1 : left;
+        take_line(server, in, data, len, end != NULL);
+        lines += end != NULL;
+        data += len;
+        left -= len;
+    }
+    return lines;
 }
 
-static void communicate(int epli, int serv_fd)
+/**
+ * \brief Connection whose frames are being decoded
+ */
+struct ws_input_t
 {
-    struct connection_t *clients = NULL;
-    while (1)
+    struct server_t *server; /**< the server state */
+
+    struct connection_t *in; /**< the client */
+
+    size_t lines; /**< lines ended by the frames */
+
+    int closed; /**< the client sent a close frame */
+};
+
+/* a WebSocket message is a line, its own '\n' are kept as line ends */
+static void ws_data(void *data, const char *payload, size_t len, int end)
+{
+    struct ws_input_t *input = data;
+    input->lines += take_data(input->server, input->in, payload, len);
+    if (end && (input->in->nb_read != 0 || input->in->discarding))
     {
-        struct epoll_event events[MAX_EVENTS];
-        int events_count = epoll_wait(epli, events, MAX_EVENTS, -1);
+        take_line(input->server, input->in, "\n", 1, 1);
+        input->lines++;
+    }
+}
 
-        for (int index = 0; index < events_count; index++)
+static int ws_control_frame(void *data, int opcode, const char *payload,
+                            size_t len)
+{
+    struct ws_input_t *input = data;
+    if (opcode == WS_PONG)
+        return 0;
+    /* a close is answered with its status code, then the socket is closed */
+    struct message_t *reply = opcode == WS_PING
+        ? ws_control(WS_PONG, payload, len)
+        : ws_control(WS_CLOSE, payload, len < 2 ? len : 2);
+    queue_message(&input->server->clients, input->in, reply);
+    message_unref(reply);
+    if (!input->in->want_write)
+        send_pending(input->server, input->in);
+    input->closed = opcode == WS_CLOSE;
+    return opcode == WS_CLOSE ? -1 : 0;
+}
+
+static void ws_open(struct server_t *server, struct connection_t *in,
+                    struct ws_conn_t *ws, const char **data, size_t *len)
+{
+    size_t before = in->nb_read;
+    size_t room = WS_MAX_HANDSHAKE - before;
+    save_data(&server->clients, in, *data, *len < room ? *len : room);
+    size_t end = ws_request_end(in->buffer, in->nb_read);
+    if (end == 0 && in->nb_read < WS_MAX_HANDSHAKE)
+    {
+        *len = 0;
+        return;
+    }
+
+    char reply[WS_MAX_REPLY];
+    int res = end ? ws_handshake(in->buffer, end, reply) : -1;
+    if (end == 0)
+        strcpy(reply, WS_TOO_LARGE);
+    release_input(&server->clients, in);
+    struct message_t *msg = message_new(reply, strlen(reply));
+    queue_message(&server->clients, in, msg);
+    message_unref(msg);
+    send_pending(server, in);
+    if (res == -1)
+    {
+        server->metrics.websocket_errors++;
+        in->closing = 1;
+        *len = 0;
+        return;
+    }
+
+    /* the frames sent along with the request follow it */
+    ws->open = 1;
+    ws->joining = server->mid_line;
+    *data += end - before;
+    *len -= end - before;
+}
+
+static long receive_frames(struct server_t *server, struct connection_t *in,
+                           char *data, size_t len)
+{
+    struct ws_conn_t *ws = ws_get(&server->websockets, in->client_socket);
+    if (!ws->open)
+    {
+        const char *rest = data;
+        ws_open(server, in, ws, &rest, &len);
+        if (in->closing)
         {
-            int cur_fd = events[index].data.fd;
-            if (cur_fd == serv_fd)
-                clients = accept_client(epli, serv_fd, clients);
-            else
-            {
-                char recv_buffer[DEFAULT_BUFFER_SIZE];
-                int nr = recv(cur_fd, recv_buffer, DEFAULT_BUFFER_SIZE, 0);
-                if (nr == 0)
-                    disconnect(epli, &clients, cur_fd);
-                else
-                {
-                    struct connection_t *in = find_client(clients, cur_fd);
-                    save_data(in, recv_buffer, nr);
-                    if (in->buffer[in->nb_read - 1] == '\n')
-                    {
-                        Networks(cur_fd, clients, -1);
-                        in->nb_read = 0;
-                    }
-                }
-            }
+            disconnect(server, in);
+            return -1;
         }
+        data += rest - data;
     }
+
+    struct ws_input_t input = { server, in, 0, 0 };
+    long frames = ws_input(ws, data, len, ws_data, ws_control_frame, &input);
+    if (frames == -1)
+    {
+        server->metrics.websocket_errors += !input.closed;
+        disconnect(server, in);
+        return -1;
+    }
+    server->metrics.websocket_frames += frames;
+    return input.lines;
 }
 
-int main(int argc, char **argv)
+/* return the bytes read, 0 on EAGAIN and -1 once the client is gone */
+static long receive(struct server_t *server, struct connection_t *in,
+                    size_t allowed, size_t *lines)
 {
-    if (argc != 3)
+    char recv_buffer[READ_CHUNK];
+    if (allowed > READ_CHUNK)
+        allowed = READ_CHUNK;
+    const struct transport_t *transport = server->clients.transport;
+    int nr = in->tls_read
+        ? tls_recv(&server->tls, in->client_socket, recv_buffer, allowed)
+        : transport->recv(transport->ctx, in->client_socket, recv_buffer,
+                          allowed);
+    server->metrics.reads++;
+    if (nr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (nr <= 0)
     {
-        fprintf(stderr, "Usage : ./epoll_server ip_address port\n");
-        return 1;
+        disconnect(server, in);
+        return -1;
     }
-    int serv_fd = prepare_socket(argv[1], argv[2]);
 
-    int epli = epoll_create1(0);
-    struct epoll_event event = { 0 };
-    event.data.fd = serv_fd;
-    event.events = EPOLLIN;
+    server->metrics.bytes_in += nr;
+    TRACE3(recv, in->client_socket, nr, trace_now());
+    long taken = in->websocket
+        ? receive_frames(server, in, recv_buffer, nr)
+        : (long)take_data(server, in, recv_buffer, nr);
+    if (taken == -1)
+        return -1;
+    limiter_charge(&server->limiter, in->client_socket, taken, nr);
+    *lines += taken;
 
-    if (epoll_ctl(epli, EPOLL_CTL_ADD, serv_fd, &event) == -1)
-        errx(1, "cannot add socket to epoll");
+    /* a long partial line waits for the pinned one instead of growing */
+    if (server->cfg->cut_through != 0 && !in->streaming
+        && in->nb_read >= server->cfg->cut_through
+        && (!in->websocket
+            || ws_get(&server->websockets, in->client_socket)->open))
+    {
+        pause_client(server, in);
+        server->waiting = 1;
+    }
+    else if (in->tls_read)
+        tls_mark(&server->tls, in->client_socket);
+    return nr;
+}
 
-    communicate(epli, serv_fd);
-    return 0;
-}
\ No newline at end of file
+static void schedule_read(struct server_t *server, struct connection_t *in)
+{
+    /* a round queues at most the clients it served, no growth mid-round */
+    if (server->nb_ready == server->ready_cap)
+    {
+        server->ready_cap = server->ready_cap ? server->ready_cap * 2 : 16;
+        server->ready = xrealloc_tag(MEM_CONNECTIONS, server->ready,
+                                     server->ready_cap * sizeof(int));
+        server->serving = xrealloc_tag(MEM_CONNECTIONS, server->serving,
+                                       server->ready_cap * sizeof(int));
+    }
+    server->ready[server->nb_ready++] = in->client_socket;
+    in->scheduled = 1;
+    server->metrics.reads_rescheduled++;
+}
+
+/*
+ * Read until the socket is empty or the budget of the round is spent. A
+ * client with more to read is served again next round after the others,
+ * without waiting for epoll to report it.
+ */
+static void read_client(struct server_t *server, struct connection_t *in,
+                        int congested)
+{
+    int fd = in->client_socket;
+    if (stream_congested(&server->stream)
+        && stream_pinned(&server->stream, fd))
+        congested = 1;
+    if (congested)
+    {
+        pause_client(server, in);
+        server->held = 1;
+        return;
+    }
+
+    const struct rate_t *budget = &server->cfg->read_budget;
+    size_t left = budget->bytes;
+    size_t lines = 0;
+    while (left != 0)
+    {
+        size_t allowed = limiter_allow(&server->limiter, fd,
+                                       left < READ_CHUNK ? left : READ_CHUNK,
+                                       server->now);
+        if (allowed == 0)
+        {
+            in->throttled = 1;
+            update_events(server, in);
+            server->metrics.throttles++;
+            return;
+        }
+        long nr = receive(server, in, allowed, &lines);
+        /* a short read emptied the socket, no recv(2) to see EAGAIN */
+        if (nr < (long)allowed || in->paused || in->closing)
+            return;
+        left -= nr;
+        if (budget->lines != 0 && lines >= budget->lines)
+            break;
+    }
+    schedule_read(server, in);
+}
+
+/* one budget per client and round, the unfinished ones queue again */
+static void read_scheduled(struct server_t *server, int congested)
+{
+    int *serving = server->ready;
+    size_t nb = server->nb_ready;
+    server->ready = server->serving;
+    server->serving = serving;
+    server->nb_ready = 0;
+    for (size_t i = 0; i < nb; i++)
+    {
+        /* the fd of a client that left may be reused, unscheduled */
+        struct connection_t *cc = find_client(&server->clients, serving[i]);
+        if (cc == NULL || !cc->scheduled)
+            continue;
+        cc->scheduled = 0;
+        /* epoll reports them again once they may read */
+        if (cc->paused || cc->throttled || cc->closing)
+            continue;
+        read_client(server, cc, congested);
+    }
+}
+
+static void secure(struct server_t *server, struct connection_t *in)
+{
+    int want_write = 0;
+    int userspace = 0;
+    int res = tls_handshake(&server->tls, in->client_socket, &want_write,
+                            &userspace);
+    if (res == TLS_FAILED)
+    {
+        disconnect(server, in);
+        return;
+    }
+    if (res == TLS_DONE)
+    {
+        in->handshaking = 0;
+        in->tls_read = (userspace & TLS_READ) != 0;
+        in->tls_write = (userspace & TLS_WRITE) != 0;
+    }
+    if (res == TLS_DONE || want_write != in->want_write)
+    {
+        in->want_write = want_write;
+        update_events(server, in);
+    }
+}
+
+static void unthrottle(struct server_t *server)
+{
+    int fd = -1;
+    while ((fd = limiter_expired(&server->limiter, server->now)) != -1)
+    {
+        struct connection_t *cc = find_client(&server->clients, fd);
+        if (cc != NULL && cc->throttled)
+        {
+            cc->throttled = 0;
+            update_events(server, cc);
+        }
+    }
+}
+
+static void memory_metrics(struct server_t *server)
+{
+    struct client_table_t *table = &server->clients;
+    server->metrics.idle_connection_bytes = idle_connection_size();
+    server->metrics.input_buffers_lent = table->buffers.lent;
+    server->metrics.output_queues_lent = table->queues.lent;
+    server->metrics.zerocopy_sends = table->zc_sends;
+    server->metrics.zerocopy_bytes = table->zc_bytes;
+    server->metrics.zerocopy_copied = table->zc_copied;
+    server->metrics.zerocopy_fallbacks = table->zc_fallbacks;
+    server->metrics.deferred_bytes = server->stream.deferred_bytes;
+    server->metrics.pipeline_depth = pipeline_depth(&server->pipeline);
+    server->metrics.pipeline_fanned = pipeline_fanned(&server->pipeline);
+    server->metrics.tasks = server->executor.tasks;
+    server->metrics.tasks_inflight = server->executor.inflight;
+    server->metrics.tasks_stolen =
+        __atomic_load_n(&server->executor.stolen, __ATOMIC_RELAXED);
+    server->metrics.tasks_dropped = server->executor.dropped;
+    server->metrics.task_latency_ns = server->executor.latency_ns;
+    server->metrics.task_latency_max_ns = server->executor.latency_max_ns;
+    if (server->filter.path != NULL)
+        filter_metrics(&server->filter, &server->metrics);
+    server->metrics.broadcast_seq = server->history.seq;
+    server->metrics.history_lines = server->history.count;
+    server->metrics.history_bytes = server->history.bytes;
+    server->metrics.sessions = server->sessions.count;
+    server->metrics.websockets = server->websockets.count;
+    server->metrics.tls_handshakes = server->tls.handshakes;
+    server->metrics.tls_kernel_tx = server->tls.kernel_tx;
+    server->metrics.tls_kernel_rx = server->tls.kernel_rx;
+    server->metrics.tls_errors = server->tls.errors;
+    server->metrics.mcast_datagrams = server->mcast.datagrams;
+    server->metrics.mcast_bytes = server->mcast.bytes;
+    server->metrics.mcast_dropped = server->mcast.dropped;
+    server->metrics.who_served = server->presence.served;
+    server->metrics.who_rebuilds = server->presence.rebuilds;
+    server->metrics.presence_subscribers = server->presence.nb_subscribers;
+    server->metrics.peer_dropped = server->fed.dropped;
+    xalloc_stats(server->metrics.mem);
+    server->metrics.pooled_bytes =
+        table->buffers.nb_free * table->buffers.obj_size
+        + table->queues.nb_free * table->queues.obj_size
+        + table->connections.nb_free * table->connections.obj_size;
+}
+
+static void hand_over(struct server_t *server)
+{
+    int sock = accept(server->upgrade_sock, NULL, NULL);
+    if (sock == -1)
+        return;
+    executor_drain(&server->executor);
+    stream_end(&server->stream);
+    Networks(server);
+    peer_flush(&server->fed, server->epoll_instance);
+    printf("Handing over to a new process\n");
+    if (upgrade_send(server, sock) == 0)
+    {
+        /* the sockets belong to the new process now, do not shut them down */
+        fflush(stdout);
+        _exit(0);
+    }
+    close(sock);
+    fprintf(stderr, "Upgrade failed, resuming\n");
+}
+
+static const struct listener_t *find_listener(const struct server_t *server,
+                                              int fd)
+{
+    for (size_t i = 0; i < server->nb_listeners; i++)
+    {
+        if (server->listeners[i].sock == fd)
+            return &server->listeners[i];
+    }
+    return NULL;
+}
+
+static void handle_event(struct server_t *server, int cur_fd, uint32_t flags,
+                         int congested)
+{
+    const struct listener_t *listener = find_listener(server, cur_fd);
+    if (listener != NULL)
+    {
+        /* the rest of a storm waits for the next iteration, level-triggered */
+        size_t budget = server->cfg->accept_budget;
+        while (budget != 0 && accept_client(server, listener))
+            budget--;
+        if (budget == 0)
+            server->metrics.accept_budget_spent++;
+        return;
+    }
+    if (cur_fd == server->signal_fd)
+    {
+        int sig = metrics_signal_read(server->signal_fd);
+        if (sig == SIGUSR1)
+        {
+            memory_metrics(server);
+            metrics_dump(&server->metrics, stderr);
+        }
+        else if (sig == SIGHUP && server->filter.path != NULL)
+            filter_reload(&server->filter);
+        /* through exit(3), so that the PGO profiles are written */
+        else if (sig == SIGTERM)
+        {
+            printf("Shutting down\n");
+            exit(0);
+        }
+        return;
+    }
+    if (cur_fd == server->upgrade_sock)
+    {
+        hand_over(server);
+        return;
+    }
+    if (cur_fd == server->executor.event_fd)
+    {
+        executor_complete(&server->executor);
+        return;
+    }
+    if (peer_handle(&server->fed, server->epoll_instance, cur_fd, flags,
+                    deliver_remote, server))
+        return;
+
+    struct connection_t *in = find_client(&server->clients, cur_fd);
+    if (in == NULL)
+        return;
+    if ((flags & EPOLLERR) && in->zerocopy
+        && zerocopy_complete(&server->clients, in) == 0)
+        flags &= ~EPOLLERR;
+    if (in->handshaking)
+    {
+        secure(server, in);
+        return;
+    }
+    if ((flags & EPOLLOUT) && !in->closing)
+        send_pending(server, in);
+    /* its turn comes in read_scheduled(), level-triggered epoll or not */
+    if (!(flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) || in->scheduled)
+        return;
+    if (in->closing || (flags & (EPOLLHUP | EPOLLERR)))
+    {
+        size_t lines = 0;
+        receive(server, in, READ_CHUNK, &lines);
+        return;
+    }
+    read_client(server, in, congested);
+}
+
+/* decrypted bytes left in OpenSSL do not make the sockets readable */
+static void receive_buffered(struct server_t *server, int congested)
+{
+    int *ready = NULL;
+    size_t nb_ready = tls_take_ready(&server->tls, &ready);
+    for (size_t i = 0; i < nb_ready; i++)
+    {
+        struct connection_t *cc = find_client(&server->clients, ready[i]);
+        if (cc != NULL && cc->tls_read && !cc->paused && !cc->throttled)
+            handle_event(server, ready[i], EPOLLIN, congested);
+    }
+}
+
+int server_timeout(struct server_t *server, int *congested)
+{
+    int timeout = peer_reconnect(&server->fed, server->epoll_instance);
+    *congested = peer_congested(&server->fed);
+    if (*congested || server->stream.active)
+        timeout = PEER_RETRY_DELAY * 1000;
+    /* the broadcasters drain without waking the loop, poll them */
+    if (executor_congested(&server->executor))
+        *congested = 1;
+    if (pipeline_congested(&server->pipeline))
+    {
+        *congested = 1;
+        timeout = PIPELINE_POLL_DELAY;
+    }
+    int wake = limiter_timeout(&server->limiter, limiter_now());
+    if (wake != -1 && (timeout == -1 || wake < timeout))
+        timeout = wake;
+    if (server->nb_ready != 0 || server->tls.nb_ready != 0)
+        timeout = 0;
+    return timeout;
+}
+
+void server_dispatch(struct server_t *server, const struct epoll_event *events,
+                     int count, int congested)
+{
+    server->metrics.iterations++;
+    server->metrics.events += count;
+    if (server->limiter.enabled)
+    {
+        server->now = limiter_now();
+        unthrottle(server);
+    }
+
+    for (int index = 0; index < count; index++)
+        handle_event(server, events[index].data.fd, events[index].events,
+                     congested);
+    read_scheduled(server, congested);
+    receive_buffered(server, congested);
+
+    time_t now = time(NULL);
+    if (stream_expire(&server->stream, now))
+        server->metrics.streams_expired++;
+    session_expire(&server->sessions, now);
+    Networks(server);
+    peer_flush(&server->fed, server->epoll_instance);
+    if (server->held && !peer_congested(&server->fed)
+        && !stream_congested(&server->stream)
+        && !pipeline_congested(&server->pipeline)
+        && !executor_congested(&server->executor))
+    {
+        resume_clients(server);
+        server->held = 0;
+        server->waiting = 0;
+    }
+    else if (server->waiting && !server->stream.active)
+    {
+        resume_clients(server);
+        server->waiting = 0;
+    }
+}
+
+void communicate(struct server_t *server)
+{
+    while (1)
+    {
+        int congested = 0;
+        int timeout = server_timeout(server, &congested);
+        /* the peaks are those of the ends of iterations */
+        xalloc_sample();
+
+        int events_count =
+            poller_wait(&server->poller, timeout, &server->metrics);
+        if (events_count == -1)
+            errx(1, "epoll_wait failed");
+        server_dispatch(server, server->poller.events, events_count,
+                        congested);
+    }
+}
+
+void server_init(struct server_t *server, const struct config_t *cfg)
+{
+    memset(server, 0, sizeof(struct server_t));
+    server->cfg = cfg;
+    server->epoll_instance = -1;
+    server->signal_fd = -1;
+    server->upgrade_sock = -1;
+    server->spare_fd = -1;
+    init_clients(&server->clients);
+    server->clients.zerocopy_threshold = cfg->zerocopy_threshold;
+    stream_init(&server->stream, release, server);
+    history_init(&server->history, cfg->history_lines);
+    server->mcast.sock = -1;
+    if (cfg->mcast_group != NULL)
+        mcast_init(&server->mcast, cfg->mcast_group, cfg->mcast_if);
+    if (cfg->capture_path != NULL)
+        capture_open(&server->capture, cfg->capture_path, cfg->capture_size);
+    if (cfg->tls_cert != NULL)
+    {
+        tls_init(&server->tls, cfg->tls_cert, cfg->tls_key);
+        server->clients.tls = &server->tls;
+    }
+    limiter_init(&server->limiter, cfg);
+}
+
+void server_start(struct server_t *server)
+{
+    const struct config_t *cfg = server->cfg;
+    pipeline_init(&server->pipeline, cfg->broadcasters);
+    executor_init(&server->executor, cfg->workers, processed, server);
+    for (size_t i = 0; i < cfg->nb_plugins; i++)
+    {
+        if (plugin_load(&server->executor, cfg->plugins[i]) == -1)
+            errx(1, "unknown plugin %s", cfg->plugins[i]);
+    }
+    if (cfg->filter_path != NULL)
+    {
+        filter_init(&server->filter, cfg->filter_path);
+        if (executor_hook(&server->executor, filter_hook, &server->filter)
+            == -1)
+            errx(1, "too many plugins for the filter");
+    }
+    executor_start(&server->executor);
+}
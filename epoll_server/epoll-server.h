@@ -2,18 +2,156 @@
 #define EPOLL_SERVER_H_
 
 #include <netdb.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "capture.h"
+#include "config.h"
 #include "connection.h"
+#include "executor.h"
+#include "filter.h"
+#include "history.h"
+#include "limiter.h"
+#include "mcast.h"
+#include "message.h"
+#include "metrics.h"
+#include "nick.h"
+#include "peer.h"
+#include "pipeline.h"
+#include "poller.h"
+#include "presence.h"
+#include "session.h"
+#include "stream.h"
+#include "tls.h"
+#include "transport.h"
+#include "websocket.h"
 
 /**
- * \brief The length of the event array, must be greater than zero
+ * \brief The initial length of the event array, must be greater than zero
  */
 #define MAX_EVENTS 64
 
 #define DEFAULT_BUFFER_SIZE 2048
 
+/**
+ * \brief Most bytes asked to a single recv(2) of a client
+ */
+#define READ_CHUNK (16 * 1024)
+
+/**
+ * \brief Most listening sockets of the clients, all addresses counted
+ */
+#define MAX_LISTENERS 16
+
+/**
+ * \brief A socket accepting clients
+ */
+struct listener_t
+{
+    int sock; /**< non blocking, registered in the epoll instance */
+
+    int websocket; /**< its clients speak WebSocket */
+};
+
+/**
+ * \brief Message for a single client, waiting for the end of the iteration
+ */
+struct direct_t
+{
+    int fd; /**< the recipient */
+
+    uint32_t gen; /**< nick_gen() of the recipient when it was queued */
+
+    struct message_t *msg; /**< the message and its reference */
+};
+
+/**
+ * \brief Contain the whole state of the event loop
+ */
+struct server_t
+{
+    const struct config_t *cfg; /**< the runtime options */
+
+    int epoll_instance; /**< the epoll instance */
+
+    struct listener_t listeners[MAX_LISTENERS]; /**< chat and WebSocket */
+
+    size_t nb_listeners; /**< number of elements in listeners */
+
+    int spare_fd; /**< descriptor released to shed connections on EMFILE */
+
+    int signal_fd; /**< signalfd(2) of SIGUSR1, SIGHUP and SIGTERM */
+
+    int upgrade_sock; /**< Unix socket of the hot upgrades, -1 if none */
+
+    struct client_table_t clients; /**< the connected clients */
+
+    struct batch_t batch; /**< messages collected during this iteration */
+
+    struct batch_t tagged; /**< their sequenced copies, if nb_sequenced */
+
+    struct batch_t framed; /**< their WebSocket frames, if any client */
+
+    struct batch_t framed_tagged; /**< frames of the sequenced copies */
+
+    int mid_line; /**< the latest broadcast did not end its line */
+
+    struct ws_table_t websockets; /**< state of the WebSocket clients */
+
+    struct history_t history; /**< sequence numbers and recent broadcasts */
+
+    size_t nb_sequenced; /**< clients receiving the sequenced copies */
+
+    struct session_table_t sessions; /**< sessions of the clients */
+
+    struct tls_t tls; /**< TLS context and sessions, no context without -S */
+
+    struct mcast_t mcast; /**< publisher of the broadcasts, if a group */
+
+    struct capture_t capture; /**< recorder of the traffic, if a file */
+
+    struct direct_t *directs; /**< messages for a single client, in order */
+
+    size_t nb_directs; /**< number of elements in directs */
+
+    size_t directs_cap; /**< allocated size of directs */
+
+    int *ready; /**< clients that spent their read budget, in turn order */
+
+    size_t nb_ready; /**< number of elements in ready */
+
+    int *serving; /**< the list of the round being served */
+
+    size_t ready_cap; /**< length of ready and serving */
+
+    struct nick_table_t nicks; /**< the nicknames of the clients */
+
+    struct presence_t presence; /**< answer of /who and its subscribers */
+
+    struct stream_t stream; /**< pinning of the cut through lines */
+
+    struct limiter_t limiter; /**< read rate limits */
+
+    uint64_t now; /**< time of the last wakeup, kept while limits are set */
+
+    int held; /**< clients paused until the links and the stream drain */
+
+    int waiting; /**< clients paused until the pinned line ends */
+
+    struct federation_t fed; /**< the peer links */
+
+    struct pipeline_t pipeline; /**< the broadcaster threads, if any */
+
+    struct executor_t executor; /**< the plugin threads, if any */
+
+    struct filter_t filter; /**< the banned terms, if a list was given */
+
+    struct poller_t poller; /**< the adaptive event array */
+
+    struct metrics_t metrics; /**< the counters */
+};
+
 /**
  * \brief Iterate over the struct addrinfo elements to create and bind a socket
  *
@@ -33,6 +171,7 @@ int create_and_bind(struct addrinfo *addrinfo);
  *
  * \param ip: IP address of the server
  * \param port: Port of the server
+ * \param backlog: the listen(2) backlog
  *
  * \return The created socket
  *
@@ -40,19 +179,144 @@ int create_and_bind(struct addrinfo *addrinfo);
  * it. When create_and_bind() returns a valid socket, set the socket to
  * listening and return it.
  */
-int prepare_socket(const char *ip, const char *port);
+int prepare_socket(const char *ip, const char *port, int backlog);
+
+/**
+ * \brief Listen on every address an ip resolves to
+ *
+ * \param ip: IP address or name, "*" for the wildcard of every family
+ * \param port: the port
+ * \param backlog: the listen(2) backlog
+ * \param socks: receives the listening sockets
+ * \param max: length of socks
+ *
+ * \return The number of sockets, exits if no address could be bound
+ *
+ * IPv6 sockets are IPV6_V6ONLY so that they do not take the port of the
+ * IPv4 ones: "::" alone no longer accepts IPv4 clients, "*" or a name with
+ * both families does. An address that cannot be bound is reported and
+ * skipped.
+ */
+size_t prepare_sockets(const char *ip, const char *port, int backlog,
+                       int *socks, size_t max);
+
+/**
+ * \brief Set the O_NONBLOCK flag of a file descriptor
+ *
+ * \param fd: the file descriptor
+ */
+void set_nonblocking(int fd);
 
 /**
  * \brief Accept a new client and add it to the connection_t struct
  *
- * \param epoll_instance: the epoll instance
- * \param server_socket: listening socket
- * \param connection: the connection linked list with all the current
- * connections
+ * \param server: the server state
+ * \param listener: a chat or a WebSocket listener
+ *
+ * \return 1 if a connection was taken from the backlog, accepted or refused,
+ * 0 if the backlog is empty or accept(2) failed
+ *
+ * Connections above max_clients, or above max_per_ip for their address, are
+ * told why and closed. When the process is out of file descriptors the
+ * spare descriptor is used to accept and drop the connection, so that the
+ * listener does not stay readable forever.
+ */
+int accept_client(struct server_t *server, const struct listener_t *listener);
+
+/**
+ * \brief Add a connected client to the engine
+ *
+ * \param server: the server state
+ * \param sfd_client: the socket, non blocking, or a client of the transport
+ * \param addr: address of the client, for the limits of its IP
+ * \param websocket: the client speaks WebSocket
+ *
+ * \return 0, or -1 if the client is above max_per_ip and was not added
+ *
+ * The client is watched through the transport of the table, for reading.
+ */
+int admit_client(struct server_t *server, int sfd_client,
+                 const struct sockaddr *addr, int websocket);
+
+/**
+ * \brief Initialize the state of the engine from the options
+ *
+ * \param server: the server state
+ * \param cfg: the options, kept for the lifetime of the server
+ *
+ * No descriptor is watched and no thread started: the caller creates the
+ * epoll instance and the signalfd, or changes the transport of the clients,
+ * before server_start().
+ */
+void server_init(struct server_t *server, const struct config_t *cfg);
+
+/**
+ * \brief Load the plugins and the filter and start the threads
+ *
+ * \param server: the server state, initialized by server_init()
+ *
+ * The threads inherit the signal mask, which must be set before.
+ */
+void server_start(struct server_t *server);
+
+/**
+ * \brief Compute the timeout of the next wait for events
+ *
+ * \param server: the server state
+ * \param congested: set when the links, the plugins or the broadcasters
+ * cannot take more lines, to give to server_dispatch()
+ *
+ * \return The timeout in milliseconds, -1 for none
+ *
+ * It also dials the peer links due for a new attempt.
+ */
+int server_timeout(struct server_t *server, int *congested);
+
+/**
+ * \brief Run an iteration of the event loop on a list of events
+ *
+ * \param server: the server state
+ * \param events: the ready descriptors, as epoll_wait(2) returns them
+ * \param count: number of elements in events
+ * \param congested: computed by server_timeout() before the wait
+ *
+ * The events are handled, the clients with budget left read, and what the
+ * iteration collected fanned out.
+ */
+void server_dispatch(struct server_t *server, const struct epoll_event *events,
+                     int count, int congested);
+
+/**
+ * \brief The event loop, never returns
+ *
+ * \param server: the server state, started and listening
+ */
+void communicate(struct server_t *server);
+
+/**
+ * \brief Send a message to a single client
+ *
+ * \param server: the server state
+ * \param fd: the socket of the recipient
+ * \param msg: the message, its reference is taken
+ *
+ * The message is delivered after the broadcasts of the iteration, or once
+ * the pinned line ends so that it does not split it. It is dropped if the
+ * recipient leaves in between.
+ */
+void send_direct(struct server_t *server, int fd, struct message_t *msg);
+
+/**
+ * \brief Replay the history to a client and sequence its broadcasts
+ *
+ * \param server: the server state
+ * \param fd: the socket of the client
+ * \param from: position of the first entry to replay, history.count for none
  *
- * \return The connection struct with the new client added
+ * The entries are queued right away, ahead of the broadcasts of the
+ * iteration, which the client receives prefixed with "@seq " like every
+ * broadcast that follows.
  */
-struct connection_t *accept_client(int epoll_instance, int server_socket,
-                                   struct connection_t *connection);
+void sequence_client(struct server_t *server, int fd, size_t from);
 
 #endif /* EPOLL_SERVER_H_ */
\ No newline at end of file
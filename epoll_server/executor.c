@@ -0,0 +1,284 @@
+#include "executor.h"
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils/xalloc.h"
+
+/**
+ * \brief Initial length of the deque of a worker
+ */
+#define DEQUE_SIZE 256
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_hooks(struct executor_t *exec, struct task_t *task)
+{
+    for (size_t i = 0; i < exec->nb_hooks && task->msg != NULL; i++)
+        task->msg = exec->hooks[i](task->msg, task->owner, task->more,
+                                   exec->hook_data[i]);
+}
+
+static void deque_push(struct worker_t *worker, struct task_t *task)
+{
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count == worker->cap)
+    {
+        size_t cap = worker->cap * 2;
+        struct task_t **deque =
+            xmalloc_tag(MEM_TASKS, cap * sizeof(struct task_t *));
+        for (size_t i = 0; i < worker->count; i++)
+            deque[i] = worker->deque[(worker->first + i) & (worker->cap - 1)];
+        xfree_tag(MEM_TASKS, worker->deque);
+        worker->deque = deque;
+        worker->first = 0;
+        worker->cap = cap;
+    }
+    worker->deque[(worker->first + worker->count) & (worker->cap - 1)] = task;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static struct task_t *deque_take(struct worker_t *worker, int steal)
+{
+    struct task_t *task = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count != 0 && steal)
+        task = worker->deque[(worker->first + --worker->count)
+                             & (worker->cap - 1)];
+    else if (worker->count != 0)
+    {
+        task = worker->deque[worker->first];
+        worker->first = (worker->first + 1) & (worker->cap - 1);
+        worker->count--;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return task;
+}
+
+/* every token of ready matches a task, which is somewhere in the deques */
+static struct task_t *next_task(struct worker_t *self)
+{
+    struct executor_t *exec = self->exec;
+    while (1)
+    {
+        struct task_t *task = deque_take(self, 0);
+        if (task != NULL)
+            return task;
+        for (size_t i = 1; i < exec->nb_workers; i++)
+        {
+            struct worker_t *victim =
+                &exec->workers[(self->index + i) % exec->nb_workers];
+            task = deque_take(victim, 1);
+            if (task != NULL)
+            {
+                __atomic_add_fetch(&exec->stolen, 1, __ATOMIC_RELAXED);
+                return task;
+            }
+        }
+    }
+}
+
+static void *work(void *data)
+{
+    struct worker_t *self = data;
+    struct executor_t *exec = self->exec;
+    while (1)
+    {
+        if (sem_wait(&exec->ready) == -1)
+            continue;
+        struct task_t *task = next_task(self);
+        run_hooks(exec, task);
+
+        pthread_mutex_lock(&exec->done_lock);
+        task->link = exec->done_list;
+        exec->done_list = task;
+        pthread_mutex_unlock(&exec->done_lock);
+        uint64_t one = 1;
+        if (write(exec->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            errx(1, "cannot signal completed task");
+    }
+    return NULL;
+}
+
+void executor_init(struct executor_t *exec, size_t nb_workers, done_fn done,
+                   void *data)
+{
+    memset(exec, 0, sizeof(struct executor_t));
+    exec->nb_workers = nb_workers;
+    exec->event_fd = -1;
+    exec->done = done;
+    exec->data = data;
+}
+
+int executor_hook(struct executor_t *exec, hook_fn hook, void *data)
+{
+    if (exec->nb_hooks == EXECUTOR_MAX_HOOKS)
+        return -1;
+    exec->hooks[exec->nb_hooks] = hook;
+    exec->hook_data[exec->nb_hooks] = data;
+    exec->nb_hooks++;
+    return 0;
+}
+
+void executor_start(struct executor_t *exec)
+{
+    if (exec->nb_hooks == 0 || exec->nb_workers == 0)
+        return;
+    if (sem_init(&exec->ready, 0, 0) == -1
+        || pthread_mutex_init(&exec->done_lock, NULL) != 0)
+        errx(1, "cannot initialize executor");
+    exec->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (exec->event_fd == -1)
+        errx(1, "cannot create executor eventfd");
+
+    exec->workers =
+        xcalloc_tag(MEM_TASKS, exec->nb_workers, sizeof(struct worker_t));
+    for (size_t i = 0; i < exec->nb_workers; i++)
+    {
+        struct worker_t *worker = &exec->workers[i];
+        if (pthread_mutex_init(&worker->lock, NULL) != 0)
+            errx(1, "cannot initialize executor");
+        worker->deque =
+            xmalloc_tag(MEM_TASKS, DEQUE_SIZE * sizeof(struct task_t *));
+        worker->cap = DEQUE_SIZE;
+        worker->index = i;
+        worker->exec = exec;
+    }
+    for (size_t i = 0; i < exec->nb_workers; i++)
+    {
+        if (pthread_create(&exec->workers[i].thread, NULL, work,
+                           &exec->workers[i])
+            != 0)
+            errx(1, "cannot start executor thread");
+    }
+}
+
+static void hand_back(struct executor_t *exec, struct task_t *task)
+{
+    uint64_t latency = now_ns() - task->submitted;
+    exec->latency_ns += latency;
+    if (latency > exec->latency_max_ns)
+        exec->latency_max_ns = latency;
+    exec->tasks++;
+    exec->dropped += task->msg == NULL;
+    exec->done(task->owner, task->msg, task->more, exec->data);
+    xfree_tag(MEM_TASKS, task);
+}
+
+void executor_submit(struct executor_t *exec, int owner,
+                     struct message_t *msg, int more)
+{
+    struct task_t *task = xcalloc_tag(MEM_TASKS, 1, sizeof(struct task_t));
+    task->msg = msg;
+    task->submitted = now_ns();
+    task->owner = owner;
+    task->more = more;
+    if (exec->workers == NULL)
+    {
+        run_hooks(exec, task);
+        hand_back(exec, task);
+        return;
+    }
+
+    if ((size_t)owner >= exec->senders_cap)
+    {
+        size_t cap = exec->senders_cap ? exec->senders_cap : 64;
+        while (cap <= (size_t)owner)
+            cap *= 2;
+        exec->senders = xrealloc_tag(MEM_TASKS, exec->senders,
+                                     cap * sizeof(struct sender_t));
+        memset(exec->senders + exec->senders_cap, 0,
+               (cap - exec->senders_cap) * sizeof(struct sender_t));
+        exec->senders_cap = cap;
+    }
+    struct sender_t *sender = &exec->senders[owner];
+    if (sender->last != NULL)
+        sender->last->next = task;
+    else
+        sender->first = task;
+    sender->last = task;
+    exec->inflight++;
+
+    /* the lines of a sender start on the same worker, in order */
+    deque_push(&exec->workers[(size_t)owner % exec->nb_workers], task);
+    sem_post(&exec->ready);
+}
+
+struct message_t *executor_run(struct executor_t *exec, int owner,
+                               struct message_t *msg)
+{
+    struct task_t task = { 0 };
+    task.msg = msg;
+    task.owner = owner;
+    run_hooks(exec, &task);
+    return task.msg;
+}
+
+static void release_sender(struct executor_t *exec, struct sender_t *sender)
+{
+    while (sender->first != NULL && sender->first->done)
+    {
+        struct task_t *task = sender->first;
+        sender->first = task->next;
+        if (sender->first == NULL)
+            sender->last = NULL;
+        exec->inflight--;
+        hand_back(exec, task);
+    }
+}
+
+void executor_complete(struct executor_t *exec)
+{
+    uint64_t count = 0;
+    if (read(exec->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        errx(1, "cannot read executor eventfd");
+
+    pthread_mutex_lock(&exec->done_lock);
+    struct task_t *list = exec->done_list;
+    exec->done_list = NULL;
+    pthread_mutex_unlock(&exec->done_lock);
+
+    /* release_sender() frees tasks further in the list, note the owners */
+    size_t nb = 0;
+    for (struct task_t *task = list; task != NULL; task = task->link)
+    {
+        task->done = 1;
+        if (nb == exec->owners_cap)
+        {
+            exec->owners_cap = exec->owners_cap ? exec->owners_cap * 2 : 64;
+            exec->owners = xrealloc_tag(MEM_TASKS, exec->owners,
+                                        exec->owners_cap * sizeof(int));
+        }
+        exec->owners[nb++] = task->owner;
+    }
+    for (size_t i = 0; i < nb; i++)
+        release_sender(exec, &exec->senders[exec->owners[i]]);
+}
+
+void executor_drain(struct executor_t *exec)
+{
+    while (exec->inflight != 0)
+    {
+        struct pollfd pfd = { exec->event_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            errx(1, "cannot wait for the executor");
+        executor_complete(exec);
+    }
+}
+
+int executor_congested(const struct executor_t *exec)
+{
+    return exec->inflight > EXECUTOR_MAX_INFLIGHT;
+}
@@ -0,0 +1,244 @@
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+/**
+ * \brief Most worker threads given with -W
+ */
+#define EXECUTOR_MAX_WORKERS 64
+
+/**
+ * \brief Most hooks chained on a message
+ */
+#define EXECUTOR_MAX_HOOKS 8
+
+/**
+ * \brief Tasks in flight after which the event loop stops reading clients
+ */
+#define EXECUTOR_MAX_INFLIGHT 65536
+
+/**
+ * \brief Transform run on every message before it is broadcast
+ *
+ * \param msg: the message, unshared so that the hook may modify it in place
+ * \param owner: the sender, a client socket
+ * \param more: the message is a chunk of a cut through line
+ * \param data: the pointer given to executor_hook()
+ *
+ * \return msg, a new message replacing it, or NULL to drop it
+ *
+ * Hooks run concurrently on the worker threads and must not touch the
+ * server state. A hook returning another message or NULL unrefs msg, and
+ * the message it returns must not be shared either. Chunks
+ * of a cut through line should be transformed rather than dropped.
+ */
+typedef struct message_t *(*hook_fn)(struct message_t *msg, int owner,
+                                     int more, void *data);
+
+/**
+ * \brief Called by the event loop with every processed message
+ *
+ * \param owner: the sender given to executor_submit()
+ * \param msg: the transformed message and its reference, NULL if dropped
+ * \param more: the more flag given to executor_submit()
+ * \param data: the pointer given to executor_init()
+ */
+typedef void (*done_fn)(int owner, struct message_t *msg, int more,
+                        void *data);
+
+/**
+ * \brief A message going through the hooks
+ */
+struct task_t
+{
+    struct task_t *next; /**< next task of the same sender */
+
+    struct task_t *link; /**< next task of the completion list */
+
+    struct message_t *msg; /**< the message, replaced by the hooks */
+
+    uint64_t submitted; /**< monotonic time of the submission in ns */
+
+    int owner; /**< the sender */
+
+    int more; /**< chunk of a cut through line */
+
+    int done; /**< the hooks ran, set by the event loop */
+};
+
+/**
+ * \brief Tasks of one sender in submission order
+ */
+struct sender_t
+{
+    struct task_t *first; /**< oldest task not handed back */
+
+    struct task_t *last; /**< newest task */
+};
+
+/**
+ * \brief A worker thread and its deque of tasks
+ *
+ * The owner pops the oldest task, thieves take the newest one so that they
+ * rarely fight over the same end.
+ */
+struct worker_t
+{
+    pthread_mutex_t lock; /**< protects the deque */
+
+    struct task_t **deque; /**< ring of tasks */
+
+    size_t first; /**< index of the oldest task */
+
+    size_t count; /**< number of tasks */
+
+    size_t cap; /**< allocated length of deque, a power of two */
+
+    pthread_t thread; /**< the thread */
+
+    size_t index; /**< position in the workers array */
+
+    struct executor_t *exec; /**< the executor */
+};
+
+/**
+ * \brief Thread pool running the hooks off the event loop
+ *
+ * The event loop submits every line to the worker of its sender, idle
+ * workers steal from the others. Processed tasks are posted back on a list
+ * and signaled with an eventfd, and the event loop hands them to done in
+ * submission order per sender, whatever the order they finished in.
+ */
+struct executor_t
+{
+    hook_fn hooks[EXECUTOR_MAX_HOOKS]; /**< the transforms, in order */
+
+    void *hook_data[EXECUTOR_MAX_HOOKS]; /**< their data pointers */
+
+    size_t nb_hooks; /**< number of hooks, the executor is off if 0 */
+
+    struct worker_t *workers; /**< the threads, NULL to run hooks inline */
+
+    size_t nb_workers; /**< number of threads */
+
+    sem_t ready; /**< counts the tasks waiting in the deques */
+
+    pthread_mutex_t done_lock; /**< protects done_list */
+
+    struct task_t *done_list; /**< processed tasks, newest first */
+
+    int event_fd; /**< eventfd(2) signaling done_list, -1 if inline */
+
+    done_fn done; /**< receives the processed messages */
+
+    void *data; /**< data pointer of done */
+
+    struct sender_t *senders; /**< in flight tasks indexed by owner */
+
+    size_t senders_cap; /**< length of senders */
+
+    int *owners; /**< senders of the tasks being completed */
+
+    size_t owners_cap; /**< length of owners */
+
+    size_t inflight; /**< tasks submitted and not handed back */
+
+    uint64_t tasks; /**< tasks handed back */
+
+    uint64_t dropped; /**< messages dropped by a hook */
+
+    uint64_t stolen; /**< tasks run by another worker, accessed atomically */
+
+    uint64_t latency_ns; /**< sum of the submission to hand back delays */
+
+    uint64_t latency_max_ns; /**< longest submission to hand back delay */
+};
+
+/**
+ * \brief Initialize an executor with no hook
+ *
+ * \param exec: the executor
+ * \param nb_workers: number of threads, 0 to run the hooks in the event loop
+ * \param done: receives the processed messages
+ * \param data: data pointer of done
+ */
+void executor_init(struct executor_t *exec, size_t nb_workers, done_fn done,
+                   void *data);
+
+/**
+ * \brief Append a hook to the chain
+ *
+ * \param exec: the executor, not started
+ * \param hook: the transform
+ * \param data: data pointer of hook
+ *
+ * \return 0 on success, -1 if there are EXECUTOR_MAX_HOOKS hooks already
+ */
+int executor_hook(struct executor_t *exec, hook_fn hook, void *data);
+
+/**
+ * \brief Start the worker threads if there is a hook
+ *
+ * \param exec: the executor
+ */
+void executor_start(struct executor_t *exec);
+
+/**
+ * \brief Run the hooks on a message
+ *
+ * \param exec: the executor, with at least one hook
+ * \param owner: the sender, a socket fd
+ * \param msg: the message and its reference
+ * \param more: the message is a chunk of a cut through line
+ *
+ * Without workers the hooks run right away and done is called before this
+ * returns.
+ */
+void executor_submit(struct executor_t *exec, int owner,
+                     struct message_t *msg, int more);
+
+/**
+ * \brief Run the hooks on a message on the calling thread
+ *
+ * \param exec: the executor
+ * \param owner: the sender, a socket fd
+ * \param msg: a complete line, unshared, and its reference
+ *
+ * For the lines that do not go to the stream, like direct messages. done is
+ * not called and the line is not counted in tasks nor dropped.
+ *
+ * \return The message the hooks returned, NULL if they dropped it
+ */
+struct message_t *executor_run(struct executor_t *exec, int owner,
+                               struct message_t *msg);
+
+/**
+ * \brief Hand the processed tasks back, to be called when event_fd is ready
+ *
+ * \param exec: the executor
+ */
+void executor_complete(struct executor_t *exec);
+
+/**
+ * \brief Wait for every task in flight and hand them back
+ *
+ * \param exec: the executor
+ */
+void executor_drain(struct executor_t *exec);
+
+/**
+ * \brief Tell if too many tasks are in flight
+ *
+ * \param exec: the executor
+ *
+ * \return 1 if clients must stop being read, 0 otherwise
+ */
+int executor_congested(const struct executor_t *exec);
+
+#endif /* EXECUTOR_H_ */
@@ -0,0 +1,469 @@
+#include "filter.h"
+
+#include <err.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utils/xalloc.h"
+
+/**
+ * \brief A term read from the list
+ */
+struct term_t
+{
+    const char *data; /**< the bytes, inside the list */
+
+    size_t len; /**< number of bytes */
+
+    uint8_t action; /**< FILTER_* bit */
+};
+
+static uint8_t fold(uint8_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static uint8_t parse_action(const char **line, size_t *len)
+{
+    static const struct
+    {
+        const char *prefix;
+        uint8_t action;
+    } prefixes[] = {
+        { "reject:", FILTER_REJECT },
+        { "mask:", FILTER_MASK },
+        { "flag:", FILTER_FLAG },
+    };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+    {
+        size_t plen = strlen(prefixes[i].prefix);
+        if (*len > plen && memcmp(*line, prefixes[i].prefix, plen) == 0)
+        {
+            *line += plen;
+            *len -= plen;
+            return prefixes[i].action;
+        }
+    }
+    return FILTER_MASK;
+}
+
+static struct term_t *parse_terms(const char *text, size_t len, size_t *count)
+{
+    size_t cap = 64;
+    struct term_t *terms = xmalloc_tag(MEM_FILTER, cap * sizeof(struct term_t));
+    *count = 0;
+    const char *end = text + len;
+    while (text < end)
+    {
+        const char *eol = memchr(text, '\n', end - text);
+        if (eol == NULL)
+            eol = end;
+        const char *line = text;
+        size_t line_len = eol - text;
+        text = eol + 1;
+        if (line_len != 0 && line[line_len - 1] == '\r')
+            line_len--;
+        if (line_len == 0 || line[0] == '#')
+            continue;
+
+        uint8_t action = parse_action(&line, &line_len);
+        if (line_len > FILTER_MAX_TERM)
+        {
+            xfree_tag(MEM_FILTER, terms);
+            return NULL;
+        }
+        if (*count == cap)
+        {
+            cap *= 2;
+            terms =
+                xrealloc_tag(MEM_FILTER, terms, cap * sizeof(struct term_t));
+        }
+        terms[*count].data = line;
+        terms[*count].len = line_len;
+        terms[*count].action = action;
+        (*count)++;
+    }
+    return terms;
+}
+
+static uint32_t new_state(struct automaton_t *ac, size_t *cap)
+{
+    if (ac->nb_states == *cap)
+    {
+        *cap *= 2;
+        ac->next = xrealloc_tag(MEM_FILTER, ac->next,
+                                *cap * ac->nb_classes * sizeof(uint32_t));
+        ac->mask_len =
+            xrealloc_tag(MEM_FILTER, ac->mask_len, *cap * sizeof(uint32_t));
+        ac->actions = xrealloc_tag(MEM_FILTER, ac->actions, *cap);
+    }
+    uint32_t s = ac->nb_states++;
+    memset(ac->next + (size_t)s * ac->nb_classes, 0,
+           ac->nb_classes * sizeof(uint32_t));
+    ac->mask_len[s] = 0;
+    ac->actions[s] = 0;
+    return s;
+}
+
+static void build_trie(struct automaton_t *ac, const struct term_t *terms,
+                       size_t count)
+{
+    size_t cap = 1024;
+    ac->next = xmalloc_tag(MEM_FILTER, cap * ac->nb_classes * sizeof(uint32_t));
+    ac->mask_len = xmalloc_tag(MEM_FILTER, cap * sizeof(uint32_t));
+    ac->actions = xmalloc_tag(MEM_FILTER, cap);
+    new_state(ac, &cap);
+
+    /* the root is never a child, 0 stands for no child while building */
+    for (size_t t = 0; t < count; t++)
+    {
+        uint32_t s = 0;
+        for (size_t i = 0; i < terms[t].len; i++)
+        {
+            uint8_t c = ac->classes[(uint8_t)terms[t].data[i]];
+            uint32_t child = ac->next[(size_t)s * ac->nb_classes + c];
+            if (child == 0)
+            {
+                child = new_state(ac, &cap);
+                ac->next[(size_t)s * ac->nb_classes + c] = child;
+            }
+            s = child;
+        }
+        ac->actions[s] |= terms[t].action;
+        if (terms[t].action == FILTER_MASK && terms[t].len > ac->mask_len[s])
+            ac->mask_len[s] = terms[t].len;
+    }
+}
+
+/* number the states breadth first, so that the shallow states where a scan
+ * spends most of its time share a few cache lines */
+static void renumber(struct automaton_t *ac, const uint32_t *order)
+{
+    uint32_t *rank = xmalloc_tag(MEM_FILTER, ac->nb_states * sizeof(uint32_t));
+    for (uint32_t i = 0; i < ac->nb_states; i++)
+        rank[order[i]] = i;
+    size_t row = ac->nb_classes;
+    uint32_t *next =
+        xmalloc_tag(MEM_FILTER, (size_t)ac->nb_states * row * sizeof(uint32_t));
+    uint32_t *mask_len =
+        xmalloc_tag(MEM_FILTER, ac->nb_states * sizeof(uint32_t));
+    uint8_t *actions = xmalloc_tag(MEM_FILTER, ac->nb_states);
+    for (uint32_t i = 0; i < ac->nb_states; i++)
+    {
+        for (size_t c = 0; c < row; c++)
+            next[i * row + c] = rank[ac->next[order[i] * row + c]];
+        mask_len[i] = ac->mask_len[order[i]];
+        actions[i] = ac->actions[order[i]];
+    }
+    xfree_tag(MEM_FILTER, ac->next);
+    xfree_tag(MEM_FILTER, ac->mask_len);
+    xfree_tag(MEM_FILTER, ac->actions);
+    ac->next = next;
+    ac->mask_len = mask_len;
+    ac->actions = actions;
+    xfree_tag(MEM_FILTER, rank);
+}
+
+/* breadth first, the failure state of a node is always done before it */
+static void build_links(struct automaton_t *ac)
+{
+    uint32_t *fail = xcalloc_tag(MEM_FILTER, ac->nb_states, sizeof(uint32_t));
+    uint32_t *queue = xmalloc_tag(MEM_FILTER, ac->nb_states * sizeof(uint32_t));
+    size_t head = 1;
+    size_t tail = 1;
+    queue[0] = 0;
+    for (uint32_t c = 0; c < ac->nb_classes; c++)
+    {
+        if (ac->next[c] != 0)
+            queue[tail++] = ac->next[c];
+    }
+    while (head < tail)
+    {
+        uint32_t s = queue[head++];
+        uint32_t *row = ac->next + (size_t)s * ac->nb_classes;
+        const uint32_t *fail_row = ac->next + (size_t)fail[s] * ac->nb_classes;
+        for (uint32_t c = 0; c < ac->nb_classes; c++)
+        {
+            if (row[c] == 0)
+            {
+                row[c] = fail_row[c];
+                continue;
+            }
+            uint32_t child = row[c];
+            fail[child] = fail_row[c];
+            ac->actions[child] |= ac->actions[fail[child]];
+            if (ac->mask_len[fail[child]] > ac->mask_len[child])
+                ac->mask_len[child] = ac->mask_len[fail[child]];
+            queue[tail++] = child;
+        }
+    }
+    renumber(ac, queue);
+    xfree_tag(MEM_FILTER, queue);
+    xfree_tag(MEM_FILTER, fail);
+}
+
+/* merge the closest runs of start bytes until they fit the prefilter */
+static void build_ranges(struct automaton_t *ac)
+{
+    uint8_t lo[256];
+    uint8_t hi[256];
+    size_t nb = 0;
+    for (int b = 0; b < 256; b++)
+    {
+        ac->start[b] = ac->next[ac->classes[b]] != 0;
+        if (!ac->start[b])
+            continue;
+        if (nb != 0 && hi[nb - 1] == b - 1)
+            hi[nb - 1] = b;
+        else
+        {
+            lo[nb] = b;
+            hi[nb] = b;
+            nb++;
+        }
+    }
+    while (nb > FILTER_RANGES)
+    {
+        size_t best = 0;
+        for (size_t i = 1; i + 1 < nb; i++)
+        {
+            if (lo[i + 1] - hi[i] < lo[best + 1] - hi[best])
+                best = i;
+        }
+        hi[best] = hi[best + 1];
+        memmove(lo + best + 1, lo + best + 2, nb - best - 2);
+        memmove(hi + best + 1, hi + best + 2, nb - best - 2);
+        nb--;
+    }
+    memcpy(ac->lo, lo, nb);
+    memcpy(ac->hi, hi, nb);
+    ac->nb_ranges = nb;
+    size_t covered = 0;
+    for (size_t r = 0; r < nb; r++)
+        covered += hi[r] - lo[r] + 1;
+    ac->prefilter = covered <= FILTER_PREFILTER_BYTES;
+}
+
+struct automaton_t *automaton_compile(const char *text, size_t len)
+{
+    size_t count = 0;
+    struct term_t *terms = parse_terms(text, len, &count);
+    if (terms == NULL)
+        return NULL;
+
+    struct automaton_t *ac =
+        xcalloc_tag(MEM_FILTER, 1, sizeof(struct automaton_t));
+    ac->refs = 1;
+    ac->nb_terms = count;
+    ac->nb_classes = 1;
+    for (size_t t = 0; t < count; t++)
+    {
+        for (size_t i = 0; i < terms[t].len; i++)
+        {
+            uint8_t c = fold(terms[t].data[i]);
+            if (ac->classes[c] == 0)
+                ac->classes[c] = ac->nb_classes++;
+        }
+    }
+    for (int b = 'A'; b <= 'Z'; b++)
+        ac->classes[b] = ac->classes[fold(b)];
+
+    build_trie(ac, terms, count);
+    xfree_tag(MEM_FILTER, terms);
+    build_links(ac);
+    build_ranges(ac);
+    return ac;
+}
+
+struct automaton_t *automaton_load(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    size_t cap = 4096;
+    size_t len = 0;
+    char *text = xmalloc_tag(MEM_FILTER, cap);
+    size_t r = 0;
+    while ((r = fread(text + len, 1, cap - len, file)) != 0)
+    {
+        len += r;
+        if (len == cap)
+        {
+            cap *= 2;
+            text = xrealloc_tag(MEM_FILTER, text, cap);
+        }
+    }
+    int failed = ferror(file);
+    fclose(file);
+
+    struct automaton_t *ac = failed ? NULL : automaton_compile(text, len);
+    xfree_tag(MEM_FILTER, text);
+    return ac;
+}
+
+void automaton_unref(struct automaton_t *ac)
+{
+    if (__atomic_sub_fetch(&ac->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    xfree_tag(MEM_FILTER, ac->next);
+    xfree_tag(MEM_FILTER, ac->mask_len);
+    xfree_tag(MEM_FILTER, ac->actions);
+    xfree_tag(MEM_FILTER, ac);
+}
+
+static size_t skip_root(const struct automaton_t *ac, const uint8_t *data,
+                        size_t i, size_t len)
+{
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= len)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hits = zero;
+        /* b is in [lo, hi] iff b - lo, wrapping, is at most hi - lo */
+        for (size_t r = 0; r < ac->nb_ranges; r++)
+        {
+            __m128i off = _mm_sub_epi8(block, _mm_set1_epi8(ac->lo[r]));
+            __m128i over =
+                _mm_subs_epu8(off, _mm_set1_epi8(ac->hi[r] - ac->lo[r]));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(over, zero));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && !ac->start[data[i]])
+        i++;
+    return i;
+}
+
+int automaton_scan(const struct automaton_t *ac, char *data, size_t len,
+                   int prefilter)
+{
+    uint8_t *bytes = (uint8_t *)data;
+    uint32_t s = 0;
+    int found = 0;
+    prefilter = prefilter && ac->prefilter;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s == 0 && prefilter)
+        {
+            i = skip_root(ac, bytes, i, len);
+            if (i == len)
+                break;
+        }
+        s = ac->next[(size_t)s * ac->nb_classes + ac->classes[bytes[i]]];
+        if (ac->actions[s] == 0)
+            continue;
+        found |= ac->actions[s];
+        if (ac->mask_len[s] != 0)
+            memset(data + i + 1 - ac->mask_len[s], '*', ac->mask_len[s]);
+    }
+    return found;
+}
+
+void filter_init(struct filter_t *filter, const char *path)
+{
+    memset(filter, 0, sizeof(struct filter_t));
+    filter->path = path;
+    if (pthread_mutex_init(&filter->lock, NULL) != 0)
+        errx(1, "cannot initialize filter");
+    filter->current = automaton_load(path);
+    if (filter->current == NULL)
+        errx(1, "cannot load filter terms from %s", path);
+    printf("Filter loaded: %zu terms\n", filter->current->nb_terms);
+}
+
+static void *reload(void *data)
+{
+    struct filter_t *filter = data;
+    struct automaton_t *ac = automaton_load(filter->path);
+    if (ac == NULL)
+        fprintf(stderr, "cannot reload filter terms from %s, keeping them\n",
+                filter->path);
+    else
+    {
+        pthread_mutex_lock(&filter->lock);
+        struct automaton_t *old = filter->current;
+        __atomic_store_n(&filter->current, ac, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&filter->lock);
+        /* a scan may have loaded old and not yet taken its reference */
+        while (__atomic_load_n(&filter->pinning, __ATOMIC_SEQ_CST) != 0)
+            sched_yield();
+        automaton_unref(old);
+        __atomic_add_fetch(&filter->reloads, 1, __ATOMIC_RELAXED);
+        printf("Filter reloaded: %zu terms\n", ac->nb_terms);
+    }
+    __atomic_store_n(&filter->reloading, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void filter_reload(struct filter_t *filter)
+{
+    if (__atomic_exchange_n(&filter->reloading, 1, __ATOMIC_ACQ_REL))
+        return;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, reload, filter) != 0)
+    {
+        fprintf(stderr, "cannot start filter reload\n");
+        __atomic_store_n(&filter->reloading, 0, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+struct message_t *filter_hook(struct message_t *msg, int owner, int more,
+                              void *data)
+{
+    struct filter_t *filter = data;
+    (void)owner;
+    __atomic_add_fetch(&filter->pinning, 1, __ATOMIC_SEQ_CST);
+    struct automaton_t *ac =
+        __atomic_load_n(&filter->current, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ac->refs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&filter->pinning, 1, __ATOMIC_RELEASE);
+    int found = automaton_scan(ac, msg->data, msg->len, 1);
+    automaton_unref(ac);
+
+    __atomic_add_fetch(&filter->lines, 1, __ATOMIC_RELAXED);
+    if (found & FILTER_FLAG)
+        __atomic_add_fetch(&filter->flagged, 1, __ATOMIC_RELAXED);
+    if (found & FILTER_REJECT)
+    {
+        __atomic_add_fetch(&filter->rejected, 1, __ATOMIC_RELAXED);
+        if (!more)
+        {
+            message_unref(msg);
+            return NULL;
+        }
+        memset(msg->data, '*', msg->len);
+    }
+    else if (found & FILTER_MASK)
+        __atomic_add_fetch(&filter->masked, 1, __ATOMIC_RELAXED);
+    return msg;
+}
+
+void filter_metrics(struct filter_t *filter, struct metrics_t *metrics)
+{
+    pthread_mutex_lock(&filter->lock);
+    metrics->filter_terms = filter->current->nb_terms;
+    pthread_mutex_unlock(&filter->lock);
+    metrics->filter_lines = __atomic_load_n(&filter->lines, __ATOMIC_RELAXED);
+    metrics->filter_rejected =
+        __atomic_load_n(&filter->rejected, __ATOMIC_RELAXED);
+    metrics->filter_masked = __atomic_load_n(&filter->masked, __ATOMIC_RELAXED);
+    metrics->filter_flagged =
+        __atomic_load_n(&filter->flagged, __ATOMIC_RELAXED);
+    metrics->filter_reloads =
+        __atomic_load_n(&filter->reloads, __ATOMIC_RELAXED);
+}
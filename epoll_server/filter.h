@@ -0,0 +1,203 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+#include "metrics.h"
+
+/**
+ * \brief Line dropped when it contains the term
+ */
+#define FILTER_REJECT 0x1
+
+/**
+ * \brief Term replaced with '*' in the line
+ */
+#define FILTER_MASK 0x2
+
+/**
+ * \brief Line counted and logged, but broadcast unchanged
+ */
+#define FILTER_FLAG 0x4
+
+/**
+ * \brief Longest term of a term list
+ */
+#define FILTER_MAX_TERM 255
+
+/**
+ * \brief Byte ranges tested by the prefilter
+ */
+#define FILTER_RANGES 4
+
+/**
+ * \brief Most bytes covered by the ranges for the prefilter to be used
+ *
+ * Terms starting with any letter make nearly every byte of a chat line a
+ * candidate, and the prefilter only costs time then.
+ */
+#define FILTER_PREFILTER_BYTES 32
+
+/**
+ * \brief Aho-Corasick automaton compiled from a term list
+ *
+ * The terms are matched ignoring ASCII case. The bytes are mapped to the
+ * classes of the bytes found in the terms, the other ones all share class 0,
+ * and the transitions are stored as a full nb_states x nb_classes table so
+ * that a byte costs one lookup whatever the state. While the automaton is in
+ * the root state, the prefilter skips 16 bytes at a time as long as none of
+ * them can start a term. States are numbered breadth first to keep the rows
+ * of the shallow ones, where most bytes are scanned, close together.
+ */
+struct automaton_t
+{
+    uint32_t refs; /**< filter and scans using it, changed atomically */
+
+    uint8_t classes[256]; /**< class of every byte */
+
+    uint32_t nb_classes; /**< number of classes, including class 0 */
+
+    uint32_t nb_states; /**< number of states, the root is 0 */
+
+    uint32_t *next; /**< transitions, nb_classes per state */
+
+    uint32_t *mask_len; /**< longest masked term ending in the state */
+
+    uint8_t *actions; /**< FILTER_* bits of the terms ending in the state */
+
+    uint8_t start[256]; /**< 1 for the bytes leaving the root state */
+
+    uint8_t lo[FILTER_RANGES]; /**< ranges holding every start byte */
+
+    uint8_t hi[FILTER_RANGES]; /**< inclusive ends of the ranges */
+
+    size_t nb_ranges; /**< number of ranges */
+
+    int prefilter; /**< the ranges are narrow enough for the prefilter */
+
+    size_t nb_terms; /**< number of terms compiled */
+};
+
+/**
+ * \brief Term list reloaded on SIGHUP and the counters of the filter
+ *
+ * Scans load the current automaton without the lock and take a reference on
+ * it, counted in pinning meanwhile. A reload compiles the new list on its own
+ * thread, swaps it in under the lock and waits for pinning to drop to 0
+ * before it drops its own reference: no scan is left between the load of
+ * the old automaton and its reference. The old automaton is freed by the
+ * last scan using it.
+ */
+struct filter_t
+{
+    const char *path; /**< the term list */
+
+    pthread_mutex_t lock; /**< serializes the writes to current */
+
+    struct automaton_t *current; /**< automaton of new scans, atomic loads */
+
+    int pinning; /**< scans taking a reference, accessed atomically */
+
+    int reloading; /**< a reload thread runs, accessed atomically */
+
+    uint64_t lines; /**< lines scanned, accessed atomically */
+
+    uint64_t rejected; /**< lines dropped, accessed atomically */
+
+    uint64_t masked; /**< lines with a masked term, accessed atomically */
+
+    uint64_t flagged; /**< lines flagged, accessed atomically */
+
+    uint64_t reloads; /**< successful reloads, accessed atomically */
+};
+
+/**
+ * \brief Compile a term list
+ *
+ * \param text: the list, one term per line
+ * \param len: the length of text
+ *
+ * \return The automaton with one reference, NULL if a term is too long
+ *
+ * A term may be prefixed with "reject:", "mask:" or "flag:" to choose its
+ * action, masking is the default. Empty lines and lines starting with '#'
+ * are ignored.
+ */
+struct automaton_t *automaton_compile(const char *text, size_t len);
+
+/**
+ * \brief Compile the term list of a file
+ *
+ * \param path: the file
+ *
+ * \return The automaton with one reference, NULL if the file is invalid
+ */
+struct automaton_t *automaton_load(const char *path);
+
+/**
+ * \brief Release a reference on an automaton, freeing it on the last one
+ *
+ * \param ac: the automaton
+ */
+void automaton_unref(struct automaton_t *ac);
+
+/**
+ * \brief Find the terms of a text and mask them
+ *
+ * \param ac: the automaton
+ * \param data: the text, its masked terms are replaced with '*'
+ * \param len: the length of data
+ * \param prefilter: skip the bytes that cannot start a term with SSE2, if
+ * the automaton allows it
+ *
+ * \return The FILTER_* bits of the terms found
+ */
+int automaton_scan(const struct automaton_t *ac, char *data, size_t len,
+                   int prefilter);
+
+/**
+ * \brief Load the term list of a filter
+ *
+ * \param filter: the filter
+ * \param path: the term list, read again by filter_reload()
+ */
+void filter_init(struct filter_t *filter, const char *path);
+
+/**
+ * \brief Compile the term list again on a new thread
+ *
+ * \param filter: the filter
+ *
+ * The filter keeps its terms if the file is invalid, and the request is
+ * ignored while a reload runs.
+ */
+void filter_reload(struct filter_t *filter);
+
+/**
+ * \brief Executor hook applying the actions of the terms to a line
+ *
+ * \param msg: the line
+ * \param owner: the sender
+ * \param more: the line is a chunk of a cut through line
+ * \param data: the filter
+ *
+ * \return The line, NULL if rejected
+ *
+ * Terms are not matched across the chunks of a cut through line, and a
+ * rejected chunk is masked as a whole since the rest of the line follows.
+ */
+struct message_t *filter_hook(struct message_t *msg, int owner, int more,
+                              void *data);
+
+/**
+ * \brief Copy the counters of a filter
+ *
+ * \param filter: the filter
+ * \param metrics: the counters receiving them
+ */
+void filter_metrics(struct filter_t *filter, struct metrics_t *metrics);
+
+#endif /* FILTER_H_ */
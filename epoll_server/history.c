@@ -0,0 +1,107 @@
+#include "history.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "utils/xalloc.h"
+
+void history_init(struct history_t *history, size_t lines)
+{
+    memset(history, 0, sizeof(struct history_t));
+    history->cap = lines;
+    if (lines != 0)
+        history->ring =
+            xcalloc_tag(MEM_HISTORY, lines, sizeof(struct history_entry_t));
+}
+
+static void drop_oldest(struct history_t *history)
+{
+    struct history_entry_t *entry = &history->ring[history->first];
+    history->bytes -= entry->msg->len;
+    message_unref(entry->msg);
+    entry->msg = NULL;
+    history->first = (history->first + 1) % history->cap;
+    history->count--;
+}
+
+void history_add(struct history_t *history, struct message_t *msg)
+{
+    uint64_t seq = ++history->seq;
+    int line_start = !history->mid_line;
+    history->mid_line = msg->len == 0 || msg->data[msg->len - 1] != '\n';
+
+    while (history->count != 0
+           && (history->count == history->cap
+               || history->bytes + msg->len > HISTORY_MAX_BYTES))
+        drop_oldest(history);
+    struct history_entry_t *entry =
+        &history->ring[(history->first + history->count) % history->cap];
+    entry->seq = seq;
+    entry->msg = message_ref(msg);
+    entry->line_start = line_start;
+    history->count++;
+    history->bytes += msg->len;
+}
+
+size_t history_prefix(const struct history_entry_t *entry, char *prefix)
+{
+    if (!entry->line_start)
+        return 0;
+    return snprintf(prefix, HISTORY_PREFIX, "@%llu ",
+                    (unsigned long long)entry->seq);
+}
+
+struct message_t *history_sequenced(const struct history_entry_t *entry)
+{
+    char prefix[HISTORY_PREFIX];
+    size_t len = history_prefix(entry, prefix);
+    if (len == 0)
+        return message_ref(entry->msg);
+    struct message_t *copy = message_new(NULL, len + entry->msg->len);
+    memcpy(copy->data, prefix, len);
+    memcpy(copy->data + len, entry->msg->data, entry->msg->len);
+    return copy;
+}
+
+long history_find(const struct history_t *history, uint64_t last)
+{
+    if (last > history->seq)
+        return -1;
+    if (last == history->seq)
+        return history->count;
+    if (history->count == 0 || history->ring[history->first].seq > last + 1)
+        return -1;
+
+    /* the sequence numbers are contiguous, the rest of a line was received */
+    size_t pos = last + 1 - history->ring[history->first].seq;
+    while (pos < history->count
+           && !history->ring[(history->first + pos) % history->cap].line_start)
+        pos++;
+    return pos;
+}
+
+long history_range(const struct history_t *history, uint64_t from,
+                   uint64_t to, size_t *end)
+{
+    if (history->count == 0 || from > to || to > history->seq
+        || from < history->ring[history->first].seq)
+        return -1;
+
+    /* the chunks of a cut through line come with the rest of the line */
+    size_t pos = from - history->ring[history->first].seq;
+    while (pos != 0 && !history_at(history, pos)->line_start)
+        pos--;
+    if (!history_at(history, pos)->line_start)
+        return -1;
+    size_t last = to - history->ring[history->first].seq + 1;
+    while (last < history->count && !history_at(history, last)->line_start)
+        last++;
+    *end = last;
+    return pos;
+}
+
+const struct history_entry_t *history_at(const struct history_t *history,
+                                         size_t pos)
+{
+    return &history->ring[(history->first + pos) % history->cap];
+}
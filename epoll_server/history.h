@@ -0,0 +1,138 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+/**
+ * \brief Broadcasts kept when -H is not given
+ */
+#define DEFAULT_HISTORY_LINES 4096
+
+/**
+ * \brief Most bytes kept by the history, the oldest entries go first
+ */
+#define HISTORY_MAX_BYTES (16 * 1024 * 1024)
+
+/**
+ * \brief Longest "@seq " prefix of a sequenced line
+ */
+#define HISTORY_PREFIX 22
+
+/**
+ * \brief A broadcast kept for the clients resuming a session
+ */
+struct history_entry_t
+{
+    uint64_t seq; /**< sequence number of the broadcast */
+
+    struct message_t *msg; /**< the message broadcast and a reference */
+
+    int line_start; /**< the message starts a line, it is not a later chunk */
+};
+
+/**
+ * \brief Sequence numbers of the broadcasts and the latest of them
+ *
+ * Every message fanned out gets the next sequence number. Clients with a
+ * session receive a copy of the lines prefixed with "@seq ", the chunks
+ * following the first one of a cut through line are not prefixed. The ring
+ * keeps references on the broadcasts, bounded by a number of entries and by
+ * HISTORY_MAX_BYTES. The prefixed copies are made at the fan-out only while
+ * a client is sequenced, and for the replays. The plain lines a
+ * reconnecting client gets before its /resume are all part of the replay,
+ * it can drop them.
+ */
+struct history_t
+{
+    struct history_entry_t *ring; /**< the entries, oldest at first */
+
+    size_t cap; /**< length of ring, 0 when sequencing is off */
+
+    size_t first; /**< index of the oldest entry */
+
+    size_t count; /**< number of entries */
+
+    size_t bytes; /**< bytes of the messages of the entries */
+
+    uint64_t seq; /**< sequence number of the latest broadcast */
+
+    int mid_line; /**< the latest broadcast did not end its line */
+};
+
+/**
+ * \brief Initialize a history
+ *
+ * \param history: the history
+ * \param lines: number of broadcasts kept, 0 to disable sequencing
+ */
+void history_init(struct history_t *history, size_t lines);
+
+/**
+ * \brief Number a broadcast and keep it
+ *
+ * \param history: the history, enabled
+ * \param msg: the message broadcast, the history takes a new reference
+ */
+void history_add(struct history_t *history, struct message_t *msg);
+
+/**
+ * \brief The "@seq " prefix of an entry
+ *
+ * \param entry: the entry
+ * \param prefix: receives the prefix, HISTORY_PREFIX bytes
+ *
+ * \return The length of the prefix, 0 for a chunk that does not start a line
+ */
+size_t history_prefix(const struct history_entry_t *entry, char *prefix);
+
+/**
+ * \brief The copy of an entry that the sequenced clients receive
+ *
+ * \param entry: the entry
+ *
+ * \return A new message with the "@seq " prefix, or a new reference on the
+ * message of a later chunk of a line
+ */
+struct message_t *history_sequenced(const struct history_entry_t *entry);
+
+/**
+ * \brief Find the first entry a resuming client is missing
+ *
+ * \param history: the history
+ * \param last: sequence number of the last line the client received
+ *
+ * \return The position of the first line started after last, count if the
+ * client is up to date, -1 if entries after last were dropped or last was
+ * never sent
+ */
+long history_find(const struct history_t *history, uint64_t last);
+
+/**
+ * \brief Find the entries of whole lines covering a range of broadcasts
+ *
+ * \param history: the history
+ * \param from: sequence number of the first broadcast wanted
+ * \param to: sequence number of the last broadcast wanted, from or later
+ * \param end: set to the position after the last entry
+ *
+ * \return The position of the first entry, -1 if the start of the line of
+ * from was dropped or to was never sent
+ */
+long history_range(const struct history_t *history, uint64_t from,
+                   uint64_t to, size_t *end);
+
+/**
+ * \brief Entry at a position
+ *
+ * \param history: the history
+ * \param pos: the position of the entry, 0 is the oldest
+ *
+ * \return The entry, its message without a new reference
+ */
+const struct history_entry_t *history_at(const struct history_t *history,
+                                         size_t pos);
+
+#endif /* HISTORY_H_ */
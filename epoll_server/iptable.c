@@ -0,0 +1,97 @@
+#include "iptable.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/xalloc.h"
+
+static void ip_key(const struct sockaddr *addr, unsigned char *key)
+{
+    memset(key, 0, IP_KEY_SIZE);
+    if (addr->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key, &in6->sin6_addr, IP_KEY_SIZE);
+        return;
+    }
+    if (addr->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &in->sin_addr, 4);
+    }
+}
+
+static size_t ip_hash(const unsigned char *key)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < IP_KEY_SIZE; i++)
+    {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ (hash >> 32);
+}
+
+static void grow(struct iptable_t *table)
+{
+    size_t cap = table->cap ? table->cap * 2 : 64;
+    struct ip_entry_t **chains =
+        xcalloc_tag(MEM_CONNECTIONS, cap, sizeof(struct ip_entry_t *));
+    for (size_t i = 0; i < table->cap; i++)
+    {
+        struct ip_entry_t *entry = table->chains[i];
+        while (entry != NULL)
+        {
+            struct ip_entry_t *next = entry->next;
+            size_t slot = ip_hash(entry->addr) & (cap - 1);
+            entry->next = chains[slot];
+            chains[slot] = entry;
+            entry = next;
+        }
+    }
+    xfree_tag(MEM_CONNECTIONS, table->chains);
+    table->chains = chains;
+    table->cap = cap;
+}
+
+struct ip_entry_t *iptable_get(struct iptable_t *table,
+                               const struct sockaddr *addr)
+{
+    unsigned char key[IP_KEY_SIZE];
+    ip_key(addr, key);
+
+    if (table->count >= table->cap)
+        grow(table);
+    size_t slot = ip_hash(key) & (table->cap - 1);
+    struct ip_entry_t *entry = table->chains[slot];
+    while (entry != NULL && memcmp(entry->addr, key, IP_KEY_SIZE) != 0)
+        entry = entry->next;
+    if (entry == NULL)
+    {
+        entry = xcalloc_tag(MEM_CONNECTIONS, 1, sizeof(struct ip_entry_t));
+        memcpy(entry->addr, key, IP_KEY_SIZE);
+        entry->next = table->chains[slot];
+        table->chains[slot] = entry;
+        table->count++;
+    }
+    entry->refs++;
+    return entry;
+}
+
+void iptable_put(struct iptable_t *table, struct ip_entry_t *entry)
+{
+    if (--entry->refs != 0)
+        return;
+
+    struct ip_entry_t **cur =
+        &table->chains[ip_hash(entry->addr) & (table->cap - 1)];
+    while (*cur != entry)
+        cur = &(*cur)->next;
+    *cur = entry->next;
+    table->count--;
+    xfree_tag(MEM_CONNECTIONS, entry);
+}
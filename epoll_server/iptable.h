@@ -0,0 +1,75 @@
+#ifndef IPTABLE_H_
+#define IPTABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * \brief Size of an address key, IPv4 addresses are stored IPv4-mapped
+ */
+#define IP_KEY_SIZE 16
+
+/**
+ * \brief Token bucket refilled at a fixed rate per second
+ *
+ * tokens is counted in millionths of a token so that it refills by exactly
+ * rate units per microsecond. It may go negative when a read takes more
+ * than what was left, the debt is paid back before the next read.
+ */
+struct bucket_t
+{
+    int64_t tokens; /**< millionths of tokens available */
+
+    uint64_t stamp; /**< monotonic time of the last refill in microseconds */
+};
+
+/**
+ * \brief State shared by the connections coming from one address
+ */
+struct ip_entry_t
+{
+    unsigned char addr[IP_KEY_SIZE]; /**< the address */
+
+    uint32_t refs; /**< number of connections from this address */
+
+    struct bucket_t lines; /**< lines per second of the address */
+
+    struct bucket_t bytes; /**< bytes per second of the address */
+
+    struct ip_entry_t *next; /**< next entry of the hash chain */
+};
+
+/**
+ * \brief Hash table of the addresses with at least one connection
+ */
+struct iptable_t
+{
+    struct ip_entry_t **chains; /**< hash chains, a power of two of them */
+
+    size_t cap; /**< number of chains */
+
+    size_t count; /**< number of entries */
+};
+
+/**
+ * \brief Find the entry of an address, creating it on first use
+ *
+ * \param table: the table
+ * \param addr: the address, AF_INET or AF_INET6
+ *
+ * \return The entry, with one more reference. A new entry is zeroed apart
+ * from its address.
+ */
+struct ip_entry_t *iptable_get(struct iptable_t *table,
+                               const struct sockaddr *addr);
+
+/**
+ * \brief Release a reference on an entry, freeing it on the last one
+ *
+ * \param table: the table
+ * \param entry: the entry
+ */
+void iptable_put(struct iptable_t *table, struct ip_entry_t *entry);
+
+#endif /* IPTABLE_H_ */
@@ -0,0 +1,259 @@
+#include "limiter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils/xalloc.h"
+
+/**
+ * \brief Millionths of a token in a token
+ */
+#define TOKEN 1000000
+
+/**
+ * \brief Most reads per second of a client limited in bytes
+ *
+ * A throttled client waits for a twentieth of its byte rate instead of being
+ * woken up for every few bytes refilled.
+ */
+#define LIMIT_WAKEUPS 20
+
+uint64_t limiter_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bucket_fill(struct bucket_t *bucket, size_t rate, uint64_t now)
+{
+    bucket->tokens = (int64_t)rate * TOKEN;
+    bucket->stamp = now;
+}
+
+static void bucket_refill(struct bucket_t *bucket, size_t rate, uint64_t now)
+{
+    if (rate == 0)
+        return;
+    /* a full second refills any bucket, longer gaps could overflow */
+    uint64_t elapsed = now - bucket->stamp;
+    if (elapsed > 1000000)
+        elapsed = 1000000;
+    bucket->tokens += (int64_t)(rate * elapsed);
+    if (bucket->tokens > (int64_t)rate * TOKEN)
+        bucket->tokens = (int64_t)rate * TOKEN;
+    bucket->stamp = now;
+}
+
+static size_t bucket_available(const struct bucket_t *bucket, size_t rate)
+{
+    if (rate == 0)
+        return SIZE_MAX;
+    return bucket->tokens <= 0 ? 0 : bucket->tokens / TOKEN;
+}
+
+static uint64_t bucket_wait(const struct bucket_t *bucket, size_t rate,
+                            size_t want)
+{
+    int64_t needed = (int64_t)want * TOKEN;
+    if (rate == 0 || bucket->tokens >= needed)
+        return 0;
+    return (needed - bucket->tokens + rate - 1) / rate;
+}
+
+static size_t byte_step(size_t rate, size_t max)
+{
+    if (rate == 0)
+        return max;
+    size_t step = rate / LIMIT_WAKEUPS;
+    if (step == 0)
+        step = 1;
+    return step < max ? step : max;
+}
+
+static void bucket_take(struct bucket_t *bucket, size_t rate, size_t n)
+{
+    if (rate != 0)
+        bucket->tokens -= (int64_t)n * TOKEN;
+}
+
+static size_t min_size(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+static uint64_t max_u64(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+void limiter_init(struct limiter_t *limiter, const struct config_t *cfg)
+{
+    memset(limiter, 0, sizeof(struct limiter_t));
+    limiter->client = cfg->client_rate;
+    limiter->ip = cfg->ip_rate;
+    limiter->max_per_ip = cfg->max_per_ip;
+    limiter->enabled = cfg->client_rate.lines || cfg->client_rate.bytes
+        || cfg->ip_rate.lines || cfg->ip_rate.bytes || cfg->max_per_ip;
+}
+
+int limiter_add(struct limiter_t *limiter, int fd, const struct sockaddr *addr)
+{
+    if (!limiter->enabled)
+        return 0;
+    struct ip_entry_t *ip = iptable_get(&limiter->ips, addr);
+    if (limiter->max_per_ip != 0 && ip->refs > limiter->max_per_ip)
+    {
+        iptable_put(&limiter->ips, ip);
+        return -1;
+    }
+
+    if ((size_t)fd >= limiter->by_fd_cap)
+    {
+        size_t cap = limiter->by_fd_cap ? limiter->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        limiter->by_fd = xrealloc_tag(MEM_CONNECTIONS, limiter->by_fd,
+                                      cap * sizeof(struct client_limit_t));
+        memset(limiter->by_fd + limiter->by_fd_cap, 0,
+               (cap - limiter->by_fd_cap) * sizeof(struct client_limit_t));
+        limiter->by_fd_cap = cap;
+    }
+
+    uint64_t now = limiter_now();
+    struct client_limit_t *lim = &limiter->by_fd[fd];
+    bucket_fill(&lim->lines, limiter->client.lines, now);
+    bucket_fill(&lim->bytes, limiter->client.bytes, now);
+    lim->wake = 0;
+    lim->ip = ip;
+    if (ip->refs == 1)
+    {
+        bucket_fill(&ip->lines, limiter->ip.lines, now);
+        bucket_fill(&ip->bytes, limiter->ip.bytes, now);
+    }
+    return 0;
+}
+
+void limiter_remove(struct limiter_t *limiter, int fd)
+{
+    if (!limiter->enabled)
+        return;
+    struct client_limit_t *lim = &limiter->by_fd[fd];
+    iptable_put(&limiter->ips, lim->ip);
+    memset(lim, 0, sizeof(struct client_limit_t));
+}
+
+static void heap_push(struct limiter_t *limiter, uint64_t at, int fd)
+{
+    if (limiter->heap_len == limiter->heap_cap)
+    {
+        limiter->heap_cap = limiter->heap_cap ? limiter->heap_cap * 2 : 64;
+        limiter->heap = xrealloc_tag(MEM_CONNECTIONS, limiter->heap,
+                                 limiter->heap_cap * sizeof(struct wake_t));
+    }
+    size_t i = limiter->heap_len++;
+    while (i != 0 && limiter->heap[(i - 1) / 2].at > at)
+    {
+        limiter->heap[i] = limiter->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    limiter->heap[i].at = at;
+    limiter->heap[i].fd = fd;
+}
+
+static struct wake_t heap_pop(struct limiter_t *limiter)
+{
+    struct wake_t top = limiter->heap[0];
+    struct wake_t last = limiter->heap[--limiter->heap_len];
+    size_t i = 0;
+    while (2 * i + 1 < limiter->heap_len)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < limiter->heap_len
+            && limiter->heap[child + 1].at < limiter->heap[child].at)
+            child++;
+        if (last.at <= limiter->heap[child].at)
+            break;
+        limiter->heap[i] = limiter->heap[child];
+        i = child;
+    }
+    limiter->heap[i] = last;
+    return top;
+}
+
+size_t limiter_allow(struct limiter_t *limiter, int fd, size_t max,
+                     uint64_t now)
+{
+    if (!limiter->enabled)
+        return max;
+
+    struct client_limit_t *lim = &limiter->by_fd[fd];
+    struct ip_entry_t *ip = lim->ip;
+    bucket_refill(&lim->lines, limiter->client.lines, now);
+    bucket_refill(&lim->bytes, limiter->client.bytes, now);
+    bucket_refill(&ip->lines, limiter->ip.lines, now);
+    bucket_refill(&ip->bytes, limiter->ip.bytes, now);
+
+    size_t lines = min_size(bucket_available(&lim->lines, limiter->client.lines),
+                            bucket_available(&ip->lines, limiter->ip.lines));
+    size_t bytes = min_size(bucket_available(&lim->bytes, limiter->client.bytes),
+                            bucket_available(&ip->bytes, limiter->ip.bytes));
+    size_t client_step = byte_step(limiter->client.bytes, max);
+    size_t ip_step = byte_step(limiter->ip.bytes, max);
+    if (lines != 0 && bytes >= min_size(client_step, ip_step))
+        return min_size(bytes, max);
+
+    uint64_t wait = max_u64(bucket_wait(&lim->lines, limiter->client.lines, 1),
+                            bucket_wait(&lim->bytes, limiter->client.bytes,
+                                        client_step));
+    wait = max_u64(wait, bucket_wait(&ip->lines, limiter->ip.lines, 1));
+    wait = max_u64(wait, bucket_wait(&ip->bytes, limiter->ip.bytes, ip_step));
+    lim->wake = now + wait;
+    heap_push(limiter, lim->wake, fd);
+    return 0;
+}
+
+void limiter_charge(struct limiter_t *limiter, int fd, size_t lines,
+                    size_t bytes)
+{
+    if (!limiter->enabled)
+        return;
+
+    struct client_limit_t *lim = &limiter->by_fd[fd];
+    bucket_take(&lim->lines, limiter->client.lines, lines);
+    bucket_take(&lim->bytes, limiter->client.bytes, bytes);
+    bucket_take(&lim->ip->lines, limiter->ip.lines, lines);
+    bucket_take(&lim->ip->bytes, limiter->ip.bytes, bytes);
+}
+
+/* wake times of clients gone or woken since are left in the heap */
+static int heap_stale(const struct limiter_t *limiter, const struct wake_t *w)
+{
+    return (size_t)w->fd >= limiter->by_fd_cap
+        || limiter->by_fd[w->fd].wake != w->at;
+}
+
+int limiter_expired(struct limiter_t *limiter, uint64_t now)
+{
+    while (limiter->heap_len != 0 && limiter->heap[0].at <= now)
+    {
+        struct wake_t top = heap_pop(limiter);
+        if (heap_stale(limiter, &top))
+            continue;
+        limiter->by_fd[top.fd].wake = 0;
+        return top.fd;
+    }
+    return -1;
+}
+
+int limiter_timeout(struct limiter_t *limiter, uint64_t now)
+{
+    while (limiter->heap_len != 0 && heap_stale(limiter, &limiter->heap[0]))
+        heap_pop(limiter);
+    if (limiter->heap_len == 0)
+        return -1;
+    if (limiter->heap[0].at <= now)
+        return 0;
+    return (limiter->heap[0].at - now + 999) / 1000;
+}
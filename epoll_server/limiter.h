@@ -0,0 +1,146 @@
+#ifndef LIMITER_H_
+#define LIMITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "iptable.h"
+
+/**
+ * \brief Read limits of one client, indexed by socket fd
+ */
+struct client_limit_t
+{
+    struct bucket_t lines; /**< lines per second of the client */
+
+    struct bucket_t bytes; /**< bytes per second of the client */
+
+    struct ip_entry_t *ip; /**< the address of the client */
+
+    uint64_t wake; /**< time the client is read again, 0 if not throttled */
+};
+
+/**
+ * \brief Time a throttled client is read again (min heap element)
+ */
+struct wake_t
+{
+    uint64_t at; /**< monotonic time in microseconds */
+
+    int fd; /**< the client */
+};
+
+/**
+ * \brief Token bucket rate limits on the data read from the clients
+ *
+ * Every client has a lines and a bytes bucket, and shares another pair with
+ * the clients of its address. A read takes at most the bytes left in both
+ * byte buckets, the lines it completes are charged afterwards. A client
+ * without tokens is not read until the buckets refill: the caller removes
+ * EPOLLIN and the wake heap tells when to add it back, so a flood fills the
+ * TCP window of the sender instead of the server memory.
+ */
+struct limiter_t
+{
+    struct rate_t client; /**< rates of a client */
+
+    struct rate_t ip; /**< rates of an address */
+
+    size_t max_per_ip; /**< connections of an address, 0 no limit */
+
+    int enabled; /**< a rate or the connections per address are limited */
+
+    struct client_limit_t *by_fd; /**< the limits of every socket fd */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    struct iptable_t ips; /**< the addresses of the clients */
+
+    struct wake_t *heap; /**< throttled clients, earliest first */
+
+    size_t heap_len; /**< number of elements in heap */
+
+    size_t heap_cap; /**< allocated size of heap */
+};
+
+/**
+ * \brief Current monotonic time
+ *
+ * \return The time in microseconds
+ */
+uint64_t limiter_now(void);
+
+/**
+ * \brief Initialize the limiter with the rates of the configuration
+ *
+ * \param limiter: the limiter
+ * \param cfg: the server configuration
+ */
+void limiter_init(struct limiter_t *limiter, const struct config_t *cfg);
+
+/**
+ * \brief Start limiting a new client with full buckets
+ *
+ * \param limiter: the limiter
+ * \param fd: the socket of the client
+ * \param addr: the address of the client
+ *
+ * \return 0 on success, -1 if the address already has max_per_ip connections
+ */
+int limiter_add(struct limiter_t *limiter, int fd, const struct sockaddr *addr);
+
+/**
+ * \brief Forget a client
+ *
+ * \param limiter: the limiter
+ * \param fd: the socket of the client
+ */
+void limiter_remove(struct limiter_t *limiter, int fd);
+
+/**
+ * \brief Number of bytes a client may send now
+ *
+ * \param limiter: the limiter
+ * \param fd: the socket of the client
+ * \param max: the most bytes the caller wants to read
+ * \param now: the current time
+ *
+ * \return At most max bytes, 0 if the client is throttled until its wake time
+ */
+size_t limiter_allow(struct limiter_t *limiter, int fd, size_t max,
+                     uint64_t now);
+
+/**
+ * \brief Take what a read consumed from the buckets of a client
+ *
+ * \param limiter: the limiter
+ * \param fd: the socket of the client
+ * \param lines: the number of lines completed by the read
+ * \param bytes: the number of bytes read
+ */
+void limiter_charge(struct limiter_t *limiter, int fd, size_t lines,
+                    size_t bytes);
+
+/**
+ * \brief Pop a throttled client whose wake time has come
+ *
+ * \param limiter: the limiter
+ * \param now: the current time
+ *
+ * \return The socket of the client, -1 if there is none
+ */
+int limiter_expired(struct limiter_t *limiter, uint64_t now);
+
+/**
+ * \brief Time until the next throttled client is read again
+ *
+ * \param limiter: the limiter
+ * \param now: the current time
+ *
+ * \return The epoll_wait(2) timeout in milliseconds, -1 if none is throttled
+ */
+int limiter_timeout(struct limiter_t *limiter, uint64_t now);
+
+#endif /* LIMITER_H_ */
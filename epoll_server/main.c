@@ -0,0 +1,101 @@
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#include "epoll-server.h"
+#include "upgrade.h"
+
+static void watch_fd(int epli, int fd)
+{
+    struct epoll_event event = { 0 };
+    event.data.fd = fd;
+    event.events = EPOLLIN;
+
+    if (epoll_ctl(epli, EPOLL_CTL_ADD, fd, &event) == -1)
+        errx(1, "cannot add socket to epoll");
+}
+
+static void listen_on(struct server_t *server, const char *ip,
+                      const char *port, int websocket)
+{
+    int socks[MAX_LISTENERS];
+    size_t nb = prepare_sockets(ip, port, server->cfg->backlog, socks,
+                                MAX_LISTENERS - server->nb_listeners);
+    for (size_t i = 0; i < nb; i++)
+    {
+        set_nonblocking(socks[i]);
+        struct listener_t *listener =
+            &server->listeners[server->nb_listeners++];
+        listener->sock = socks[i];
+        listener->websocket = websocket;
+    }
+}
+
+static void listen_spec(struct server_t *server, const char *spec,
+                        int websocket)
+{
+    char host[HOST_SIZE];
+    char port[PORT_SIZE];
+    if (split_host_port(spec, host, sizeof(host), port, sizeof(port)) == -1)
+        errx(1, "invalid address %s", spec);
+    listen_on(server, host, port, websocket);
+}
+
+int main(int argc, char **argv)
+{
+    struct config_t cfg;
+    if (parse_config(&cfg, argc, argv) == -1)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct server_t server;
+    server_init(&server, &cfg);
+    server.epoll_instance = epoll_create1(0);
+    server.signal_fd = metrics_signal_fd();
+    /* flush_client() writes with writev(2), which has no MSG_NOSIGNAL */
+    signal(SIGPIPE, SIG_IGN);
+    /* started after the signals are blocked so that threads inherit the mask */
+    server_start(&server);
+    poller_init(&server.poller, server.epoll_instance, cfg.busy_poll,
+                &server.metrics);
+
+    int peer_listen = -1;
+    int upgrade = cfg.upgrade_path ? upgrade_connect(cfg.upgrade_path) : -1;
+    if (upgrade != -1)
+    {
+        peer_listen = upgrade_receive(&server, upgrade);
+        printf("Took over %zu clients\n", server.clients.count);
+    }
+    else
+    {
+        if (cfg.ip != NULL)
+            listen_on(&server, cfg.ip, cfg.port, 0);
+        for (size_t i = 0; i < cfg.nb_listen; i++)
+            listen_spec(&server, cfg.listen[i], 0);
+    }
+    int ws_listening = 0;
+    for (size_t i = 0; i < server.nb_listeners; i++)
+        ws_listening |= server.listeners[i].websocket;
+    if (!ws_listening && cfg.ws_listen != NULL)
+        listen_spec(&server, cfg.ws_listen, 1);
+    server.spare_fd = open("/dev/null", O_RDONLY);
+    for (size_t i = 0; i < server.nb_listeners; i++)
+        watch_fd(server.epoll_instance, server.listeners[i].sock);
+    watch_fd(server.epoll_instance, server.signal_fd);
+    if (server.executor.event_fd != -1)
+        watch_fd(server.epoll_instance, server.executor.event_fd);
+    federation_init(&server.fed, &cfg, server.epoll_instance, peer_listen);
+
+    if (cfg.upgrade_path != NULL)
+    {
+        server.upgrade_sock = upgrade_listen(cfg.upgrade_path);
+        watch_fd(server.epoll_instance, server.upgrade_sock);
+    }
+
+    communicate(&server);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/* sendmmsg(2) */
+#define _GNU_SOURCE
+
+#include "mcast.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "epoll-server.h"
+#include "utils/xalloc.h"
+
+static void put_u32(char *dst, uint32_t val)
+{
+    val = htonl(val);
+    memcpy(dst, &val, sizeof(uint32_t));
+}
+
+void mcast_init(struct mcast_t *mcast, const char *group, const char *ifname)
+{
+    memset(mcast, 0, sizeof(struct mcast_t));
+    char host[HOST_SIZE];
+    char port[PORT_SIZE];
+    if (split_host_port(group, host, sizeof(host), port, sizeof(port)) == -1)
+        errx(1, "invalid multicast group %s", group);
+
+    struct addrinfo hints;
+    struct addrinfo *addr = NULL;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &addr) != 0)
+        errx(1, "invalid multicast group %s", group);
+    mcast->sock = socket(addr->ai_family, SOCK_DGRAM, 0);
+    if (mcast->sock == -1)
+        errx(1, "cannot create the multicast socket");
+
+    unsigned index = 0;
+    if (ifname != NULL && (index = if_nametoindex(ifname)) == 0)
+        errx(1, "unknown interface %s", ifname);
+    int res = 0;
+    if (addr->ai_family == AF_INET6 && index != 0)
+        res = setsockopt(mcast->sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index,
+                         sizeof(index));
+    else if (index != 0)
+    {
+        struct ip_mreqn mreq;
+        memset(&mreq, 0, sizeof(struct ip_mreqn));
+        mreq.imr_ifindex = index;
+        res = setsockopt(mcast->sock, IPPROTO_IP, IP_MULTICAST_IF, &mreq,
+                         sizeof(mreq));
+    }
+    if (res == -1
+        || connect(mcast->sock, addr->ai_addr, addr->ai_addrlen) == -1)
+        errx(1, "cannot publish on the multicast group %s", group);
+    freeaddrinfo(addr);
+    set_nonblocking(mcast->sock);
+}
+
+static void grow(struct mcast_t *mcast)
+{
+    mcast->cap = mcast->cap ? mcast->cap * 2 : 64;
+    mcast->msgs = xrealloc_tag(MEM_OTHER, mcast->msgs,
+                               mcast->cap * sizeof(struct mmsghdr));
+    mcast->iov = xrealloc_tag(MEM_OTHER, mcast->iov,
+                              2 * mcast->cap * sizeof(struct iovec));
+    mcast->headers =
+        xrealloc_tag(MEM_OTHER, mcast->headers, mcast->cap * MCAST_HEADER_SIZE);
+}
+
+void mcast_add(struct mcast_t *mcast, uint64_t seq,
+               struct message_t *msg, int line_start)
+{
+    /* a broadcast this long could not be told from its flag, never sent */
+    if (msg->len >= MCAST_LINE_START)
+    {
+        mcast->dropped++;
+        return;
+    }
+    size_t off = 0;
+    do
+    {
+        if (mcast->nb == mcast->cap)
+            grow(mcast);
+        size_t part = msg->len - off;
+        if (part > MCAST_PAYLOAD)
+            part = MCAST_PAYLOAD;
+        char *header = mcast->headers + mcast->nb * MCAST_HEADER_SIZE;
+        put_u32(header, seq >> 32);
+        put_u32(header + 4, seq & 0xffffffff);
+        put_u32(header + 8, off);
+        put_u32(header + 12, msg->len | (line_start ? MCAST_LINE_START : 0));
+        /* the pointers are set by mcast_flush(), the arrays may move */
+        mcast->iov[2 * mcast->nb + 1].iov_base = msg->data + off;
+        mcast->iov[2 * mcast->nb + 1].iov_len = part;
+        mcast->nb++;
+        off += part;
+    } while (off < msg->len);
+}
+
+void mcast_flush(struct mcast_t *mcast)
+{
+    for (size_t i = 0; i < mcast->nb; i++)
+    {
+        mcast->iov[2 * i].iov_base = mcast->headers + i * MCAST_HEADER_SIZE;
+        mcast->iov[2 * i].iov_len = MCAST_HEADER_SIZE;
+        memset(&mcast->msgs[i], 0, sizeof(struct mmsghdr));
+        mcast->msgs[i].msg_hdr.msg_iov = &mcast->iov[2 * i];
+        mcast->msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    size_t sent = 0;
+    while (sent < mcast->nb)
+    {
+        size_t nb = mcast->nb - sent;
+        if (nb > UIO_MAXIOV)
+            nb = UIO_MAXIOV;
+        int res = sendmmsg(mcast->sock, mcast->msgs + sent, nb, 0);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1)
+        {
+            /* a full buffer or a lost route, /gapfill brings the lines back */
+            mcast->dropped += mcast->nb - sent;
+            break;
+        }
+        for (int i = 0; i < res; i++)
+            mcast->bytes += mcast->iov[2 * (sent + i) + 1].iov_len;
+        mcast->datagrams += res;
+        sent += res;
+    }
+    mcast->nb = 0;
+}
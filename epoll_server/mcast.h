@@ -0,0 +1,100 @@
+#ifndef MCAST_H_
+#define MCAST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+struct iovec;
+struct mmsghdr;
+
+/**
+ * \brief Size of the header in front of every datagram
+ *
+ * The header holds the sequence number of the broadcast (64 bits), the
+ * offset of the payload in the broadcast (32 bits) and the length of the
+ * broadcast (32 bits), all in network byte order.
+ */
+#define MCAST_HEADER_SIZE 16
+
+/**
+ * \brief Bit of the length field set when the broadcast starts a line
+ *
+ * The other broadcasts are the later chunks of a cut through line.
+ */
+#define MCAST_LINE_START 0x80000000u
+
+/**
+ * \brief Largest datagram, an Ethernet frame without its IP and UDP headers
+ */
+#define MCAST_DATAGRAM 1472
+
+#define MCAST_PAYLOAD (MCAST_DATAGRAM - MCAST_HEADER_SIZE)
+
+/**
+ * \brief Most broadcasts sent back by one /gapfill
+ */
+#define GAPFILL_MAX 1024
+
+/**
+ * \brief Publisher of the broadcasts on a UDP multicast group
+ *
+ * Every broadcast is split in datagrams numbered with its sequence number
+ * in the history, those of an iteration go out with a single sendmmsg(2)
+ * whatever the number of subscribers. Datagrams the socket buffer has no
+ * room for are dropped, subscribers fetch what they missed with /gapfill
+ * over TCP.
+ */
+struct mcast_t
+{
+    int sock; /**< UDP socket connected to the group, -1 when off */
+
+    struct mmsghdr *msgs; /**< datagrams of the iteration */
+
+    struct iovec *iov; /**< header and payload of every datagram */
+
+    char *headers; /**< MCAST_HEADER_SIZE bytes per datagram */
+
+    size_t nb; /**< number of datagrams queued */
+
+    size_t cap; /**< length of msgs, iov / 2 and headers / header size */
+
+    uint64_t datagrams; /**< datagrams sent */
+
+    uint64_t bytes; /**< payload bytes sent */
+
+    uint64_t dropped; /**< datagrams dropped on a full buffer or an error */
+};
+
+/**
+ * \brief Open the socket publishing on a group
+ *
+ * \param mcast: the publisher to initialize
+ * \param group: "group:port", IPv6 groups may be written [group]:port
+ * \param ifname: interface sending the datagrams, NULL for the route of
+ * the group
+ *
+ * Exits if the group cannot be used.
+ */
+void mcast_init(struct mcast_t *mcast, const char *group, const char *ifname);
+
+/**
+ * \brief Queue the datagrams of a broadcast
+ *
+ * \param mcast: the publisher
+ * \param seq: the sequence number of the broadcast
+ * \param msg: the broadcast, alive until mcast_flush()
+ * \param line_start: the broadcast starts a line
+ */
+void mcast_add(struct mcast_t *mcast, uint64_t seq,
+               struct message_t *msg, int line_start);
+
+/**
+ * \brief Send the queued datagrams
+ *
+ * \param mcast: the publisher
+ */
+void mcast_flush(struct mcast_t *mcast);
+
+#endif /* MCAST_H_ */
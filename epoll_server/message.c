@@ -0,0 +1,40 @@
+#include "message.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/xalloc.h"
+
+struct message_t *message_new(const char *data, size_t len)
+{
+    struct message_t *msg =
+        xmalloc_tag(MEM_MESSAGES, sizeof(struct message_t) + len);
+    msg->refcount = 1;
+    msg->len = len;
+    if (data != NULL)
+        memcpy(msg->data, data, len);
+    return msg;
+}
+
+struct message_t *message_ref(struct message_t *msg)
+{
+    __atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
+    return msg;
+}
+
+void message_unref(struct message_t *msg)
+{
+    if (__atomic_sub_fetch(&msg->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        xfree_tag(MEM_MESSAGES, msg);
+}
+
+void batch_add(struct batch_t *batch, struct message_t *msg)
+{
+    if (batch->len == batch->cap)
+    {
+        batch->cap = batch->cap ? batch->cap * 2 : 64;
+        batch->items = xrealloc_tag(MEM_MESSAGES, batch->items,
+                                    batch->cap * sizeof(struct message_t *));
+    }
+    batch->items[batch->len++] = msg;
+}
@@ -0,0 +1,68 @@
+#ifndef MESSAGE_H_
+#define MESSAGE_H_
+
+#include <stddef.h>
+
+/**
+ * \brief A line to broadcast, shared by reference between the recipients
+ */
+struct message_t
+{
+    size_t refcount; /**< queues and batches holding it, changed atomically */
+
+    size_t len; /**< length of data */
+
+    char data[]; /**< the bytes of the line */
+};
+
+/**
+ * \brief Create a message holding a copy of data
+ *
+ * \param data: the bytes to copy, NULL to fill the message afterwards
+ * \param len: the number of bytes
+ *
+ * \return The new message with a reference count of one
+ */
+struct message_t *message_new(const char *data, size_t len);
+
+/**
+ * \brief Take a new reference on a message
+ *
+ * \param msg: the message
+ *
+ * \return The message
+ */
+struct message_t *message_ref(struct message_t *msg);
+
+/**
+ * \brief Release a reference on a message, freeing it on the last one
+ *
+ * \param msg: the message
+ */
+void message_unref(struct message_t *msg);
+
+/**
+ * \brief Messages collected during a loop iteration, fanned out at its end
+ *
+ * Every recipient gets the whole batch queued before its socket is written,
+ * so the messages of an iteration cost one writev(2) per recipient instead of
+ * one send(2) per message and recipient.
+ */
+struct batch_t
+{
+    struct message_t **items; /**< the messages in arrival order */
+
+    size_t len; /**< number of messages in items */
+
+    size_t cap; /**< allocated size of items */
+};
+
+/**
+ * \brief Append a message to a batch
+ *
+ * \param batch: the batch
+ * \param msg: the message, the batch takes over the reference of the caller
+ */
+void batch_add(struct batch_t *batch, struct message_t *msg);
+
+#endif /* MESSAGE_H_ */
@@ -0,0 +1,147 @@
+#include "metrics.h"
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+int metrics_signal_fd(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        errx(1, "cannot block SIGUSR1, SIGHUP and SIGTERM");
+
+    int fd = signalfd(-1, &mask, 0);
+    if (fd == -1)
+        errx(1, "cannot create signalfd");
+    return fd;
+}
+
+int metrics_signal_read(int signal_fd)
+{
+    struct signalfd_siginfo info;
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+        return 0;
+    return info.ssi_signo;
+}
+
+#define COUNTER(name)                                                          \
+    {                                                                          \
+        #name, offsetof(struct metrics_t, name)                                \
+    }
+
+static const struct
+{
+    const char *name;
+    size_t offset;
+} counters[] = {
+    COUNTER(iterations),
+    COUNTER(events),
+    COUNTER(clients),
+    COUNTER(refused_full),
+    COUNTER(refused_address),
+    COUNTER(accept_errors),
+    COUNTER(accept_budget_spent),
+    COUNTER(lines_in),
+    COUNTER(bytes_in),
+    COUNTER(throttles),
+    COUNTER(lines_truncated),
+    COUNTER(lines_cut_through),
+    COUNTER(streams_expired),
+    COUNTER(deferred_bytes),
+    COUNTER(sleeps),
+    COUNTER(spin_polls),
+    COUNTER(spin_hits),
+    COUNTER(spin_ns),
+    COUNTER(spin_wasted_ns),
+    COUNTER(busy_poll_failures),
+    COUNTER(events_size),
+    COUNTER(events_burst),
+    COUNTER(idle_connection_bytes),
+    COUNTER(input_buffers_lent),
+    COUNTER(output_queues_lent),
+    COUNTER(pooled_bytes),
+    COUNTER(zerocopy_sends),
+    COUNTER(zerocopy_bytes),
+    COUNTER(zerocopy_copied),
+    COUNTER(zerocopy_fallbacks),
+    COUNTER(pipeline_depth),
+    COUNTER(pipeline_fanned),
+    COUNTER(tasks),
+    COUNTER(tasks_inflight),
+    COUNTER(tasks_stolen),
+    COUNTER(tasks_dropped),
+    COUNTER(task_latency_ns),
+    COUNTER(task_latency_max_ns),
+    COUNTER(filter_terms),
+    COUNTER(filter_lines),
+    COUNTER(filter_rejected),
+    COUNTER(filter_masked),
+    COUNTER(filter_flagged),
+    COUNTER(filter_reloads),
+    COUNTER(broadcast_seq),
+    COUNTER(history_lines),
+    COUNTER(history_bytes),
+    COUNTER(sessions),
+    COUNTER(sessions_resumed),
+    COUNTER(sessions_resynced),
+    COUNTER(websockets),
+    COUNTER(websocket_frames),
+    COUNTER(websocket_errors),
+    COUNTER(tls_handshakes),
+    COUNTER(tls_kernel_tx),
+    COUNTER(tls_kernel_rx),
+    COUNTER(tls_errors),
+    COUNTER(mcast_datagrams),
+    COUNTER(mcast_bytes),
+    COUNTER(mcast_dropped),
+    COUNTER(gapfills),
+    COUNTER(gapfill_lines),
+    COUNTER(reads),
+    COUNTER(reads_rescheduled),
+    COUNTER(who_served),
+    COUNTER(who_rebuilds),
+    COUNTER(presence_subscribers),
+    COUNTER(peer_dropped),
+};
+
+static double timeval_sec(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void metrics_dump(const struct metrics_t *metrics, FILE *out)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(*counters); i++)
+    {
+        const uint64_t *val =
+            (const uint64_t *)((const char *)metrics + counters[i].offset);
+        fprintf(out, "%s %llu\n", counters[i].name, (unsigned long long)*val);
+    }
+    for (int tag = 0; tag < MEM_TAGS; tag++)
+    {
+        const struct mem_stats_t *mem = &metrics->mem[tag];
+        const char *name = xalloc_tag_name(tag);
+        fprintf(out, "mem_%s_live %llu\n", name,
+                (unsigned long long)mem->live);
+        fprintf(out, "mem_%s_peak %llu\n", name,
+                (unsigned long long)mem->peak);
+        fprintf(out, "mem_%s_allocs %llu\n", name,
+                (unsigned long long)mem->allocs);
+        fprintf(out, "mem_%s_alloc_bytes %llu\n", name,
+                (unsigned long long)mem->alloc_bytes);
+    }
+    fprintf(out, "cpu_user_sec %.3f\n", timeval_sec(usage.ru_utime));
+    fprintf(out, "cpu_sys_sec %.3f\n", timeval_sec(usage.ru_stime));
+    fflush(out);
+}
@@ -0,0 +1,184 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "utils/xalloc.h"
+
+/**
+ * \brief Counters of the server, dumped on SIGUSR1
+ */
+struct metrics_t
+{
+    uint64_t iterations; /**< number of event loop iterations */
+
+    uint64_t events; /**< number of epoll events handled */
+
+    uint64_t clients; /**< number of connected clients */
+
+    uint64_t refused_full; /**< connections refused above max_clients */
+
+    uint64_t refused_address; /**< connections refused above max_per_ip */
+
+    uint64_t accept_errors; /**< failed accept(2) calls, EMFILE included */
+
+    uint64_t accept_budget_spent; /**< iterations that left a backlog */
+
+    uint64_t lines_in; /**< number of complete lines received */
+
+    uint64_t bytes_in; /**< number of bytes received from clients */
+
+    uint64_t throttles; /**< reads refused for lack of tokens */
+
+    uint64_t lines_truncated; /**< lines longer than the maximum */
+
+    uint64_t lines_cut_through; /**< lines forwarded before their end */
+
+    uint64_t streams_expired; /**< cut through lines ended for inactivity */
+
+    uint64_t deferred_bytes; /**< bytes waiting for the pinned line to end */
+
+    uint64_t sleeps; /**< blocking epoll_wait(2) calls */
+
+    uint64_t spin_polls; /**< zero timeout epoll_wait(2) calls while spinning */
+
+    uint64_t spin_hits; /**< spins that found events before the budget */
+
+    uint64_t spin_ns; /**< time spent spinning */
+
+    uint64_t spin_wasted_ns; /**< time spent in spins that found nothing */
+
+    uint64_t busy_poll_failures; /**< sockets refusing SO_BUSY_POLL */
+
+    uint64_t events_size; /**< current length of the event array */
+
+    uint64_t events_burst; /**< most events returned by one epoll_wait(2) */
+
+    uint64_t idle_connection_bytes; /**< memory held by an idle client */
+
+    uint64_t input_buffers_lent; /**< partial lines holding a buffer */
+
+    uint64_t output_queues_lent; /**< clients holding an output queue */
+
+    uint64_t pooled_bytes; /**< free memory kept by the pools for reuse */
+
+    uint64_t zerocopy_sends; /**< sends done with MSG_ZEROCOPY */
+
+    uint64_t zerocopy_bytes; /**< bytes sent with MSG_ZEROCOPY */
+
+    uint64_t zerocopy_copied; /**< zerocopy completions copied by the kernel */
+
+    uint64_t zerocopy_fallbacks; /**< large messages sent by copy */
+
+    uint64_t pipeline_depth; /**< items queued to the broadcaster threads */
+
+    uint64_t pipeline_fanned; /**< messages fanned out by the broadcasters */
+
+    uint64_t tasks; /**< lines processed by the plugins */
+
+    uint64_t tasks_inflight; /**< lines waiting for the plugins */
+
+    uint64_t tasks_stolen; /**< lines processed by another worker */
+
+    uint64_t tasks_dropped; /**< lines dropped by a plugin */
+
+    uint64_t task_latency_ns; /**< sum of the time spent in the plugins */
+
+    uint64_t task_latency_max_ns; /**< longest time spent in the plugins */
+
+    uint64_t filter_terms; /**< terms of the current filter list */
+
+    uint64_t filter_lines; /**< lines scanned by the filter */
+
+    uint64_t filter_rejected; /**< lines dropped by the filter */
+
+    uint64_t filter_masked; /**< lines with masked terms */
+
+    uint64_t filter_flagged; /**< lines flagged by the filter */
+
+    uint64_t filter_reloads; /**< term lists reloaded on SIGHUP */
+
+    uint64_t broadcast_seq; /**< sequence number of the latest broadcast */
+
+    uint64_t history_lines; /**< broadcasts kept for the resumed sessions */
+
+    uint64_t history_bytes; /**< bytes of the broadcasts kept */
+
+    uint64_t sessions; /**< sessions, attached or waiting to be resumed */
+
+    uint64_t sessions_resumed; /**< sessions resumed with the missed lines */
+
+    uint64_t sessions_resynced; /**< sessions resumed too late to replay */
+
+    uint64_t websockets; /**< connected WebSocket clients */
+
+    uint64_t websocket_frames; /**< data frames received */
+
+    uint64_t websocket_errors; /**< failed handshakes and protocol errors */
+
+    uint64_t tls_handshakes; /**< TLS handshakes completed */
+
+    uint64_t tls_kernel_tx; /**< TLS connections the kernel encrypts for */
+
+    uint64_t tls_kernel_rx; /**< TLS connections the kernel decrypts for */
+
+    uint64_t tls_errors; /**< failed handshakes and broken TLS sessions */
+
+    uint64_t mcast_datagrams; /**< datagrams sent to the multicast group */
+
+    uint64_t mcast_bytes; /**< payload bytes sent to the multicast group */
+
+    uint64_t mcast_dropped; /**< datagrams the socket could not take */
+
+    uint64_t gapfills; /**< /gapfill answered with lines */
+
+    uint64_t gapfill_lines; /**< broadcasts sent back by /gapfill */
+
+    uint64_t reads; /**< recv(2) calls on the clients */
+
+    uint64_t reads_rescheduled; /**< rounds ended by the budget, not EAGAIN */
+
+    uint64_t who_served; /**< /who answered */
+
+    uint64_t who_rebuilds; /**< lists of the users serialized for /who */
+
+    uint64_t presence_subscribers; /**< clients following joins and leaves */
+
+    uint64_t peer_dropped; /**< frames lost on peer links, see peer_forward */
+
+    struct mem_stats_t mem[MEM_TAGS]; /**< allocations of every subsystem */
+};
+
+/**
+ * \brief Create a signalfd(2) receiving SIGUSR1, SIGHUP and SIGTERM
+ *
+ * \return The signal fd, to be registered in the epoll instance
+ *
+ * The signals are blocked so that they are only delivered through the fd.
+ */
+int metrics_signal_fd(void);
+
+/**
+ * \brief Read a pending signal of the signal fd
+ *
+ * \param signal_fd: the fd returned by metrics_signal_fd()
+ *
+ * \return The signal read, 0 if none
+ */
+int metrics_signal_read(int signal_fd);
+
+/**
+ * \brief Print every counter as "name value" lines
+ *
+ * \param metrics: the counters
+ * \param out: the stream to print to
+ *
+ * The CPU time of the process is printed along with the counters so that the
+ * cost of busy polling can be put against the wakeups it saved. The memory
+ * of every subsystem follows as mem_<tag>_live, _peak, _allocs and
+ * _alloc_bytes, the allocation rates being the differences of two dumps.
+ */
+void metrics_dump(const struct metrics_t *metrics, FILE *out);
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,169 @@
+#include "nick.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/xalloc.h"
+
+static char fold(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static uint64_t nick_hash(const char *name, size_t len)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)fold(name[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ (hash >> 32);
+}
+
+static int same(const struct nick_entry_t *entry, const char *name, size_t len)
+{
+    if (strlen(entry->name) != len)
+        return 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (fold(entry->name[i]) != fold(name[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static struct nick_slot_t *slot_of(struct nick_table_t *table, int fd)
+{
+    if ((size_t)fd >= table->by_fd_cap)
+    {
+        size_t cap = table->by_fd_cap ? table->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        table->by_fd = xrealloc_tag(MEM_SESSIONS, table->by_fd,
+                                    cap * sizeof(struct nick_slot_t));
+        memset(table->by_fd + table->by_fd_cap, 0,
+               (cap - table->by_fd_cap) * sizeof(struct nick_slot_t));
+        table->by_fd_cap = cap;
+    }
+    return &table->by_fd[fd];
+}
+
+static void grow(struct nick_table_t *table)
+{
+    size_t cap = table->cap ? table->cap * 2 : 64;
+    struct nick_entry_t **chains =
+        xcalloc_tag(MEM_SESSIONS, cap, sizeof(struct nick_entry_t *));
+    for (size_t i = 0; i < table->cap; i++)
+    {
+        struct nick_entry_t *entry = table->chains[i];
+        while (entry != NULL)
+        {
+            struct nick_entry_t *next = entry->next;
+            size_t slot = entry->hash & (cap - 1);
+            entry->next = chains[slot];
+            chains[slot] = entry;
+            entry = next;
+        }
+    }
+    xfree_tag(MEM_SESSIONS, table->chains);
+    table->chains = chains;
+    table->cap = cap;
+}
+
+static struct nick_entry_t *lookup(const struct nick_table_t *table,
+                                   const char *name, size_t len, uint64_t hash)
+{
+    if (table->cap == 0)
+        return NULL;
+    struct nick_entry_t *entry = table->chains[hash & (table->cap - 1)];
+    while (entry != NULL && (entry->hash != hash || !same(entry, name, len)))
+        entry = entry->next;
+    return entry;
+}
+
+static void unlink_entry(struct nick_table_t *table, struct nick_entry_t *entry)
+{
+    struct nick_entry_t **cur = &table->chains[entry->hash & (table->cap - 1)];
+    while (*cur != entry)
+        cur = &(*cur)->next;
+    *cur = entry->next;
+    table->count--;
+    xfree_tag(MEM_SESSIONS, entry);
+}
+
+int nick_valid(const char *name, size_t len)
+{
+    if (len == 0 || len > NICK_MAX)
+        return 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = fold(name[i]);
+        if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-'
+              || c == '_'))
+            return 0;
+    }
+    return 1;
+}
+
+int nick_set(struct nick_table_t *table, int fd, const char *name, size_t len)
+{
+    uint64_t hash = nick_hash(name, len);
+    struct nick_entry_t *owner = lookup(table, name, len, hash);
+    if (owner != NULL && owner->fd != fd)
+        return -1;
+
+    /* a change of case only renames the entry in place */
+    struct nick_slot_t *slot = slot_of(table, fd);
+    if (owner != NULL)
+    {
+        memcpy(owner->name, name, len);
+        return 0;
+    }
+    if (slot->entry != NULL)
+        unlink_entry(table, slot->entry);
+
+    if (table->count >= table->cap)
+        grow(table);
+    struct nick_entry_t *entry =
+        xcalloc_tag(MEM_SESSIONS, 1, sizeof(struct nick_entry_t));
+    memcpy(entry->name, name, len);
+    entry->fd = fd;
+    entry->hash = hash;
+    entry->next = table->chains[hash & (table->cap - 1)];
+    table->chains[hash & (table->cap - 1)] = entry;
+    table->count++;
+    slot->entry = entry;
+    return 0;
+}
+
+int nick_find(const struct nick_table_t *table, const char *name, size_t len)
+{
+    if (!nick_valid(name, len))
+        return -1;
+    const struct nick_entry_t *entry =
+        lookup(table, name, len, nick_hash(name, len));
+    return entry ? entry->fd : -1;
+}
+
+const char *nick_of(const struct nick_table_t *table, int fd)
+{
+    if ((size_t)fd >= table->by_fd_cap || table->by_fd[fd].entry == NULL)
+        return NULL;
+    return table->by_fd[fd].entry->name;
+}
+
+uint32_t nick_gen(const struct nick_table_t *table, int fd)
+{
+    return (size_t)fd < table->by_fd_cap ? table->by_fd[fd].gen : 0;
+}
+
+void nick_remove(struct nick_table_t *table, int fd)
+{
+    struct nick_slot_t *slot = slot_of(table, fd);
+    if (slot->entry != NULL)
+        unlink_entry(table, slot->entry);
+    slot->entry = NULL;
+    slot->gen++;
+}
@@ -0,0 +1,118 @@
+#ifndef NICK_H_
+#define NICK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief Longest nickname
+ */
+#define NICK_MAX 32
+
+/**
+ * \brief A registered nickname
+ */
+struct nick_entry_t
+{
+    char name[NICK_MAX + 1]; /**< the nickname as registered */
+
+    int fd; /**< the client owning it */
+
+    uint64_t hash; /**< hash of the case folded name */
+
+    struct nick_entry_t *next; /**< next entry of the hash chain */
+};
+
+/**
+ * \brief Nickname and generation of a socket fd
+ */
+struct nick_slot_t
+{
+    struct nick_entry_t *entry; /**< the nickname of the client, or NULL */
+
+    uint32_t gen; /**< bumped whenever a client leaves the fd */
+};
+
+/**
+ * \brief Hash index from nickname to client and back
+ *
+ * Nicknames are unique ignoring ASCII case. Lookups, registrations, renames
+ * and removals cost O(1) whatever the number of clients. The generation of
+ * an fd tells apart the successive clients using it, so that a message
+ * addressed to a client that left is not given to the next one.
+ */
+struct nick_table_t
+{
+    struct nick_entry_t **chains; /**< hash chains, a power of two of them */
+
+    size_t cap; /**< number of chains */
+
+    size_t count; /**< number of nicknames */
+
+    struct nick_slot_t *by_fd; /**< the slot of every socket fd */
+
+    size_t by_fd_cap; /**< length of by_fd */
+};
+
+/**
+ * \brief Tell if a nickname is valid
+ *
+ * \param name: the nickname
+ * \param len: its length
+ *
+ * \return 1 if it has 1 to NICK_MAX letters, digits, '-' or '_', 0 otherwise
+ */
+int nick_valid(const char *name, size_t len);
+
+/**
+ * \brief Give a nickname to a client, replacing its previous one
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ * \param name: a valid nickname
+ * \param len: its length
+ *
+ * \return 0 on success, -1 if another client has the nickname
+ */
+int nick_set(struct nick_table_t *table, int fd, const char *name, size_t len);
+
+/**
+ * \brief Find the client with a nickname
+ *
+ * \param table: the table
+ * \param name: the nickname
+ * \param len: its length
+ *
+ * \return The socket of the client, -1 if nobody has the nickname
+ */
+int nick_find(const struct nick_table_t *table, const char *name, size_t len);
+
+/**
+ * \brief Nickname of a client
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ *
+ * \return The nickname, NULL if the client has none
+ */
+const char *nick_of(const struct nick_table_t *table, int fd);
+
+/**
+ * \brief Generation of the client on an fd
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ *
+ * \return The generation, changed once the client leaves
+ */
+uint32_t nick_gen(const struct nick_table_t *table, int fd);
+
+/**
+ * \brief Release the nickname of a leaving client and bump the generation
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ */
+void nick_remove(struct nick_table_t *table, int fd);
+
+#endif /* NICK_H_ */
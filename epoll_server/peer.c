@@ -0,0 +1,441 @@
+#include "peer.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "epoll-server.h"
+#include "utils/xalloc.h"
+
+static void put_u32(char *dst, uint32_t val)
+{
+    val = htonl(val);
+    memcpy(dst, &val, sizeof(uint32_t));
+}
+
+static uint32_t get_u32(const char *src)
+{
+    uint32_t val = 0;
+    memcpy(&val, src, sizeof(uint32_t));
+    return ntohl(val);
+}
+
+static void link_events(int epli, struct peer_t *peer, int op)
+{
+    struct epoll_event evt = { 0 };
+    evt.data.fd = peer->sock;
+    evt.events = EPOLLIN;
+    if (peer->connecting || peer->out_len != 0)
+        evt.events |= EPOLLOUT;
+    if (epoll_ctl(epli, op, peer->sock, &evt) == -1)
+        errx(1, "cannot register peer link in epoll");
+}
+
+static struct peer_t *add_peer(struct federation_t *fed, int sock,
+                               const char *addr)
+{
+    struct peer_t *peer = xcalloc_tag(MEM_PEERS, 1, sizeof(struct peer_t));
+    peer->sock = sock;
+    peer->addr = addr;
+    peer->next = fed->peers;
+    fed->peers = peer;
+    return peer;
+}
+
+/* count and discard the whole frames starting at off in out */
+static void drop_frames(struct federation_t *fed, struct peer_t *peer,
+                        size_t off)
+{
+    while (off < peer->out_len)
+    {
+        off += PEER_HEADER_SIZE + (get_u32(peer->out + off + 4) & ~PEER_MORE);
+        fed->dropped++;
+    }
+    peer->out_len = 0;
+    peer->out_partial = 0;
+}
+
+static void link_down(struct federation_t *fed, int epli, struct peer_t *peer)
+{
+    epoll_ctl(epli, EPOLL_CTL_DEL, peer->sock, NULL);
+    close(peer->sock);
+    fprintf(stderr, "Peer link %s down\n", peer->addr ? peer->addr : "in");
+    peer->sock = -1;
+    peer->connecting = 0;
+    peer->in_len = 0;
+
+    /* the rest of a frame cut by the link is of no use to the receiver */
+    if (peer->out_partial != 0)
+    {
+        memmove(peer->out, peer->out + peer->out_partial,
+                peer->out_len - peer->out_partial);
+        peer->out_len -= peer->out_partial;
+        peer->out_partial = 0;
+        fed->dropped++;
+    }
+    /* an outbound link resends the frames left once it is dialed again */
+    if (peer->addr == NULL || peer->out_len > fed->link_buffer)
+        drop_frames(fed, peer, 0);
+    if (peer->out_len != 0)
+        fprintf(stderr, "Peer link %s keeps %zu bytes\n", peer->addr,
+                peer->out_len);
+
+    if (peer->addr != NULL)
+        return;
+
+    struct peer_t **cur = &fed->peers;
+    while (*cur != peer)
+        cur = &(*cur)->next;
+    *cur = peer->next;
+    xfree_tag(MEM_PEERS, peer->out);
+    xfree_tag(MEM_PEERS, peer->in);
+    xfree_tag(MEM_PEERS, peer);
+}
+
+static void dial(struct peer_t *peer, int epli)
+{
+    char host[HOST_SIZE];
+    char port[PORT_SIZE];
+    struct addrinfo hints;
+    struct addrinfo *addr = NULL;
+
+    peer->last_attempt = time(NULL);
+    if (split_host_port(peer->addr, host, sizeof(host), port, sizeof(port))
+        == -1)
+        errx(1, "invalid peer address %s", peer->addr);
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addr) != 0)
+        return;
+
+    int sockfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sockfd == -1)
+    {
+        freeaddrinfo(addr);
+        return;
+    }
+    set_nonblocking(sockfd);
+    int res = connect(sockfd, addr->ai_addr, addr->ai_addrlen);
+    freeaddrinfo(addr);
+    if (res == -1 && errno != EINPROGRESS)
+    {
+        close(sockfd);
+        return;
+    }
+
+    peer->sock = sockfd;
+    peer->connecting = (res == -1);
+    peer->last_progress = peer->last_attempt;
+    link_events(epli, peer, EPOLL_CTL_ADD);
+}
+
+void federation_init(struct federation_t *fed, const struct config_t *cfg,
+                     int epoll_instance, int listen_sock)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    memset(fed, 0, sizeof(struct federation_t));
+    fed->origin_id = cfg->origin_id;
+    fed->next_seq = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    fed->link_buffer = cfg->link_buffer;
+    fed->listen_sock = listen_sock;
+    if (cfg->peer_listen != NULL || cfg->nb_peers != 0)
+        printf("Origin id %u\n", fed->origin_id);
+
+    if (cfg->peer_listen != NULL && listen_sock == -1)
+    {
+        char host[HOST_SIZE];
+        char port[PORT_SIZE];
+        if (split_host_port(cfg->peer_listen, host, sizeof(host), port,
+                            sizeof(port))
+            == -1)
+            errx(1, "invalid peer listen address %s", cfg->peer_listen);
+        fed->listen_sock = prepare_socket(host, port, cfg->backlog);
+    }
+    if (fed->listen_sock != -1)
+    {
+        struct epoll_event evt = { 0 };
+        evt.data.fd = fed->listen_sock;
+        evt.events = EPOLLIN;
+        if (epoll_ctl(epoll_instance, EPOLL_CTL_ADD, fed->listen_sock, &evt)
+            == -1)
+            errx(1, "cannot add peer listener to epoll");
+    }
+
+    for (size_t i = 0; i < cfg->nb_peers; i++)
+        dial(add_peer(fed, -1, cfg->peers[i]), epoll_instance);
+}
+
+static void forward_frame(struct federation_t *fed, const char *msg,
+                          size_t len, int more)
+{
+    uint64_t seq = fed->next_seq++;
+    char header[PEER_HEADER_SIZE];
+    put_u32(header, fed->origin_id);
+    put_u32(header + 4, len | (more ? PEER_MORE : 0));
+    put_u32(header + 8, seq >> 32);
+    put_u32(header + 12, seq & 0xffffffff);
+
+    for (struct peer_t *peer = fed->peers; peer != NULL; peer = peer->next)
+    {
+        size_t needed = peer->out_len + PEER_HEADER_SIZE + len;
+        /* a link not up holds its frames up to link_buffer bytes */
+        if ((peer->sock == -1 || peer->connecting)
+            && needed > fed->link_buffer)
+        {
+            fed->dropped++;
+            continue;
+        }
+        if (needed > peer->out_cap)
+        {
+            peer->out_cap = needed * 2;
+            peer->out = xrealloc_tag(MEM_PEERS, peer->out, peer->out_cap);
+        }
+        if (peer->out_len == 0)
+            peer->last_progress = time(NULL);
+        memcpy(peer->out + peer->out_len, header, PEER_HEADER_SIZE);
+        memcpy(peer->out + peer->out_len + PEER_HEADER_SIZE, msg, len);
+        peer->out_len = needed;
+    }
+}
+
+void peer_forward(struct federation_t *fed, const char *msg, size_t len,
+                  int more)
+{
+    /* a receiver drops the link on a larger frame, send chunks of a line */
+    while (len > PEER_MAX_FRAME)
+    {
+        forward_frame(fed, msg, PEER_MAX_FRAME, 1);
+        msg += PEER_MAX_FRAME;
+        len -= PEER_MAX_FRAME;
+    }
+    forward_frame(fed, msg, len, more);
+}
+
+static int link_write(struct peer_t *peer)
+{
+    size_t sent = 0;
+    while (sent < peer->out_len)
+    {
+        ssize_t w =
+            send(peer->sock, peer->out + sent, peer->out_len - sent,
+                 MSG_NOSIGNAL);
+        if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w == -1)
+            return -1;
+        sent += w;
+    }
+    if (sent != 0)
+    {
+        /* find where the last frame written in part ends */
+        size_t off = peer->out_partial;
+        while (off < sent)
+            off += PEER_HEADER_SIZE
+                + (get_u32(peer->out + off + 4) & ~PEER_MORE);
+        peer->out_partial = off - sent;
+        memmove(peer->out, peer->out + sent, peer->out_len - sent);
+        peer->out_len -= sent;
+        peer->last_progress = time(NULL);
+    }
+    return 0;
+}
+
+void peer_flush(struct federation_t *fed, int epoll_instance)
+{
+    time_t now = time(NULL);
+    struct peer_t *peer = fed->peers;
+    while (peer != NULL)
+    {
+        struct peer_t *next = peer->next;
+        if (peer->sock != -1 && !peer->connecting && peer->out_len != 0)
+        {
+            if (link_write(peer) == -1
+                || (peer->out_len > fed->link_buffer
+                    && now - peer->last_progress > PEER_STALL_TIMEOUT))
+                link_down(fed, epoll_instance, peer);
+            else
+                link_events(epoll_instance, peer, EPOLL_CTL_MOD);
+        }
+        peer = next;
+    }
+}
+
+int peer_congested(const struct federation_t *fed)
+{
+    for (struct peer_t *peer = fed->peers; peer != NULL; peer = peer->next)
+    {
+        if (peer->out_len > fed->link_buffer)
+            return 1;
+    }
+    return 0;
+}
+
+static int origin_accept(struct federation_t *fed, uint32_t id, uint64_t seq)
+{
+    if (id == fed->origin_id)
+        return 0;
+
+    struct origin_t *origin = fed->origins;
+    while (origin != NULL && origin->id != id)
+        origin = origin->next;
+    if (origin == NULL)
+    {
+        origin = xcalloc_tag(MEM_PEERS, 1, sizeof(struct origin_t));
+        origin->id = id;
+        origin->next = fed->origins;
+        fed->origins = origin;
+    }
+
+    if (seq > origin->last_seq)
+    {
+        uint64_t shift = seq - origin->last_seq;
+        origin->window = shift >= 64 ? 0 : origin->window << shift;
+        origin->window |= 1;
+        origin->last_seq = seq;
+        return 1;
+    }
+
+    uint64_t diff = origin->last_seq - seq;
+    if (diff >= 64 || (origin->window & ((uint64_t)1 << diff)))
+    {
+        fed->duplicates++;
+        return 0;
+    }
+    origin->window |= (uint64_t)1 << diff;
+    return 1;
+}
+
+static int link_read(struct federation_t *fed, struct peer_t *peer,
+                     peer_deliver_fn deliver, void *data)
+{
+    char recv_buffer[DEFAULT_BUFFER_SIZE * 8];
+    ssize_t nr = recv(peer->sock, recv_buffer, sizeof(recv_buffer), 0);
+    if (nr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (nr <= 0)
+        return -1;
+
+    if (peer->in_len + nr > peer->in_cap)
+    {
+        peer->in_cap = (peer->in_len + nr) * 2;
+        peer->in = xrealloc_tag(MEM_PEERS, peer->in, peer->in_cap);
+    }
+    memcpy(peer->in + peer->in_len, recv_buffer, nr);
+    peer->in_len += nr;
+
+    size_t off = 0;
+    while (peer->in_len - off >= PEER_HEADER_SIZE)
+    {
+        const char *frame = peer->in + off;
+        uint32_t len = get_u32(frame + 4) & ~PEER_MORE;
+        if (len > PEER_MAX_FRAME)
+            return -1;
+        if (peer->in_len - off < PEER_HEADER_SIZE + len)
+            break;
+        uint64_t seq =
+            ((uint64_t)get_u32(frame + 8) << 32) | get_u32(frame + 12);
+        uint32_t origin = get_u32(frame);
+        if (origin_accept(fed, origin, seq))
+            deliver(frame + PEER_HEADER_SIZE, len, origin,
+                    (get_u32(frame + 4) & PEER_MORE) != 0, data);
+        off += PEER_HEADER_SIZE + len;
+    }
+    memmove(peer->in, peer->in + off, peer->in_len - off);
+    peer->in_len -= off;
+    return 0;
+}
+
+static void link_accept(struct federation_t *fed, int epli)
+{
+    int sock = accept(fed->listen_sock, NULL, NULL);
+    if (sock == -1)
+        return;
+    set_nonblocking(sock);
+    struct peer_t *peer = add_peer(fed, sock, NULL);
+    peer->last_progress = time(NULL);
+    link_events(epli, peer, EPOLL_CTL_ADD);
+    printf("Peer link accepted\n");
+}
+
+static void link_connected(struct federation_t *fed, int epli,
+                           struct peer_t *peer)
+{
+    int error = 0;
+    socklen_t len = sizeof(int);
+    if (getsockopt(peer->sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1
+        || error != 0)
+    {
+        link_down(fed, epli, peer);
+        return;
+    }
+    peer->connecting = 0;
+    link_events(epli, peer, EPOLL_CTL_MOD);
+    printf("Peer link %s up\n", peer->addr);
+}
+
+int peer_handle(struct federation_t *fed, int epoll_instance, int fd,
+                uint32_t events, peer_deliver_fn deliver, void *data)
+{
+    if (fd == fed->listen_sock)
+    {
+        link_accept(fed, epoll_instance);
+        return 1;
+    }
+
+    struct peer_t *peer = fed->peers;
+    while (peer != NULL && peer->sock != fd)
+        peer = peer->next;
+    if (peer == NULL)
+        return 0;
+
+    if (peer->connecting)
+    {
+        link_connected(fed, epoll_instance, peer);
+        return 1;
+    }
+    if (events & EPOLLOUT)
+    {
+        if (link_write(peer) == -1)
+        {
+            link_down(fed, epoll_instance, peer);
+            return 1;
+        }
+        link_events(epoll_instance, peer, EPOLL_CTL_MOD);
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        if (link_read(fed, peer, deliver, data) == -1)
+            link_down(fed, epoll_instance, peer);
+    }
+    return 1;
+}
+
+int peer_reconnect(struct federation_t *fed, int epoll_instance)
+{
+    int timeout = -1;
+    time_t now = time(NULL);
+    for (struct peer_t *peer = fed->peers; peer != NULL; peer = peer->next)
+    {
+        if (peer->sock != -1)
+            continue;
+        if (now - peer->last_attempt >= PEER_RETRY_DELAY)
+            dial(peer, epoll_instance);
+        if (peer->sock == -1)
+            timeout = PEER_RETRY_DELAY * 1000;
+    }
+    return timeout;
+}
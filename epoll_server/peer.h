@@ -0,0 +1,198 @@
+#ifndef PEER_H_
+#define PEER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "config.h"
+
+/**
+ * \brief Size of the header in front of every line sent on a peer link
+ *
+ * The header holds the origin id (32 bits), the payload length (32 bits) and
+ * the origin sequence number (64 bits), all in network byte order.
+ */
+#define PEER_HEADER_SIZE 16
+
+/**
+ * \brief Bit of the length field set on the chunks of a cut through line
+ */
+#define PEER_MORE 0x80000000u
+
+/**
+ * \brief Largest payload accepted from a peer, bigger frames drop the link
+ */
+#define PEER_MAX_FRAME (64 * 1024 * 1024)
+
+/**
+ * \brief Seconds a congested link may go without progress before it is cut
+ */
+#define PEER_STALL_TIMEOUT 10
+
+/**
+ * \brief Seconds between two attempts to dial a lost outbound link
+ */
+#define PEER_RETRY_DELAY 1
+
+/**
+ * \brief A link to another server of the federation (linked list)
+ */
+struct peer_t
+{
+    int sock; /**< socket fd of the link, -1 while an outbound link is down */
+
+    const char *addr; /**< ip:port dialed, NULL for accepted links */
+
+    int connecting; /**< non-blocking connect(2) still in progress */
+
+    char *out; /**< frames waiting to be sent (batched per loop iteration) */
+
+    size_t out_len; /**< number of bytes in out */
+
+    size_t out_cap; /**< allocated size of out */
+
+    size_t out_partial; /**< bytes ending a frame written in part, in out */
+
+    char *in; /**< partial frame received from the link */
+
+    size_t in_len; /**< number of bytes in in */
+
+    size_t in_cap; /**< allocated size of in */
+
+    time_t last_progress; /**< last time pending output was written */
+
+    time_t last_attempt; /**< last time an outbound link was dialed */
+
+    struct peer_t *next; /**< next link */
+};
+
+/**
+ * \brief Duplicate filter state for one origin server (linked list)
+ *
+ * A sequence number is accepted once: the highest sequence seen is kept along
+ * with a bitmap of the 64 sequences before it.
+ */
+struct origin_t
+{
+    uint32_t id; /**< origin id of the server */
+
+    uint64_t last_seq; /**< highest sequence number accepted */
+
+    uint64_t window; /**< bit n is set if last_seq - n was accepted */
+
+    struct origin_t *next; /**< next origin */
+};
+
+/**
+ * \brief Callback delivering a line received from a peer to local clients
+ *
+ * more is set when msg is a chunk of a line continued by the next frames of
+ * the same origin.
+ */
+typedef void (*peer_deliver_fn)(const char *msg, size_t len, uint32_t origin,
+                                int more, void *data);
+
+/**
+ * \brief Contain the state of the peer link mode
+ */
+struct federation_t
+{
+    uint32_t origin_id; /**< id stamped on locally originated lines */
+
+    uint64_t next_seq; /**< sequence number of the next local line */
+
+    int listen_sock; /**< socket accepting peer links, -1 if none */
+
+    size_t link_buffer; /**< pending bytes after which a link is congested */
+
+    struct peer_t *peers; /**< all the links, up or down */
+
+    struct origin_t *origins; /**< duplicate filter of every known origin */
+
+    unsigned long duplicates; /**< number of frames dropped as duplicates */
+
+    unsigned long dropped; /**< frames lost on a link down or too far behind */
+};
+
+/**
+ * \brief Create the peer listener and dial the peers given in cfg
+ *
+ * \param fed: the federation_t to initialize
+ * \param cfg: the server configuration
+ * \param epoll_instance: the epoll instance links are registered in
+ * \param listen_sock: peer listener inherited from an upgrade, -1 to create it
+ *
+ * The sequence numbers start from the current time in microseconds so that a
+ * restarted server using the same origin id is not taken for a duplicate.
+ */
+void federation_init(struct federation_t *fed, const struct config_t *cfg,
+                     int epoll_instance, int listen_sock);
+
+/**
+ * \brief Queue a locally originated line on every link
+ *
+ * \param fed: the federation state
+ * \param msg: the line
+ * \param len: length of the line
+ * \param more: 1 if msg is a chunk of a line that continues
+ *
+ * Frames are only appended to the link buffers, they are written by
+ * peer_flush() once per loop iteration. A line longer than PEER_MAX_FRAME
+ * is split into frames of that size, all but the last one marked more.
+ *
+ * An outbound link that is down or connecting keeps its frames, up to
+ * link_buffer bytes, and sends them once it is up again. Frames past that
+ * bound, the rest of a frame cut by a link down and the frames pending on an
+ * accepted link when it goes down are lost and counted in dropped.
+ */
+void peer_forward(struct federation_t *fed, const char *msg, size_t len,
+                  int more);
+
+/**
+ * \brief Write the pending frames of every link
+ *
+ * \param fed: the federation state
+ * \param epoll_instance: the epoll instance
+ *
+ * Links that cannot take everything are registered for EPOLLOUT. Links
+ * congested without progress for PEER_STALL_TIMEOUT seconds are cut.
+ */
+void peer_flush(struct federation_t *fed, int epoll_instance);
+
+/**
+ * \brief Handle an epoll event if it concerns the federation
+ *
+ * \param fed: the federation state
+ * \param epoll_instance: the epoll instance
+ * \param fd: the fd the event is about
+ * \param events: the epoll events
+ * \param deliver: called for every new line received from a peer
+ * \param data: passed to deliver
+ *
+ * \return 1 if fd is the peer listener or a link, 0 otherwise
+ */
+int peer_handle(struct federation_t *fed, int epoll_instance, int fd,
+                uint32_t events, peer_deliver_fn deliver, void *data);
+
+/**
+ * \brief Dial again the outbound links that are down
+ *
+ * \param fed: the federation state
+ * \param epoll_instance: the epoll instance
+ *
+ * \return The epoll_wait(2) timeout needed before the next retry, -1 if all
+ * the links are up
+ */
+int peer_reconnect(struct federation_t *fed, int epoll_instance);
+
+/**
+ * \brief Tell if a link holds more pending bytes than allowed
+ *
+ * \param fed: the federation state
+ *
+ * \return 1 if local clients must stop being read, 0 otherwise
+ */
+int peer_congested(const struct federation_t *fed);
+
+#endif /* PEER_H_ */
@@ -0,0 +1,318 @@
+#include "pipeline.h"
+
+#include <err.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils/xalloc.h"
+
+static void mpsc_init(struct mpsc_t *queue)
+{
+    memset(queue, 0, sizeof(struct mpsc_t));
+    queue->cells = xmalloc_tag(
+        MEM_TASKS, PIPELINE_QUEUE_SIZE * sizeof(struct pipe_cell_t));
+    for (uint64_t i = 0; i < PIPELINE_QUEUE_SIZE; i++)
+        queue->cells[i].seq = i;
+}
+
+static int mpsc_push(struct mpsc_t *queue, const struct pipe_item_t *item)
+{
+    uint64_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    struct pipe_cell_t *cell = NULL;
+    while (1)
+    {
+        cell = &queue->cells[pos & (PIPELINE_QUEUE_SIZE - 1)];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0
+            && __atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+            break;
+        if (diff < 0)
+            return -1;
+        if (diff > 0)
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    }
+    cell->item = *item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int mpsc_pop(struct mpsc_t *queue, struct pipe_item_t *item)
+{
+    struct pipe_cell_t *cell =
+        &queue->cells[queue->head & (PIPELINE_QUEUE_SIZE - 1)];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != queue->head + 1)
+        return 0;
+    *item = cell->item;
+    __atomic_store_n(&cell->seq, queue->head + PIPELINE_QUEUE_SIZE,
+                     __ATOMIC_RELEASE);
+    queue->head++;
+    return 1;
+}
+
+static void set_output(struct broadcaster_t *stage, struct connection_t *cc,
+                       int want)
+{
+    if ((unsigned)want == cc->want_write)
+        return;
+    struct epoll_event evt = { 0 };
+    evt.data.fd = cc->client_socket;
+    evt.events = EPOLLOUT;
+    if (epoll_ctl(stage->epoll_instance, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                  cc->client_socket, &evt)
+        == -1)
+        errx(1, "cannot update recipient in broadcaster epoll instance");
+    cc->want_write = want;
+}
+
+static void send_pending(struct broadcaster_t *stage, struct connection_t *cc)
+{
+    int res = flush_client(&stage->clients, cc);
+    if (res == -1 || pending_output(cc) > MAX_PENDING_OUTPUT)
+    {
+        /* the event loop reads the EOF and removes the client */
+        shutdown(cc->client_socket, SHUT_RDWR);
+        drop_output(&stage->clients, cc);
+        cc->closing = 1;
+        res = 0;
+    }
+    set_output(stage, cc, res);
+}
+
+static void fan_out(struct broadcaster_t *stage)
+{
+    struct batch_t *batch = &stage->batch;
+    struct batch_t *tagged = &stage->tagged;
+    if (batch->len == 0)
+        return;
+    for (size_t c = 0; c < stage->clients.count; c++)
+    {
+        struct connection_t *cc = stage->clients.all[c];
+        if (cc->closing)
+            continue;
+        struct batch_t *own = cc->sequenced && tagged->len ? tagged : batch;
+        for (size_t i = 0; i < own->len; i++)
+            queue_message(&stage->clients, cc, own->items[i]);
+        if (!cc->want_write)
+            send_pending(stage, cc);
+    }
+    for (size_t i = 0; i < batch->len; i++)
+        message_unref(batch->items[i]);
+    for (size_t i = 0; i < tagged->len; i++)
+        message_unref(tagged->items[i]);
+    __atomic_add_fetch(&stage->fanned, batch->len, __ATOMIC_RELAXED);
+    batch->len = 0;
+    tagged->len = 0;
+}
+
+static void consume(struct broadcaster_t *stage)
+{
+    struct pipe_item_t item;
+    while (mpsc_pop(&stage->queue, &item))
+    {
+        __atomic_sub_fetch(&stage->depth, 1, __ATOMIC_RELAXED);
+        if (item.op == PIPE_MESSAGE)
+        {
+            batch_add(&stage->batch, item.msg);
+            if (item.tagged != NULL)
+                batch_add(&stage->tagged, item.tagged);
+            continue;
+        }
+
+        /* a new recipient only gets the messages that follow its arrival */
+        fan_out(stage);
+        if (item.op == PIPE_ADD)
+        {
+            add_client(&stage->clients, item.fd);
+            continue;
+        }
+        struct connection_t *cc = find_client(&stage->clients, item.fd);
+        if (item.op == PIPE_DIRECT)
+        {
+            if (cc != NULL && !cc->closing)
+            {
+                queue_message(&stage->clients, cc, item.msg);
+                if (!cc->want_write)
+                    send_pending(stage, cc);
+            }
+            message_unref(item.msg);
+        }
+        else if (item.op == PIPE_SEQUENCED)
+        {
+            if (cc != NULL)
+                cc->sequenced = 1;
+        }
+        else if (cc != NULL)
+        {
+            set_output(stage, cc, 0);
+            remove_client(&stage->clients, cc);
+        }
+    }
+    fan_out(stage);
+}
+
+static void *broadcast(void *data)
+{
+    struct broadcaster_t *stage = data;
+    struct epoll_event events[PIPELINE_EVENTS];
+    while (1)
+    {
+        int nb = epoll_wait(stage->epoll_instance, events, PIPELINE_EVENTS, -1);
+        if (nb == -1 && errno == EINTR)
+            continue;
+        if (nb == -1)
+            errx(1, "broadcaster epoll_wait failed");
+        for (int i = 0; i < nb; i++)
+        {
+            if (events[i].data.fd == stage->event_fd)
+            {
+                uint64_t count = 0;
+                if (read(stage->event_fd, &count, sizeof(count)) == -1
+                    && errno != EAGAIN)
+                    errx(1, "cannot read broadcaster eventfd");
+                continue;
+            }
+            struct connection_t *cc =
+                find_client(&stage->clients, events[i].data.fd);
+            if (cc != NULL && !cc->closing)
+                send_pending(stage, cc);
+        }
+        consume(stage);
+    }
+    return NULL;
+}
+
+void pipeline_init(struct pipeline_t *pipeline, size_t nb_stages)
+{
+    memset(pipeline, 0, sizeof(struct pipeline_t));
+    if (nb_stages == 0)
+        return;
+    pipeline->stages =
+        xcalloc_tag(MEM_TASKS, nb_stages, sizeof(struct broadcaster_t));
+    pipeline->nb_stages = nb_stages;
+    for (size_t i = 0; i < nb_stages; i++)
+    {
+        struct broadcaster_t *stage = &pipeline->stages[i];
+        mpsc_init(&stage->queue);
+        init_clients(&stage->clients);
+        stage->event_fd = eventfd(0, EFD_NONBLOCK);
+        stage->epoll_instance = epoll_create1(0);
+        if (stage->event_fd == -1 || stage->epoll_instance == -1)
+            errx(1, "cannot create broadcaster");
+
+        struct epoll_event evt = { 0 };
+        evt.data.fd = stage->event_fd;
+        evt.events = EPOLLIN;
+        if (epoll_ctl(stage->epoll_instance, EPOLL_CTL_ADD, stage->event_fd,
+                      &evt)
+            == -1)
+            errx(1, "cannot add eventfd to broadcaster epoll instance");
+        if (pthread_create(&stage->thread, NULL, broadcast, stage) != 0)
+            errx(1, "cannot start broadcaster thread");
+    }
+}
+
+static void push(struct broadcaster_t *stage, enum pipe_op op, int fd,
+                 struct message_t *msg, struct message_t *tagged)
+{
+    struct pipe_item_t item = { op, fd, msg, tagged };
+    __atomic_add_fetch(&stage->depth, 1, __ATOMIC_RELAXED);
+    /* only reached when the broadcaster lags a whole queue behind */
+    while (mpsc_push(&stage->queue, &item) == -1)
+        sched_yield();
+}
+
+static void wake(struct broadcaster_t *stage)
+{
+    uint64_t one = 1;
+    if (write(stage->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        errx(1, "cannot wake broadcaster");
+}
+
+void pipeline_add(struct pipeline_t *pipeline, int fd)
+{
+    struct broadcaster_t *stage =
+        &pipeline->stages[(size_t)fd % pipeline->nb_stages];
+    push(stage, PIPE_ADD, fd, NULL, NULL);
+    wake(stage);
+}
+
+void pipeline_remove(struct pipeline_t *pipeline, int fd)
+{
+    struct broadcaster_t *stage =
+        &pipeline->stages[(size_t)fd % pipeline->nb_stages];
+    push(stage, PIPE_REMOVE, fd, NULL, NULL);
+    wake(stage);
+}
+
+void pipeline_send(struct pipeline_t *pipeline, int fd, struct message_t *msg)
+{
+    struct broadcaster_t *stage =
+        &pipeline->stages[(size_t)fd % pipeline->nb_stages];
+    push(stage, PIPE_DIRECT, fd, msg, NULL);
+    wake(stage);
+}
+
+void pipeline_sequence(struct pipeline_t *pipeline, int fd)
+{
+    struct broadcaster_t *stage =
+        &pipeline->stages[(size_t)fd % pipeline->nb_stages];
+    push(stage, PIPE_SEQUENCED, fd, NULL, NULL);
+    wake(stage);
+}
+
+void pipeline_publish(struct pipeline_t *pipeline, struct batch_t *batch,
+                      struct batch_t *tagged)
+{
+    for (size_t s = 0; s < pipeline->nb_stages; s++)
+    {
+        struct broadcaster_t *stage = &pipeline->stages[s];
+        for (size_t i = 0; i < batch->len; i++)
+            push(stage, PIPE_MESSAGE, -1, message_ref(batch->items[i]),
+                 tagged ? message_ref(tagged->items[i]) : NULL);
+        wake(stage);
+    }
+    for (size_t i = 0; i < batch->len; i++)
+        message_unref(batch->items[i]);
+    batch->len = 0;
+    for (size_t i = 0; tagged != NULL && i < tagged->len; i++)
+        message_unref(tagged->items[i]);
+    if (tagged != NULL)
+        tagged->len = 0;
+}
+
+uint64_t pipeline_depth(const struct pipeline_t *pipeline)
+{
+    uint64_t depth = 0;
+    for (size_t s = 0; s < pipeline->nb_stages; s++)
+        depth += __atomic_load_n(&pipeline->stages[s].depth, __ATOMIC_RELAXED);
+    return depth;
+}
+
+uint64_t pipeline_fanned(const struct pipeline_t *pipeline)
+{
+    uint64_t fanned = 0;
+    for (size_t s = 0; s < pipeline->nb_stages; s++)
+        fanned +=
+            __atomic_load_n(&pipeline->stages[s].fanned, __ATOMIC_RELAXED);
+    return fanned;
+}
+
+int pipeline_congested(const struct pipeline_t *pipeline)
+{
+    for (size_t s = 0; s < pipeline->nb_stages; s++)
+    {
+        if (__atomic_load_n(&pipeline->stages[s].depth, __ATOMIC_RELAXED)
+            > PIPELINE_MAX_DEPTH)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "message.h"
+
+/**
+ * \brief Most broadcaster threads given with -T
+ */
+#define PIPELINE_MAX_STAGES 64
+
+/**
+ * \brief Slots of the queue of a broadcaster, a power of two
+ */
+#define PIPELINE_QUEUE_SIZE 65536
+
+/**
+ * \brief Length of the event array of a broadcaster
+ */
+#define PIPELINE_EVENTS 64
+
+/**
+ * \brief Queued items after which the event loop stops reading clients
+ */
+#define PIPELINE_MAX_DEPTH (PIPELINE_QUEUE_SIZE / 2)
+
+/**
+ * \brief Milliseconds between two depth checks of a congested event loop
+ */
+#define PIPELINE_POLL_DELAY 10
+
+/**
+ * \brief Kind of a pipeline item
+ */
+enum pipe_op
+{
+    PIPE_MESSAGE, /**< fan msg out to the recipients of the stage */
+    PIPE_ADD, /**< fd becomes a recipient of the stage */
+    PIPE_REMOVE, /**< fd leaves the stage, which closes it */
+    PIPE_DIRECT, /**< send msg to fd alone */
+    PIPE_SEQUENCED, /**< fd receives the sequenced copies from now on */
+};
+
+/**
+ * \brief Element of the queue of a broadcaster
+ */
+struct pipe_item_t
+{
+    enum pipe_op op; /**< what to do */
+
+    int fd; /**< the recipient, unused by PIPE_MESSAGE */
+
+    struct message_t *msg; /**< the message and one reference, or NULL */
+
+    struct message_t *tagged; /**< sequenced copy of a PIPE_MESSAGE, or NULL */
+};
+
+/**
+ * \brief Slot of the queue, seq tells which turn may use it
+ */
+struct pipe_cell_t
+{
+    uint64_t seq; /**< position the slot is ready for, accessed atomically */
+
+    struct pipe_item_t item; /**< the element */
+};
+
+/**
+ * \brief Bounded lock-free queue, many producers and a single consumer
+ *
+ * Producers reserve a position with a compare and swap on tail then publish
+ * their slot by bumping its sequence number, the consumer only reads head.
+ */
+struct mpsc_t
+{
+    struct pipe_cell_t *cells; /**< PIPELINE_QUEUE_SIZE slots */
+
+    char pad0[64]; /**< keeps tail away from the consumer cache line */
+
+    uint64_t tail; /**< next position to reserve, accessed atomically */
+
+    char pad1[64]; /**< keeps head away from the producers cache line */
+
+    uint64_t head; /**< next position to consume, owned by the consumer */
+};
+
+/**
+ * \brief A broadcaster thread and the recipients it owns
+ *
+ * The output side of a recipient (its queue, EPOLLOUT, write errors) lives
+ * in the table of its broadcaster and is only touched by this thread. The
+ * event loop keeps the input side and closes nothing: a recipient removed
+ * from the stage is closed by the broadcaster.
+ */
+struct broadcaster_t
+{
+    struct mpsc_t queue; /**< items pushed by the event loop */
+
+    int event_fd; /**< eventfd(2) waking the thread up after pushes */
+
+    int epoll_instance; /**< EPOLLOUT of the recipients with pending output */
+
+    uint64_t depth; /**< items pushed and not consumed, accessed atomically */
+
+    uint64_t fanned; /**< messages fanned out, accessed atomically */
+
+    struct client_table_t clients; /**< the recipients, output side only */
+
+    struct batch_t batch; /**< messages consumed during this wakeup */
+
+    struct batch_t tagged; /**< their sequenced copies, if any */
+
+    pthread_t thread; /**< the thread */
+};
+
+/**
+ * \brief Broadcaster threads partitioning the recipients by socket fd
+ */
+struct pipeline_t
+{
+    struct broadcaster_t *stages; /**< the broadcasters */
+
+    size_t nb_stages; /**< number of broadcasters, 0 when disabled */
+};
+
+/**
+ * \brief Start the broadcaster threads
+ *
+ * \param pipeline: the pipeline
+ * \param nb_stages: number of threads, 0 to fan out inline
+ */
+void pipeline_init(struct pipeline_t *pipeline, size_t nb_stages);
+
+/**
+ * \brief Make a new client a recipient of its broadcaster
+ *
+ * \param pipeline: the pipeline
+ * \param fd: the socket of the client, non blocking
+ */
+void pipeline_add(struct pipeline_t *pipeline, int fd);
+
+/**
+ * \brief Remove a client from its broadcaster, which closes the socket
+ *
+ * \param pipeline: the pipeline
+ * \param fd: the socket of the client, no longer in the event loop
+ */
+void pipeline_remove(struct pipeline_t *pipeline, int fd);
+
+/**
+ * \brief Give a recipient the sequenced copies of the messages from now on
+ *
+ * \param pipeline: the pipeline
+ * \param fd: the socket of the client
+ */
+void pipeline_sequence(struct pipeline_t *pipeline, int fd);
+
+/**
+ * \brief Hand the messages of a batch to every broadcaster
+ *
+ * \param pipeline: the pipeline
+ * \param batch: the batch, emptied and its references given away
+ * \param tagged: the sequenced copies of the messages, emptied as well, or
+ * NULL
+ */
+void pipeline_publish(struct pipeline_t *pipeline, struct batch_t *batch,
+                      struct batch_t *tagged);
+
+/**
+ * \brief Hand a message for a single client to its broadcaster
+ *
+ * \param pipeline: the pipeline
+ * \param fd: the socket of the client
+ * \param msg: the message, its reference is given away
+ */
+void pipeline_send(struct pipeline_t *pipeline, int fd, struct message_t *msg);
+
+/**
+ * \brief Total number of items waiting in the queues
+ *
+ * \param pipeline: the pipeline
+ *
+ * \return The depth of the fan-out stage
+ */
+uint64_t pipeline_depth(const struct pipeline_t *pipeline);
+
+/**
+ * \brief Total number of messages fanned out by the broadcasters
+ *
+ * \param pipeline: the pipeline
+ *
+ * \return The number of messages times the number of broadcasters
+ */
+uint64_t pipeline_fanned(const struct pipeline_t *pipeline);
+
+/**
+ * \brief Tell if a broadcaster lags more than PIPELINE_MAX_DEPTH items
+ *
+ * \param pipeline: the pipeline
+ *
+ * \return 1 if clients must stop being read, 0 otherwise
+ */
+int pipeline_congested(const struct pipeline_t *pipeline);
+
+#endif /* PIPELINE_H_ */
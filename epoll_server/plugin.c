@@ -0,0 +1,39 @@
+#include "plugin.h"
+
+#include <string.h>
+
+struct plugin_t
+{
+    const char *name; /**< the name given to -X */
+
+    hook_fn hook; /**< the transform */
+};
+
+static struct message_t *sanitize(struct message_t *msg, int owner, int more,
+                                  void *data)
+{
+    (void)owner;
+    (void)more;
+    (void)data;
+    for (size_t i = 0; i < msg->len; i++)
+    {
+        unsigned char c = msg->data[i];
+        if ((c < 0x20 && c != '\t' && c != '\n') || c == 0x7f)
+            msg->data[i] = '?';
+    }
+    return msg;
+}
+
+static const struct plugin_t plugins[] = {
+    { "sanitize", sanitize },
+};
+
+int plugin_load(struct executor_t *exec, const char *name)
+{
+    for (size_t i = 0; i < sizeof(plugins) / sizeof(plugins[0]); i++)
+    {
+        if (strcmp(plugins[i].name, name) == 0)
+            return executor_hook(exec, plugins[i].hook, NULL);
+    }
+    return -1;
+}
@@ -0,0 +1,20 @@
+#ifndef PLUGIN_H_
+#define PLUGIN_H_
+
+#include "executor.h"
+
+/**
+ * \brief Chain the hook of a built-in plugin
+ *
+ * \param exec: the executor, not started
+ * \param name: the name of the plugin
+ *
+ * \return 0 on success, -1 if no plugin has this name
+ *
+ * The plugins are:
+ * - sanitize: replaces the control characters of the lines but tabs and the
+ *   line feed with '?', so that clients cannot drive the terminal of others.
+ */
+int plugin_load(struct executor_t *exec, const char *name);
+
+#endif /* PLUGIN_H_ */
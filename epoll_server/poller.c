@@ -0,0 +1,109 @@
+#include "poller.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "epoll-server.h"
+#include "utils/xalloc.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void poller_init(struct poller_t *poller, int epoll_instance, long budget_us,
+                 struct metrics_t *metrics)
+{
+    poller->epoll_instance = epoll_instance;
+    poller->size = MAX_EVENTS;
+    poller->events =
+        xcalloc_tag(MEM_OTHER, poller->size, sizeof(struct epoll_event));
+    poller->small_bursts = 0;
+    poller->budget_us = budget_us;
+    metrics->events_size = poller->size;
+}
+
+static void resize(struct poller_t *poller, int count,
+                   struct metrics_t *metrics)
+{
+    if ((uint64_t)count > metrics->events_burst)
+        metrics->events_burst = count;
+
+    int size = poller->size;
+    if (count == size && size < MAX_EVENTS_LIMIT)
+        size *= 2;
+    else if (count < size / 4 && size > MAX_EVENTS)
+    {
+        if (++poller->small_bursts < SHRINK_DELAY)
+            return;
+        size /= 2;
+    }
+    poller->small_bursts = 0;
+    if (size == poller->size)
+        return;
+
+    poller->events = xrealloc_tag(MEM_OTHER, poller->events,
+                                  size * sizeof(struct epoll_event));
+    poller->size = size;
+    metrics->events_size = size;
+}
+
+static int spin(struct poller_t *poller, struct metrics_t *metrics)
+{
+    uint64_t start = now_ns();
+    uint64_t deadline = start + poller->budget_us * 1000;
+    uint64_t now = start;
+    int count = 0;
+
+    do
+    {
+        count = epoll_wait(poller->epoll_instance, poller->events,
+                           poller->size, 0);
+        metrics->spin_polls++;
+        now = now_ns();
+    } while (count == 0 && now < deadline);
+
+    metrics->spin_ns += now - start;
+    if (count > 0)
+        metrics->spin_hits++;
+    else
+        metrics->spin_wasted_ns += now - start;
+    return count;
+}
+
+int poller_wait(struct poller_t *poller, int timeout,
+                struct metrics_t *metrics)
+{
+    int count = 0;
+    if (poller->budget_us > 0 && timeout != 0)
+        count = spin(poller, metrics);
+    if (count == 0)
+    {
+        count = epoll_wait(poller->epoll_instance, poller->events,
+                           poller->size, timeout);
+        metrics->sleeps++;
+    }
+    if (count == -1)
+        return errno == EINTR ? 0 : -1;
+
+    resize(poller, count, metrics);
+    return count;
+}
+
+void poller_socket(const struct poller_t *poller, int sock,
+                   struct metrics_t *metrics)
+{
+    if (poller->budget_us <= 0)
+        return;
+#ifdef SO_BUSY_POLL
+    int usec = poller->budget_us;
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(int)) == -1)
+        metrics->busy_poll_failures++;
+#else
+    (void)sock;
+    metrics->busy_poll_failures++;
+#endif /* SO_BUSY_POLL */
+}
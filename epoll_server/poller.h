@@ -0,0 +1,78 @@
+#ifndef POLLER_H_
+#define POLLER_H_
+
+#include <sys/epoll.h>
+
+#include "metrics.h"
+
+/**
+ * \brief Largest length the event array may grow to
+ */
+#define MAX_EVENTS_LIMIT 4096
+
+/**
+ * \brief Iterations with a small burst before the event array shrinks
+ */
+#define SHRINK_DELAY 64
+
+/**
+ * \brief Wait for events on the epoll instance
+ *
+ * The event array starts with MAX_EVENTS elements. It doubles every time
+ * epoll_wait(2) fills it and halves after SHRINK_DELAY iterations using less
+ * than a quarter of it, so its length follows the readiness bursts.
+ *
+ * With a busy poll budget, epoll_wait(2) is first called with a zero timeout
+ * until events show up or the budget is spent, trading CPU time for the
+ * wakeup latency of a sleeping thread.
+ */
+struct poller_t
+{
+    int epoll_instance; /**< the epoll instance */
+
+    struct epoll_event *events; /**< the event array */
+
+    int size; /**< length of events */
+
+    int small_bursts; /**< consecutive iterations using under size / 4 */
+
+    long budget_us; /**< busy poll budget in microseconds, 0 to disable */
+};
+
+/**
+ * \brief Initialize a poller_t
+ *
+ * \param poller: the poller to initialize
+ * \param epoll_instance: the epoll instance to wait on
+ * \param budget_us: busy poll budget in microseconds, 0 to always sleep
+ * \param metrics: the counters of the server
+ */
+void poller_init(struct poller_t *poller, int epoll_instance, long budget_us,
+                 struct metrics_t *metrics);
+
+/**
+ * \brief Wait for events, spinning first if a budget is set
+ *
+ * \param poller: the poller
+ * \param timeout: the epoll_wait(2) timeout in milliseconds once sleeping
+ * \param metrics: the counters of the server
+ *
+ * \return The number of events stored in poller->events
+ */
+int poller_wait(struct poller_t *poller, int timeout,
+                struct metrics_t *metrics);
+
+/**
+ * \brief Enable SO_BUSY_POLL on a socket if a budget is set
+ *
+ * \param poller: the poller
+ * \param sock: the socket
+ * \param metrics: the counters of the server
+ *
+ * Raising SO_BUSY_POLL above the net.core.busy_read sysctl needs
+ * CAP_NET_ADMIN, a refusal is only counted.
+ */
+void poller_socket(const struct poller_t *poller, int sock,
+                   struct metrics_t *metrics);
+
+#endif /* POLLER_H_ */
@@ -0,0 +1,63 @@
+#include "pool.h"
+
+#include <stdlib.h>
+
+#include "utils/xalloc.h"
+
+void pool_init(struct pool_t *pool, size_t obj_size, size_t slab_objs,
+               size_t max_free, enum mem_tag_t tag)
+{
+    if (obj_size < sizeof(void *))
+        obj_size = sizeof(void *);
+    obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    pool->obj_size = obj_size;
+    pool->slab_objs = slab_objs ? slab_objs : 1;
+    pool->max_free = max_free;
+    pool->free_list = NULL;
+    pool->nb_free = 0;
+    pool->lent = 0;
+    pool->tag = tag;
+}
+
+static void grow(struct pool_t *pool)
+{
+    char *slab = xmalloc_tag(pool->tag, pool->obj_size * pool->slab_objs);
+    for (size_t i = 0; i < pool->slab_objs; i++)
+    {
+        void **obj = (void **)(slab + i * pool->obj_size);
+        *obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    pool->nb_free += pool->slab_objs;
+}
+
+void *pool_get(struct pool_t *pool)
+{
+    pool->lent++;
+    if (pool->free_list == NULL)
+    {
+        if (pool->slab_objs == 1)
+            return xmalloc_tag(pool->tag, pool->obj_size);
+        grow(pool);
+    }
+
+    void **obj = pool->free_list;
+    pool->free_list = *obj;
+    pool->nb_free--;
+    return obj;
+}
+
+void pool_put(struct pool_t *pool, void *obj)
+{
+    pool->lent--;
+    if (pool->slab_objs == 1 && pool->nb_free >= pool->max_free)
+    {
+        xfree_tag(pool->tag, obj);
+        return;
+    }
+
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->nb_free++;
+}
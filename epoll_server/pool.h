@@ -0,0 +1,62 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+#include "utils/xalloc.h"
+
+/**
+ * \brief Free list of fixed size objects shared by all the connections
+ *
+ * With slab_objs greater than one, objects are carved from slabs that are
+ * never given back, so they carry no malloc(3) header. Otherwise every object
+ * is its own allocation and at most max_free of them are kept for reuse, the
+ * others are released as soon as they are put back.
+ */
+struct pool_t
+{
+    size_t obj_size; /**< size of an object, at least a pointer */
+
+    size_t slab_objs; /**< objects per slab, 1 for single allocations */
+
+    size_t max_free; /**< single allocations kept in the free list */
+
+    void *free_list; /**< free objects, linked through their first bytes */
+
+    size_t nb_free; /**< number of objects in free_list */
+
+    size_t lent; /**< number of objects currently handed out */
+
+    enum mem_tag_t tag; /**< subsystem the slabs and objects are counted to */
+};
+
+/**
+ * \brief Initialize a pool
+ *
+ * \param pool: the pool
+ * \param obj_size: size of an object
+ * \param slab_objs: objects allocated at once, 1 to allocate them one by one
+ * \param max_free: single allocations kept for reuse
+ * \param tag: subsystem the memory of the pool is counted to
+ */
+void pool_init(struct pool_t *pool, size_t obj_size, size_t slab_objs,
+               size_t max_free, enum mem_tag_t tag);
+
+/**
+ * \brief Take an object from the pool
+ *
+ * \param pool: the pool
+ *
+ * \return An uninitialized object of obj_size bytes
+ */
+void *pool_get(struct pool_t *pool);
+
+/**
+ * \brief Give an object back to the pool
+ *
+ * \param pool: the pool
+ * \param obj: an object returned by pool_get() on the same pool
+ */
+void pool_put(struct pool_t *pool, void *obj);
+
+#endif /* POOL_H_ */
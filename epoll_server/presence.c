@@ -0,0 +1,150 @@
+#include "presence.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "utils/xalloc.h"
+
+#define ONLINE "* Online "
+#define JOIN "* Join "
+#define LEAVE "* Leave "
+
+static void stale(struct presence_t *presence)
+{
+    if (presence->snapshot != NULL)
+        message_unref(presence->snapshot);
+    presence->snapshot = NULL;
+}
+
+static void record(struct presence_t *presence, const char *prefix,
+                   const char *name)
+{
+    stale(presence);
+    /* nobody would get them, a new subscriber starts from a snapshot */
+    if (presence->nb_subscribers == 0)
+        return;
+    size_t prefix_len = strlen(prefix);
+    size_t name_len = strlen(name);
+    size_t len = prefix_len + name_len + 1;
+    if (presence->changes_len + len > presence->changes_cap)
+    {
+        size_t cap = presence->changes_cap ? presence->changes_cap : 256;
+        while (cap < presence->changes_len + len)
+            cap *= 2;
+        presence->changes =
+            xrealloc_tag(MEM_SESSIONS, presence->changes, cap);
+        presence->changes_cap = cap;
+    }
+    char *out = presence->changes + presence->changes_len;
+    memcpy(out, prefix, prefix_len);
+    memcpy(out + prefix_len, name, name_len);
+    out[len - 1] = '\n';
+    presence->changes_len += len;
+}
+
+void presence_join(struct presence_t *presence, const char *name)
+{
+    record(presence, JOIN, name);
+}
+
+void presence_leave(struct presence_t *presence, const char *name)
+{
+    record(presence, LEAVE, name);
+}
+
+struct message_t *presence_snapshot(struct presence_t *presence,
+                                    const struct nick_table_t *nicks)
+{
+    presence->served++;
+    if (presence->snapshot != NULL)
+        return message_ref(presence->snapshot);
+
+    char footer[64];
+    int footer_len =
+        snprintf(footer, sizeof(footer), "* Who %zu\n", nicks->count);
+    size_t total = footer_len;
+    for (size_t i = 0; i < nicks->cap; i++)
+    {
+        for (const struct nick_entry_t *entry = nicks->chains[i];
+             entry != NULL; entry = entry->next)
+            total += sizeof(ONLINE) - 1 + strlen(entry->name) + 1;
+    }
+
+    /* the list comes first, the count tells the client it is complete */
+    struct message_t *msg = message_new(NULL, total);
+    char *out = msg->data;
+    for (size_t i = 0; i < nicks->cap; i++)
+    {
+        for (const struct nick_entry_t *entry = nicks->chains[i];
+             entry != NULL; entry = entry->next)
+        {
+            size_t len = strlen(entry->name);
+            memcpy(out, ONLINE, sizeof(ONLINE) - 1);
+            out += sizeof(ONLINE) - 1;
+            memcpy(out, entry->name, len);
+            out += len;
+            *out++ = '\n';
+        }
+    }
+    memcpy(out, footer, footer_len);
+    presence->snapshot = msg;
+    presence->rebuilds++;
+    return message_ref(msg);
+}
+
+void presence_subscribe(struct presence_t *presence, int fd)
+{
+    if (presence_subscribed(presence, fd))
+        return;
+    if ((size_t)fd >= presence->by_fd_cap)
+    {
+        size_t cap = presence->by_fd_cap ? presence->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        presence->by_fd = xrealloc_tag(MEM_SESSIONS, presence->by_fd,
+                                       cap * sizeof(size_t));
+        memset(presence->by_fd + presence->by_fd_cap, 0,
+               (cap - presence->by_fd_cap) * sizeof(size_t));
+        presence->by_fd_cap = cap;
+    }
+    if (presence->nb_subscribers == presence->subscribers_cap)
+    {
+        presence->subscribers_cap =
+            presence->subscribers_cap ? presence->subscribers_cap * 2 : 64;
+        presence->subscribers =
+            xrealloc_tag(MEM_SESSIONS, presence->subscribers,
+                         presence->subscribers_cap * sizeof(int));
+    }
+    presence->subscribers[presence->nb_subscribers++] = fd;
+    presence->by_fd[fd] = presence->nb_subscribers;
+}
+
+void presence_unsubscribe(struct presence_t *presence, int fd)
+{
+    if (!presence_subscribed(presence, fd))
+        return;
+    /* the last subscriber takes the place of the leaving one */
+    size_t index = presence->by_fd[fd] - 1;
+    int last = presence->subscribers[--presence->nb_subscribers];
+    presence->subscribers[index] = last;
+    presence->by_fd[last] = index + 1;
+    presence->by_fd[fd] = 0;
+}
+
+int presence_subscribed(const struct presence_t *presence, int fd)
+{
+    return (size_t)fd < presence->by_fd_cap && presence->by_fd[fd] != 0;
+}
+
+struct message_t *presence_take(struct presence_t *presence)
+{
+    if (presence->changes_len == 0 || presence->nb_subscribers == 0)
+    {
+        presence->changes_len = 0;
+        return NULL;
+    }
+    struct message_t *msg =
+        message_new(presence->changes, presence->changes_len);
+    presence->changes_len = 0;
+    return msg;
+}
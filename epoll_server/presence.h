@@ -0,0 +1,110 @@
+#ifndef PRESENCE_H_
+#define PRESENCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+#include "nick.h"
+
+/**
+ * \brief The users online, as answered to /who and followed by subscribers
+ *
+ * The users are the clients with a nickname, the nick table is the set.
+ * The answer to /who is serialized once and shared by reference between
+ * the clients asking, until a user joins or leaves. The joins and leaves
+ * of an iteration are gathered into one message for all the subscribers.
+ * They are set operations, so a subscriber may get changes its snapshot
+ * already holds without going wrong.
+ */
+struct presence_t
+{
+    struct message_t *snapshot; /**< the answer to /who, NULL once stale */
+
+    char *changes; /**< "* Join" and "* Leave" lines of the iteration */
+
+    size_t changes_len; /**< bytes in changes */
+
+    size_t changes_cap; /**< allocated size of changes */
+
+    int *subscribers; /**< clients following the changes, without holes */
+
+    size_t nb_subscribers; /**< number of elements in subscribers */
+
+    size_t subscribers_cap; /**< allocated length of subscribers */
+
+    size_t *by_fd; /**< 1 + index in subscribers of every fd, 0 if none */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    uint64_t served; /**< snapshots sent */
+
+    uint64_t rebuilds; /**< snapshots serialized */
+};
+
+/**
+ * \brief Record that a user appeared under a nickname
+ *
+ * \param presence: the presence state
+ * \param name: the nickname
+ */
+void presence_join(struct presence_t *presence, const char *name);
+
+/**
+ * \brief Record that a nickname is no longer used
+ *
+ * \param presence: the presence state
+ * \param name: the nickname
+ */
+void presence_leave(struct presence_t *presence, const char *name);
+
+/**
+ * \brief The list of the users online
+ *
+ * \param presence: the presence state
+ * \param nicks: the nicknames of the clients
+ *
+ * \return A new reference on the snapshot, a "* Online nick" line per user
+ * ended by "* Who count", rebuilt only if a user joined or left since the
+ * previous call
+ */
+struct message_t *presence_snapshot(struct presence_t *presence,
+                                    const struct nick_table_t *nicks);
+
+/**
+ * \brief Send the changes to a client from now on
+ *
+ * \param presence: the presence state
+ * \param fd: the socket of the client
+ */
+void presence_subscribe(struct presence_t *presence, int fd);
+
+/**
+ * \brief Stop sending the changes to a client, if it followed them
+ *
+ * \param presence: the presence state
+ * \param fd: the socket of the client
+ */
+void presence_unsubscribe(struct presence_t *presence, int fd);
+
+/**
+ * \brief Tell if a client follows the changes
+ *
+ * \param presence: the presence state
+ * \param fd: the socket of the client
+ *
+ * \return 1 if it subscribed, 0 otherwise
+ */
+int presence_subscribed(const struct presence_t *presence, int fd);
+
+/**
+ * \brief Take the changes of the iteration
+ *
+ * \param presence: the presence state
+ *
+ * \return A message with the changes since the previous call, NULL if none
+ * or nobody subscribed
+ */
+struct message_t *presence_take(struct presence_t *presence);
+
+#endif /* !PRESENCE_H_ */
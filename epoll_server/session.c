@@ -0,0 +1,193 @@
+#include "session.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "utils/xalloc.h"
+
+static uint64_t token_hash(const uint8_t *token)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < SESSION_TOKEN; i++)
+    {
+        hash ^= token[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ (hash >> 32);
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static struct session_t **slot_of(struct session_table_t *table, int fd)
+{
+    if ((size_t)fd >= table->by_fd_cap)
+    {
+        size_t cap = table->by_fd_cap ? table->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        table->by_fd = xrealloc_tag(MEM_SESSIONS, table->by_fd,
+                                    cap * sizeof(struct session_t *));
+        memset(table->by_fd + table->by_fd_cap, 0,
+               (cap - table->by_fd_cap) * sizeof(struct session_t *));
+        table->by_fd_cap = cap;
+    }
+    return &table->by_fd[fd];
+}
+
+static void grow(struct session_table_t *table)
+{
+    size_t cap = table->cap ? table->cap * 2 : 64;
+    struct session_t **chains =
+        xcalloc_tag(MEM_SESSIONS, cap, sizeof(struct session_t *));
+    for (size_t i = 0; i < table->cap; i++)
+    {
+        struct session_t *session = table->chains[i];
+        while (session != NULL)
+        {
+            struct session_t *next = session->next;
+            size_t slot = session->hash & (cap - 1);
+            session->next = chains[slot];
+            chains[slot] = session;
+            session = next;
+        }
+    }
+    xfree_tag(MEM_SESSIONS, table->chains);
+    table->chains = chains;
+    table->cap = cap;
+}
+
+static void unlist(struct session_table_t *table, struct session_t *session)
+{
+    if (session->older != NULL)
+        session->older->newer = session->newer;
+    else
+        table->oldest = session->newer;
+    if (session->newer != NULL)
+        session->newer->older = session->older;
+    else
+        table->newest = session->older;
+    session->older = NULL;
+    session->newer = NULL;
+}
+
+struct session_t *session_open(struct session_table_t *table, int fd,
+                               const uint8_t *token)
+{
+    if (table->count == SESSION_MAX)
+        return NULL;
+    struct session_t *session =
+        xcalloc_tag(MEM_SESSIONS, 1, sizeof(struct session_t));
+    if (token != NULL)
+        memcpy(session->token, token, SESSION_TOKEN);
+    else if (getrandom(session->token, SESSION_TOKEN, 0) != SESSION_TOKEN)
+        errx(1, "cannot draw a session token");
+    session->hash = token_hash(session->token);
+    session->fd = fd;
+
+    if (table->count >= table->cap)
+        grow(table);
+    session->next = table->chains[session->hash & (table->cap - 1)];
+    table->chains[session->hash & (table->cap - 1)] = session;
+    table->count++;
+    *slot_of(table, fd) = session;
+    return session;
+}
+
+struct session_t *session_find(const struct session_table_t *table,
+                               const char *hex, size_t len)
+{
+    if (len != 2 * SESSION_TOKEN || table->cap == 0)
+        return NULL;
+    uint8_t token[SESSION_TOKEN];
+    for (size_t i = 0; i < SESSION_TOKEN; i++)
+    {
+        int high = hex_digit(hex[2 * i]);
+        int low = hex_digit(hex[2 * i + 1]);
+        if (high == -1 || low == -1)
+            return NULL;
+        token[i] = high << 4 | low;
+    }
+    uint64_t hash = token_hash(token);
+    struct session_t *session = table->chains[hash & (table->cap - 1)];
+    while (session != NULL
+           && (session->hash != hash
+               || memcmp(session->token, token, SESSION_TOKEN) != 0))
+        session = session->next;
+    return session;
+}
+
+struct session_t *session_of(const struct session_table_t *table, int fd)
+{
+    return (size_t)fd < table->by_fd_cap ? table->by_fd[fd] : NULL;
+}
+
+void session_attach(struct session_table_t *table, struct session_t *session,
+                    int fd)
+{
+    if (session->fd != -1)
+        *slot_of(table, session->fd) = NULL;
+    else
+        unlist(table, session);
+    session->fd = fd;
+    *slot_of(table, fd) = session;
+}
+
+void session_detach(struct session_table_t *table, int fd, const char *nick,
+                    time_t now)
+{
+    struct session_t *session = session_of(table, fd);
+    if (session == NULL)
+        return;
+    table->by_fd[fd] = NULL;
+    session->fd = -1;
+    session->left = now;
+    session->nick[0] = '\0';
+    if (nick != NULL)
+        strcpy(session->nick, nick);
+
+    session->older = table->newest;
+    if (table->newest != NULL)
+        table->newest->newer = session;
+    else
+        table->oldest = session;
+    table->newest = session;
+}
+
+void session_expire(struct session_table_t *table, time_t now)
+{
+    while (table->oldest != NULL && table->oldest->left + SESSION_TTL <= now)
+    {
+        struct session_t *session = table->oldest;
+        unlist(table, session);
+        struct session_t **cur =
+            &table->chains[session->hash & (table->cap - 1)];
+        while (*cur != session)
+            cur = &(*cur)->next;
+        *cur = session->next;
+        table->count--;
+        xfree_tag(MEM_SESSIONS, session);
+    }
+}
+
+void session_token(const struct session_t *session, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < SESSION_TOKEN; i++)
+    {
+        out[2 * i] = digits[session->token[i] >> 4];
+        out[2 * i + 1] = digits[session->token[i] & 0xf];
+    }
+    out[2 * SESSION_TOKEN] = '\0';
+}
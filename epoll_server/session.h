@@ -0,0 +1,144 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "nick.h"
+
+/**
+ * \brief Random bytes of a session token, sent as twice as many hex digits
+ */
+#define SESSION_TOKEN 16
+
+/**
+ * \brief Seconds a session outlives its connection
+ */
+#define SESSION_TTL 300
+
+/**
+ * \brief Most sessions, attached or waiting to be resumed
+ */
+#define SESSION_MAX 1048576
+
+/**
+ * \brief Identity of a client across its reconnections
+ */
+struct session_t
+{
+    uint8_t token[SESSION_TOKEN]; /**< the secret presented by /resume */
+
+    uint64_t hash; /**< hash of the token */
+
+    int fd; /**< socket of the client using it, -1 once it left */
+
+    char nick[NICK_MAX + 1]; /**< nickname the client had when it left */
+
+    time_t left; /**< time the client left */
+
+    struct session_t *next; /**< next session of the hash chain */
+
+    struct session_t *older; /**< previous detached session, by leave time */
+
+    struct session_t *newer; /**< next detached session, by leave time */
+};
+
+/**
+ * \brief Sessions by token and by socket fd
+ *
+ * The sessions whose client left are listed in leave time order, so that
+ * expiring them only looks at the oldest ones.
+ */
+struct session_table_t
+{
+    struct session_t **chains; /**< hash chains, a power of two of them */
+
+    size_t cap; /**< number of chains */
+
+    size_t count; /**< number of sessions */
+
+    struct session_t **by_fd; /**< session of every socket fd, or NULL */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    struct session_t *oldest; /**< detached session that left first */
+
+    struct session_t *newest; /**< detached session that left last */
+};
+
+/**
+ * \brief Open a session for a client
+ *
+ * \param table: the table
+ * \param fd: the socket of the client, without a session
+ * \param token: SESSION_TOKEN bytes handed over by an upgrade, NULL to draw
+ * a new token
+ *
+ * \return The session, NULL if there are SESSION_MAX sessions already
+ */
+struct session_t *session_open(struct session_table_t *table, int fd,
+                               const uint8_t *token);
+
+/**
+ * \brief Find a session by token
+ *
+ * \param table: the table
+ * \param hex: the token in hex digits, any case
+ * \param len: the length of hex
+ *
+ * \return The session, NULL if the token is unknown
+ */
+struct session_t *session_find(const struct session_table_t *table,
+                               const char *hex, size_t len);
+
+/**
+ * \brief Session of a client
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ *
+ * \return The session, NULL if the client has none
+ */
+struct session_t *session_of(const struct session_table_t *table, int fd);
+
+/**
+ * \brief Move a session to a client
+ *
+ * \param table: the table
+ * \param session: the session, possibly used by another client
+ * \param fd: the socket of the client, without a session
+ *
+ * The previous client keeps its connection and loses the session.
+ */
+void session_attach(struct session_table_t *table, struct session_t *session,
+                    int fd);
+
+/**
+ * \brief Keep the session of a leaving client for SESSION_TTL seconds
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ * \param nick: its nickname, or NULL
+ * \param now: the current time
+ */
+void session_detach(struct session_table_t *table, int fd, const char *nick,
+                    time_t now);
+
+/**
+ * \brief Free the sessions detached for SESSION_TTL seconds
+ *
+ * \param table: the table
+ * \param now: the current time
+ */
+void session_expire(struct session_table_t *table, time_t now);
+
+/**
+ * \brief Write the token of a session in hex digits
+ *
+ * \param session: the session
+ * \param out: buffer of 2 * SESSION_TOKEN + 1 bytes
+ */
+void session_token(const struct session_t *session, char *out);
+
+#endif /* SESSION_H_ */
@@ -0,0 +1,92 @@
+#include "stream.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/xalloc.h"
+
+void stream_init(struct stream_t *stream, stream_release_fn release,
+                 void *data)
+{
+    memset(stream, 0, sizeof(struct stream_t));
+    stream->release = release;
+    stream->data = data;
+}
+
+static void defer(struct stream_t *stream, uint64_t owner,
+                  struct message_t *msg, int more)
+{
+    if (stream->len == stream->cap)
+    {
+        stream->cap = stream->cap ? stream->cap * 2 : 64;
+        stream->deferred = xrealloc_tag(MEM_INPUT, stream->deferred,
+                                    stream->cap * sizeof(struct stream_item_t));
+    }
+    struct stream_item_t *item = &stream->deferred[stream->len++];
+    item->msg = msg;
+    item->owner = owner;
+    item->more = more;
+    stream->deferred_bytes += msg->len;
+}
+
+static void replay(struct stream_t *stream)
+{
+    struct stream_item_t *items = stream->deferred;
+    size_t len = stream->len;
+    stream->deferred = NULL;
+    stream->len = 0;
+    stream->cap = 0;
+    stream->deferred_bytes = 0;
+
+    /* a deferred chunk may pin the stream again, what follows is deferred */
+    for (size_t i = 0; i < len; i++)
+        stream_submit(stream, items[i].owner, items[i].msg, items[i].more);
+    xfree_tag(MEM_INPUT, items);
+}
+
+void stream_submit(struct stream_t *stream, uint64_t owner,
+                   struct message_t *msg, int more)
+{
+    if (stream_pinned(stream, owner))
+    {
+        defer(stream, owner, msg, more);
+        return;
+    }
+
+    stream->release(owner, msg, more, stream->data);
+    if (more)
+    {
+        stream->active = 1;
+        stream->owner = owner;
+        stream->last_data = time(NULL);
+    }
+    else if (stream->active)
+    {
+        stream->active = 0;
+        replay(stream);
+    }
+}
+
+void stream_end(struct stream_t *stream)
+{
+    if (stream->active)
+        stream_submit(stream, stream->owner, message_new("\n", 1), 0);
+}
+
+int stream_expire(struct stream_t *stream, time_t now)
+{
+    if (!stream->active || now - stream->last_data < STREAM_IDLE_TIMEOUT)
+        return 0;
+    stream_end(stream);
+    return 1;
+}
+
+int stream_pinned(const struct stream_t *stream, uint64_t owner)
+{
+    return stream->active && stream->owner != owner;
+}
+
+int stream_congested(const struct stream_t *stream)
+{
+    return stream->deferred_bytes > STREAM_MAX_DEFERRED;
+}
@@ -0,0 +1,139 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "message.h"
+
+/**
+ * \brief Seconds a pinned stream may stay silent before its line is ended
+ */
+#define STREAM_IDLE_TIMEOUT 5
+
+/**
+ * \brief Deferred bytes after which the other senders stop being read
+ */
+#define STREAM_MAX_DEFERRED (16 * 1024 * 1024)
+
+/**
+ * \brief Owner key of the lines received from a peer, ORed with its origin id
+ *
+ * Local clients use their socket fd as owner key.
+ */
+#define STREAM_REMOTE ((uint64_t)1 << 32)
+
+/**
+ * \brief A message waiting for the pinned stream to end
+ */
+struct stream_item_t
+{
+    struct message_t *msg; /**< the message */
+
+    uint64_t owner; /**< the sender of the message */
+
+    int more; /**< the message does not end its line */
+};
+
+/**
+ * \brief Callback broadcasting a message once the stream lets it through
+ */
+typedef void (*stream_release_fn)(uint64_t owner, struct message_t *msg,
+                                  int more, void *data);
+
+/**
+ * \brief Serialize the broadcast when lines are cut through
+ *
+ * While the line of a sender is forwarded chunk by chunk, the stream is pinned
+ * to this sender: the messages of the other senders are deferred until the
+ * line ends, so recipients only see lines interleaved at line boundaries.
+ */
+struct stream_t
+{
+    int active; /**< a line is being cut through */
+
+    uint64_t owner; /**< the sender the stream is pinned to */
+
+    time_t last_data; /**< last time the owner sent a chunk */
+
+    struct stream_item_t *deferred; /**< messages of the other senders */
+
+    size_t len; /**< number of elements in deferred */
+
+    size_t cap; /**< allocated size of deferred */
+
+    size_t deferred_bytes; /**< total length of the deferred messages */
+
+    stream_release_fn release; /**< called for every message let through */
+
+    void *data; /**< passed to release */
+};
+
+/**
+ * \brief Initialize an unpinned stream
+ *
+ * \param stream: the stream state
+ * \param release: called for every message let through, in order
+ * \param data: passed to release
+ */
+void stream_init(struct stream_t *stream, stream_release_fn release,
+                 void *data);
+
+/**
+ * \brief Release a message, or defer it if the stream is pinned
+ *
+ * \param stream: the stream state
+ * \param owner: the sender of the message
+ * \param msg: the message, the reference of the caller is taken over
+ * \param more: 1 if the message is a chunk of a line that continues
+ *
+ * A chunk pins the stream to its owner, the end of the line unpins it and
+ * releases the deferred messages in their arrival order.
+ */
+void stream_submit(struct stream_t *stream, uint64_t owner,
+                   struct message_t *msg, int more);
+
+/**
+ * \brief End the pinned line now
+ *
+ * \param stream: the stream state
+ *
+ * A newline is broadcast in place of the rest of the line and the deferred
+ * messages are released.
+ */
+void stream_end(struct stream_t *stream);
+
+/**
+ * \brief End the pinned line if its owner went silent for too long
+ *
+ * \param stream: the stream state
+ * \param now: the current time
+ *
+ * \return 1 if the line was ended, 0 otherwise
+ *
+ * A newline is broadcast in place of the rest of the line, so a stalled or
+ * vanished sender cannot hold the other senders back.
+ */
+int stream_expire(struct stream_t *stream, time_t now);
+
+/**
+ * \brief Tell if the stream is pinned to another sender
+ *
+ * \param stream: the stream state
+ * \param owner: the sender
+ *
+ * \return 1 if the messages of owner are deferred, 0 otherwise
+ */
+int stream_pinned(const struct stream_t *stream, uint64_t owner);
+
+/**
+ * \brief Tell if the deferred messages exceed STREAM_MAX_DEFERRED
+ *
+ * \param stream: the stream state
+ *
+ * \return 1 if the senders other than the owner must stop being read
+ */
+int stream_congested(const struct stream_t *stream);
+
+#endif /* STREAM_H_ */
@@ -0,0 +1,231 @@
+#include "tls.h"
+
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+
+#include "utils/xalloc.h"
+
+static void *tls_malloc(size_t num, const char *file, int line)
+{
+    (void)file;
+    (void)line;
+    return xmalloc_tag(MEM_TLS, num);
+}
+
+static void *tls_realloc(void *addr, size_t num, const char *file, int line)
+{
+    (void)file;
+    (void)line;
+    if (num == 0)
+    {
+        xfree_tag(MEM_TLS, addr);
+        return NULL;
+    }
+    return xrealloc_tag(MEM_TLS, addr, num);
+}
+
+static void tls_free(void *addr, const char *file, int line)
+{
+    (void)file;
+    (void)line;
+    xfree_tag(MEM_TLS, addr);
+}
+
+void tls_init(struct tls_t *tls, const char *cert, const char *key)
+{
+    memset(tls, 0, sizeof(struct tls_t));
+    /* refused once OpenSSL allocated, its memory then goes uncounted */
+    CRYPTO_set_mem_functions(tls_malloc, tls_realloc, tls_free);
+    tls->ctx = SSL_CTX_new(TLS_server_method());
+    if (tls->ctx == NULL)
+        errx(1, "cannot create the TLS context");
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+    /* no tickets: nothing but records follows the handshake on the socket */
+    SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION
+                            | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_num_tickets(tls->ctx, 0);
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+    /* the buffers of an idle session go back to the allocator */
+    SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                         | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                         | SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(tls->ctx, cert) != 1)
+        errx(1, "cannot load the certificate %s", cert);
+    if (SSL_CTX_use_PrivateKey_file(tls->ctx, key, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(tls->ctx) != 1)
+        errx(1, "cannot load the private key %s", key);
+}
+
+static struct tls_conn_t *conn_of(struct tls_t *tls, int fd)
+{
+    if ((size_t)fd >= tls->by_fd_cap)
+        return NULL;
+    struct tls_conn_t *conn = &tls->by_fd[fd];
+    return conn->ssl != NULL ? conn : NULL;
+}
+
+void tls_add(struct tls_t *tls, int fd)
+{
+    if ((size_t)fd >= tls->by_fd_cap)
+    {
+        size_t cap = tls->by_fd_cap ? tls->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        tls->by_fd = xrealloc_tag(MEM_CONNECTIONS, tls->by_fd,
+                                  cap * sizeof(struct tls_conn_t));
+        memset(tls->by_fd + tls->by_fd_cap, 0,
+               (cap - tls->by_fd_cap) * sizeof(struct tls_conn_t));
+        tls->by_fd_cap = cap;
+    }
+    SSL *ssl = SSL_new(tls->ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1)
+        errx(1, "cannot create a TLS session");
+    SSL_set_accept_state(ssl);
+    tls->by_fd[fd].ssl = ssl;
+    tls->by_fd[fd].ready = 0;
+}
+
+/* the error queue is per thread, it is emptied after every failure */
+static ssize_t fail(struct tls_t *tls, SSL *ssl, int res, int reading)
+{
+    int err = SSL_get_error(ssl, res);
+    ERR_clear_error();
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN && reading)
+        return 0;
+    tls->errors++;
+    errno = EPROTO;
+    return -1;
+}
+
+int tls_handshake(struct tls_t *tls, int fd, int *want_write, int *userspace)
+{
+    struct tls_conn_t *conn = conn_of(tls, fd);
+    *want_write = 0;
+    if (conn == NULL)
+        return TLS_FAILED;
+    int res = SSL_do_handshake(conn->ssl);
+    if (res != 1)
+    {
+        *want_write = SSL_get_error(conn->ssl, res) == SSL_ERROR_WANT_WRITE;
+        return fail(tls, conn->ssl, res, 0) == -1 && errno == EAGAIN
+            ? TLS_PENDING
+            : TLS_FAILED;
+    }
+
+    tls->handshakes++;
+    *userspace = 0;
+    if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+        tls->kernel_tx++;
+    else
+        *userspace |= TLS_WRITE;
+    if (BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)))
+        tls->kernel_rx++;
+    else
+        *userspace |= TLS_READ;
+    /* the kernel holds the keys and sequence numbers, the socket is plain */
+    if (*userspace == 0)
+        tls_remove(tls, fd);
+    return TLS_DONE;
+}
+
+ssize_t tls_recv(struct tls_t *tls, int fd, void *buf, size_t len)
+{
+    struct tls_conn_t *conn = conn_of(tls, fd);
+    if (conn == NULL)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    size_t nr = 0;
+    int res = SSL_read_ex(conn->ssl, buf, len, &nr);
+    if (res != 1)
+        return fail(tls, conn->ssl, res, 1);
+    return nr;
+}
+
+ssize_t tls_send(struct tls_t *tls, int fd, const struct iovec *iov, int nb)
+{
+    struct tls_conn_t *conn = conn_of(tls, fd);
+    if (conn == NULL)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    const void *data = iov[0].iov_base;
+    size_t len = iov[0].iov_len < TLS_RECORD ? iov[0].iov_len : TLS_RECORD;
+    if (nb > 1 && len < TLS_RECORD)
+    {
+        /* small lines share a record instead of paying one each */
+        len = 0;
+        for (int i = 0; i < nb && len < TLS_RECORD; i++)
+        {
+            size_t part = iov[i].iov_len;
+            if (part > TLS_RECORD - len)
+                part = TLS_RECORD - len;
+            memcpy(tls->record + len, iov[i].iov_base, part);
+            len += part;
+        }
+        data = tls->record;
+    }
+
+    size_t written = 0;
+    int res = SSL_write_ex(conn->ssl, data, len, &written);
+    if (res != 1)
+        return fail(tls, conn->ssl, res, 0);
+    return written;
+}
+
+void tls_mark(struct tls_t *tls, int fd)
+{
+    struct tls_conn_t *conn = conn_of(tls, fd);
+    if (conn == NULL || conn->ready || SSL_pending(conn->ssl) == 0)
+        return;
+    if (tls->nb_ready == tls->ready_cap)
+    {
+        tls->ready_cap = tls->ready_cap ? tls->ready_cap * 2 : 16;
+        tls->ready = xrealloc_tag(MEM_CONNECTIONS, tls->ready,
+                                  tls->ready_cap * sizeof(int));
+        tls->taken = xrealloc_tag(MEM_CONNECTIONS, tls->taken,
+                                  tls->ready_cap * sizeof(int));
+    }
+    tls->ready[tls->nb_ready++] = fd;
+    conn->ready = 1;
+}
+
+size_t tls_take_ready(struct tls_t *tls, int **fds)
+{
+    int *taken = tls->ready;
+    size_t nb = tls->nb_ready;
+    tls->ready = tls->taken;
+    tls->taken = taken;
+    tls->nb_ready = 0;
+    for (size_t i = 0; i < nb; i++)
+    {
+        struct tls_conn_t *conn = conn_of(tls, taken[i]);
+        if (conn != NULL)
+            conn->ready = 0;
+    }
+    *fds = taken;
+    return nb;
+}
+
+void tls_remove(struct tls_t *tls, int fd)
+{
+    struct tls_conn_t *conn = conn_of(tls, fd);
+    if (conn == NULL)
+        return;
+    /* no close_notify, the socket is closed or handed to the kernel */
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+    conn->ready = 0;
+}
@@ -0,0 +1,163 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <openssl/ssl.h>
+
+/**
+ * \brief Most plaintext gathered into one SSL_write(), a full TLS record
+ */
+#define TLS_RECORD 16384
+
+/**
+ * \brief Results of tls_handshake()
+ */
+#define TLS_FAILED -1
+#define TLS_PENDING 0
+#define TLS_DONE 1
+
+/**
+ * \brief Directions of a connection still encrypted by OpenSSL
+ */
+#define TLS_READ 0x1
+#define TLS_WRITE 0x2
+
+/**
+ * \brief Session of a TLS client, kept until the kernel took both directions
+ */
+struct tls_conn_t
+{
+    SSL *ssl; /**< the session, NULL once offloaded or for plain clients */
+
+    int ready; /**< listed in ready, decrypted bytes wait in ssl */
+};
+
+/**
+ * \brief TLS context of the listeners and the sessions by socket fd
+ *
+ * The handshake runs in OpenSSL with SSL_OP_ENABLE_KTLS, which hands the
+ * keys to the kernel through the "tls" TCP ULP as soon as they exist. A
+ * direction the kernel took is plain for the server: the broadcasts go out
+ * through writev(2) as usual and the kernel encrypts them, only
+ * MSG_ZEROCOPY is not offered by the ULP. Without the ULP, or for a cipher
+ * it does not offload, the direction stays in OpenSSL. Decrypted bytes OpenSSL buffered do not make the socket
+ * readable, the connections holding some are listed in ready.
+ */
+struct tls_t
+{
+    SSL_CTX *ctx; /**< the context, NULL when TLS is off */
+
+    struct tls_conn_t *by_fd; /**< session of every socket fd */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    int *ready; /**< fds with decrypted bytes left, to be read again */
+
+    size_t nb_ready; /**< number of elements in ready */
+
+    int *taken; /**< the list handed out by tls_take_ready() */
+
+    size_t ready_cap; /**< length of ready and taken */
+
+    char record[TLS_RECORD]; /**< small lines gathered by tls_send() */
+
+    uint64_t handshakes; /**< handshakes completed */
+
+    uint64_t kernel_tx; /**< connections whose sending the kernel encrypts */
+
+    uint64_t kernel_rx; /**< connections whose input the kernel decrypts */
+
+    uint64_t errors; /**< failed handshakes and broken sessions */
+};
+
+/**
+ * \brief Load the certificate and the key of the listeners
+ *
+ * \param tls: the state to initialize
+ * \param cert: PEM file of the certificate chain
+ * \param key: PEM file of the private key
+ *
+ * Exits if the files cannot be loaded or do not match.
+ */
+void tls_init(struct tls_t *tls, const char *cert, const char *key);
+
+/**
+ * \brief Start the server side of a handshake on an accepted socket
+ *
+ * \param tls: the state, initialized
+ * \param fd: the socket, non blocking
+ */
+void tls_add(struct tls_t *tls, int fd);
+
+/**
+ * \brief Go on with a handshake
+ *
+ * \param tls: the state
+ * \param fd: the socket
+ * \param want_write: set to 1 if the handshake waits for EPOLLOUT
+ * \param userspace: set to the TLS_READ and TLS_WRITE directions the kernel
+ * did not take, once done
+ *
+ * \return TLS_DONE, TLS_PENDING until more bytes move or TLS_FAILED
+ */
+int tls_handshake(struct tls_t *tls, int fd, int *want_write, int *userspace);
+
+/**
+ * \brief Read decrypted bytes, like recv(2)
+ *
+ * \param tls: the state
+ * \param fd: the socket, reading through OpenSSL
+ * \param buf: the buffer
+ * \param len: the size of buf
+ *
+ * \return The bytes read, 0 at the end of the session, -1 with errno set to
+ * EAGAIN if no record is complete or EPROTO if the session broke
+ */
+ssize_t tls_recv(struct tls_t *tls, int fd, void *buf, size_t len);
+
+/**
+ * \brief Encrypt and send the start of some buffers, like writev(2)
+ *
+ * \param tls: the state
+ * \param fd: the socket, sending through OpenSSL
+ * \param iov: the buffers
+ * \param nb: the number of buffers
+ *
+ * \return The bytes sent, -1 with errno set to EAGAIN or EPROTO
+ *
+ * Up to TLS_RECORD bytes are gathered in one record. After EAGAIN the next
+ * call must start with the same bytes, which the output queues guarantee.
+ */
+ssize_t tls_send(struct tls_t *tls, int fd, const struct iovec *iov, int nb);
+
+/**
+ * \brief List a connection if OpenSSL holds decrypted bytes of it
+ *
+ * \param tls: the state
+ * \param fd: the socket
+ */
+void tls_mark(struct tls_t *tls, int fd);
+
+/**
+ * \brief Take the listed connections, later marks start a new list
+ *
+ * \param tls: the state
+ * \param fds: set to the sockets, valid until the next call
+ *
+ * \return The number of sockets
+ */
+size_t tls_take_ready(struct tls_t *tls, int **fds);
+
+/**
+ * \brief Free the session of a leaving client
+ *
+ * \param tls: the state
+ * \param fd: the socket, possibly without a session
+ */
+void tls_remove(struct tls_t *tls, int fd);
+
+#endif /* TLS_H_ */
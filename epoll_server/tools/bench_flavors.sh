@@ -0,0 +1,26 @@
+#!/bin/sh
+# Measure the fan-out of every build flavor of the server.
+# Usage: tools/bench_flavors.sh server... (from epoll_server/, after make bench)
+
+PORT=${PORT:-7600}
+LOADGEN=./tools/loadgen
+
+run()
+{
+    $1 127.0.0.1 $PORT >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    $LOADGEN -c $2 -S $3 -s $4 -n $5 127.0.0.1 $PORT \
+        | sed "s/.*lines\/s \([0-9.]*\) MB\/s \([0-9.]*\)/\1 \2/"
+    kill $pid
+    wait $pid 2>/dev/null
+    PORT=$((PORT + 1))
+}
+
+printf "%-24s %8s %8s %10s %10s\n" server clients size lines/s MB/s
+for server in "$@"; do
+    for load in "100 10 64 5000" "50 5 1024 4000" "20 2 65536 200"; do
+        set -- $load
+        printf "%-24s %8s %8s %10s %10s\n" $server $1 $3 $(run $server $load)
+    done
+done
@@ -0,0 +1,232 @@
+#include <err.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "epoll-server.h"
+#include "transport.h"
+
+/*
+ * Engine microbenchmark: the event loop runs on the memory transport, with
+ * thousands of clients and no system call on their path. Every round, the
+ * senders each send their lines, then the loop iterates until it read and
+ * fanned out everything. What is measured is the cost of the engine, per
+ * message received and per copy delivered to a client. The options after
+ * -- are those of the server, without the ones that need real sockets.
+ */
+
+#define MAX_BENCH_EVENTS 1024
+
+struct bench
+{
+    struct server_t server;
+    struct mem_transport_t mem;
+    struct epoll_event events[MAX_BENCH_EVENTS];
+    int *fds;
+    size_t iterations;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t parse(const char *arg)
+{
+    char *end = NULL;
+    size_t val = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0')
+        errx(1, "invalid number %s", arg);
+    return val;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n clients] [-s senders] [-l line] [-b lines] "
+            "[-r rounds] [-- server options]\n",
+            name);
+    exit(1);
+}
+
+/* an iteration of the loop, 0 once nothing is left to read or complete */
+static int step(struct bench *b)
+{
+    struct server_t *server = &b->server;
+    int congested = 0;
+    server_timeout(server, &congested);
+    int nb = mem_poll(&b->mem, b->events, MAX_BENCH_EVENTS - 1);
+    int busy = nb != 0 || server->nb_ready != 0;
+    if (server->executor.inflight != 0)
+    {
+        /* the workers signal their eventfd, read it whether or not done */
+        b->events[nb].events = EPOLLIN;
+        b->events[nb].data.fd = server->executor.event_fd;
+        nb++;
+        busy = 1;
+    }
+    server_dispatch(server, b->events, nb, congested);
+    b->iterations++;
+    return busy || server->nb_directs != 0;
+}
+
+static void drain(struct bench *b)
+{
+    while (step(b))
+        continue;
+}
+
+static void connect_clients(struct bench *b, size_t nb)
+{
+    /* a client holds a descriptor of /dev/null */
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+    {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    b->fds = malloc(nb * sizeof(int));
+    for (size_t i = 0; i < nb; i++)
+    {
+        /* one address per client, the limits of an IP do not mix them */
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x0a000000 | (i + 1));
+        b->fds[i] = mem_connect(&b->mem);
+        if (admit_client(&b->server, b->fds[i], (struct sockaddr *)&addr, 0)
+            == -1)
+            errx(1, "client %zu refused", i);
+    }
+    drain(b);
+}
+
+static void start_server(struct bench *b, struct config_t *cfg, char *name,
+                         int argc, char **argv)
+{
+    /* the server options, then an address the server does not listen on */
+    char **args = malloc((argc + 4) * sizeof(char *));
+    args[0] = name;
+    memcpy(args + 1, argv, argc * sizeof(char *));
+    args[argc + 1] = "127.0.0.1";
+    args[argc + 2] = "0";
+    args[argc + 3] = NULL;
+    optind = 1;
+    if (parse_config(cfg, argc + 3, args) == -1)
+    {
+        print_usage(name);
+        exit(1);
+    }
+    if (cfg->broadcasters != 0 || cfg->tls_cert != NULL
+        || cfg->upgrade_path != NULL || cfg->zerocopy_threshold != 0
+        || cfg->ws_listen != NULL || cfg->peer_listen != NULL
+        || cfg->nb_peers != 0 || cfg->mcast_group != NULL)
+        errx(1, "-T, -S, -U, -z, -w, -L, -P and -M need real sockets");
+
+    mem_transport_init(&b->mem);
+    server_init(&b->server, cfg);
+    b->server.clients.transport = &b->mem.transport;
+    server_start(&b->server);
+    federation_init(&b->server.fed, cfg, -1, -1);
+}
+
+int main(int argc, char **argv)
+{
+    size_t clients = 1000;
+    size_t senders = 10;
+    size_t line = 64;
+    size_t lines = 1;
+    size_t rounds = 1000;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "n:s:l:b:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            clients = parse(optarg);
+            break;
+        case 's':
+            senders = parse(optarg);
+            break;
+        case 'l':
+            line = parse(optarg);
+            break;
+        case 'b':
+            lines = parse(optarg);
+            break;
+        case 'r':
+            rounds = parse(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (clients == 0 || senders == 0 || senders > clients || line < 2
+        || lines == 0 || rounds == 0)
+        usage(argv[0]);
+
+    /* the engine reports every client on stdout, the results go to a copy */
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+        err(1, "cannot redirect stdout");
+
+    struct config_t cfg;
+    static struct bench b;
+    start_server(&b, &cfg, argv[0], argc - optind, argv + optind);
+    connect_clients(&b, clients);
+
+    char *burst = malloc(line * lines);
+    memset(burst, 'x', line * lines);
+    for (size_t i = 0; i < lines; i++)
+        burst[i * line + line - 1] = '\n';
+
+    /* a first round to fill the pools and the history */
+    for (size_t s = 0; s < senders; s++)
+        mem_send(&b.mem, b.fds[s], burst, line * lines);
+    drain(&b);
+
+    uint64_t writes = b.mem.writes;
+    uint64_t bytes = b.mem.bytes_out;
+    uint64_t reads = b.mem.reads;
+    size_t iterations = b.iterations;
+    double start = now_sec();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        for (size_t s = 0; s < senders; s++)
+            mem_send(&b.mem, b.fds[s], burst, line * lines);
+        drain(&b);
+    }
+    double elapsed = now_sec() - start;
+
+    double messages = (double)rounds * senders * lines;
+    double deliveries = messages * clients;
+    fprintf(out, "clients %zu senders %zu line %zu lines %zu rounds %zu\n",
+            clients, senders, line, lines, rounds);
+    fprintf(out, "ns/message %.1f ns/delivery %.2f messages/s %.0f\n",
+            elapsed * 1e9 / messages, elapsed * 1e9 / deliveries,
+            messages / elapsed);
+    fprintf(out,
+            "iterations/round %.2f reads/round %.2f writes/round %.2f "
+            "bytes/delivery %.1f\n",
+            (double)(b.iterations - iterations) / rounds,
+            (double)(b.mem.reads - reads) / rounds,
+            (double)(b.mem.writes - writes) / rounds,
+            (b.mem.bytes_out - bytes) / deliveries);
+
+    for (size_t i = 0; i < clients; i++)
+        mem_hangup(&b.mem, b.fds[i]);
+    drain(&b);
+    mem_transport_free(&b.mem);
+    free(burst);
+    free(b.fds);
+    fclose(out);
+    return 0;
+}
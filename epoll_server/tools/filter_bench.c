@@ -0,0 +1,222 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filter.h"
+
+/*
+ * Filter microbenchmark: compiles a term list, random words by default, and
+ * scans chat-like lines with the automaton of the server, with and without
+ * the SSE2 prefilter. The text draws its words from a vocabulary with a
+ * skewed distribution, like a language, and every hundredth word is a term.
+ */
+
+#define VOCABULARY 4096
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t parse(const char *arg)
+{
+    char *end = NULL;
+    size_t val = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0')
+        errx(1, "invalid number %s", arg);
+    return val;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-t terms] [-f terms_file] [-m megabytes] [-l line] "
+            "[-r rounds]\n",
+            name);
+    exit(1);
+}
+
+static size_t random_word(char *out, size_t min, size_t max)
+{
+    size_t len = min + rand() % (max - min + 1);
+    for (size_t i = 0; i < len; i++)
+        out[i] = 'a' + rand() % 26;
+    return len;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        err(1, "cannot open %s", path);
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    rewind(file);
+    char *text = malloc(*len + 1);
+    if (fread(text, 1, *len, file) != *len)
+        errx(1, "cannot read %s", path);
+    fclose(file);
+    return text;
+}
+
+/* the terms, one per line, and their starts for the text generator */
+static char *make_terms(size_t count, size_t *len)
+{
+    char *text = malloc(count * 12);
+    *len = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        *len += random_word(text + *len, 5, 12);
+        text[(*len)++] = '\n';
+    }
+    return text;
+}
+
+static char *make_text(const char *terms, size_t terms_len, size_t size,
+                       size_t line)
+{
+    const char **starts = malloc((terms_len + 1) * sizeof(char *));
+    size_t nb_starts = 0;
+    const char *end = terms + terms_len;
+    for (const char *p = terms; p < end;)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        if (*p != '\n' && *p != '#')
+            starts[nb_starts++] = p;
+        p = eol ? eol + 1 : end;
+    }
+
+    char vocabulary[VOCABULARY][10];
+    size_t lengths[VOCABULARY];
+    for (size_t i = 0; i < VOCABULARY; i++)
+        lengths[i] = random_word(vocabulary[i], 1, 9);
+
+    char *text = malloc(size + 16);
+    size_t len = 0;
+    size_t col = 0;
+    while (len < size)
+    {
+        if (nb_starts != 0 && rand() % 100 == 0)
+        {
+            const char *term = starts[rand() % nb_starts];
+            const char *eol = memchr(term, '\n', end - term);
+            size_t n = eol ? (size_t)(eol - term) : (size_t)(end - term);
+            const char *colon = memchr(term, ':', n);
+            if (colon != NULL)
+            {
+                n -= colon + 1 - term;
+                term = colon + 1;
+            }
+            n = n > 12 ? 12 : n;
+            memcpy(text + len, term, n);
+            len += n;
+            col += n;
+        }
+        else
+        {
+            /* the square favors the first words, as in a natural language */
+            size_t r = rand() % VOCABULARY;
+            size_t w = r * r / VOCABULARY;
+            size_t n = lengths[w];
+            memcpy(text + len, vocabulary[w], n);
+            len += n;
+            col += n;
+        }
+        text[len++] = col >= line ? '\n' : ' ';
+        col = col >= line ? 0 : col + 1;
+    }
+    free(starts);
+    return text;
+}
+
+static void bench(const struct automaton_t *ac, const char *text, size_t size,
+                  size_t rounds, int prefilter)
+{
+    char *copy = malloc(size);
+    double best = 0;
+    size_t found = 0;
+    for (size_t r = 0; r < rounds; r++)
+    {
+        memcpy(copy, text, size);
+        found = 0;
+        double start = now_sec();
+        const char *end = copy + size;
+        for (char *p = copy; p < end;)
+        {
+            char *eol = memchr(p, '\n', end - p);
+            size_t len = eol ? (size_t)(eol - p) + 1 : (size_t)(end - p);
+            found += automaton_scan(ac, p, len, prefilter) != 0;
+            p += len;
+        }
+        double rate = size / (now_sec() - start) / 1e9;
+        if (rate > best)
+            best = rate;
+    }
+    printf("prefilter %-3s GB/s %.3f lines matched %zu\n",
+           prefilter ? "on" : "off", best, found);
+    free(copy);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nb_terms = 50000;
+    const char *path = NULL;
+    size_t megabytes = 64;
+    size_t line = 80;
+    size_t rounds = 3;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "t:f:m:l:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nb_terms = parse(optarg);
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        case 'm':
+            megabytes = parse(optarg);
+            break;
+        case 'l':
+            line = parse(optarg);
+            break;
+        case 'r':
+            rounds = parse(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || megabytes == 0 || line == 0 || rounds == 0)
+        usage(argv[0]);
+
+    srand(42);
+    size_t terms_len = 0;
+    char *terms = path ? read_file(path, &terms_len)
+                       : make_terms(nb_terms, &terms_len);
+    double start = now_sec();
+    struct automaton_t *ac = automaton_compile(terms, terms_len);
+    if (ac == NULL)
+        errx(1, "invalid term list");
+    printf("terms %zu states %u classes %u table MB %.1f compile sec %.3f\n",
+           ac->nb_terms, ac->nb_states, ac->nb_classes,
+           (double)ac->nb_states * ac->nb_classes * sizeof(uint32_t) / 1e6,
+           now_sec() - start);
+
+    size_t size = megabytes << 20;
+    char *text = make_text(terms, terms_len, size, line);
+    bench(ac, text, size, rounds, 0);
+    bench(ac, text, size, rounds, 1);
+
+    automaton_unref(ac);
+    free(text);
+    free(terms);
+    return 0;
+}
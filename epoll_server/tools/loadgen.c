@@ -0,0 +1,206 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Chat workload generator: every client receives the broadcasts, the first
+ * senders clients also send lines of a given size, keeping at most window of
+ * their own lines in flight (a line is done once its echo came back).
+ */
+
+struct client
+{
+    int sock;
+    size_t received; /* bytes received */
+    size_t sent_lines; /* lines fully written */
+    size_t echoed; /* own bytes seen back, only tracked for senders */
+    size_t off; /* bytes of the current line already written */
+    int finished; /* every expected byte was received */
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int dial(const char *ip, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *addr = NULL;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(ip, port, &hints, &addr) != 0)
+        errx(1, "fail getting address");
+
+    int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock == -1 || connect(sock, addr->ai_addr, addr->ai_addrlen) == -1)
+        err(1, "cannot connect to %s:%s", ip, port);
+    freeaddrinfo(addr);
+
+    int flags = fcntl(sock, F_GETFL);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    return sock;
+}
+
+static size_t parse(const char *arg)
+{
+    char *end = NULL;
+    size_t val = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0')
+        errx(1, "invalid number %s", arg);
+    return val;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-c clients] [-S senders] [-s size] [-n lines] "
+            "[-w window] ip port\n",
+            name);
+    exit(1);
+}
+
+/* return 1 while the socket must be watched for EPOLLOUT */
+static int pump(struct client *c, const char *line, size_t size, size_t lines,
+                size_t window)
+{
+    while (c->sent_lines < lines)
+    {
+        size_t sent = c->sent_lines * size;
+        if (sent > c->echoed && sent - c->echoed >= window * size)
+            return 0;
+        ssize_t w = send(c->sock, line + c->off, size - c->off, MSG_NOSIGNAL);
+        if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (w == -1)
+            err(1, "send");
+        c->off += w;
+        if (c->off == size)
+        {
+            c->off = 0;
+            c->sent_lines++;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t nb_clients = 10;
+    size_t senders = 1;
+    size_t size = 64;
+    size_t lines = 10000;
+    size_t window = 8;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "c:S:s:n:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            nb_clients = parse(optarg);
+            break;
+        case 'S':
+            senders = parse(optarg);
+            break;
+        case 's':
+            size = parse(optarg);
+            break;
+        case 'n':
+            lines = parse(optarg);
+            break;
+        case 'w':
+            window = parse(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || size < 2 || senders > nb_clients || window == 0)
+        usage(argv[0]);
+
+    char *line = malloc(size);
+    memset(line, 'x', size - 1);
+    line[size - 1] = '\n';
+
+    int epli = epoll_create1(0);
+    struct client *clients = calloc(nb_clients, sizeof(struct client));
+    for (size_t i = 0; i < nb_clients; i++)
+    {
+        clients[i].sock = dial(argv[optind], argv[optind + 1]);
+        struct epoll_event evt = { 0 };
+        evt.events = EPOLLIN | (i < senders ? EPOLLOUT : 0);
+        evt.data.u64 = i;
+        epoll_ctl(epli, EPOLL_CTL_ADD, clients[i].sock, &evt);
+    }
+    /* let the server register every client before the first line */
+    usleep(200000);
+
+    size_t expected = senders * lines * size;
+    size_t done = 0;
+    char buf[65536];
+    struct epoll_event events[256];
+    double start = now_sec();
+
+    while (done < nb_clients)
+    {
+        int nb = epoll_wait(epli, events, 256, 5000);
+        if (nb == 0)
+            errx(1, "stalled: %zu of %zu clients done", done, nb_clients);
+        for (int e = 0; e < nb; e++)
+        {
+            size_t i = events[e].data.u64;
+            struct client *c = &clients[i];
+            if (events[e].events & EPOLLIN)
+            {
+                ssize_t r = 0;
+                while ((r = recv(c->sock, buf, sizeof(buf), 0)) > 0)
+                {
+                    c->received += r;
+                    if (i < senders)
+                        c->echoed = c->received / senders;
+                }
+                if (r == 0)
+                    errx(1, "server closed client %zu", i);
+                if (c->received >= expected && !c->finished)
+                {
+                    c->finished = 1;
+                    done++;
+                }
+            }
+            if (i < senders)
+            {
+                struct epoll_event evt = { 0 };
+                evt.events = EPOLLIN;
+                if (pump(c, line, size, lines, window))
+                    evt.events |= EPOLLOUT;
+                evt.data.u64 = i;
+                epoll_ctl(epli, EPOLL_CTL_MOD, c->sock, &evt);
+            }
+        }
+    }
+
+    double elapsed = now_sec() - start;
+    double delivered = (double)expected * nb_clients;
+    printf("size %zu lines %zu clients %zu seconds %.3f lines/s %.0f "
+           "MB/s %.1f\n",
+           size, lines * senders, nb_clients, elapsed,
+           lines * senders / elapsed, delivered / elapsed / 1e6);
+
+    for (size_t i = 0; i < nb_clients; i++)
+        close(clients[i].sock);
+    free(clients);
+    free(line);
+    return 0;
+}
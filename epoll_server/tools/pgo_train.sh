@@ -0,0 +1,21 @@
+#!/bin/sh
+# Train a -fprofile-generate build of the server on a chat workload.
+# Usage: tools/pgo_train.sh ./epoll_server-pgo [port]
+# The profiles are written when the server exits on SIGTERM.
+
+SERVER=$1
+PORT=${2:-7500}
+LOADGEN=./tools/loadgen
+
+# cut through lines on, so that the long lines train the stream too
+$SERVER -c 16384 127.0.0.1 $PORT >/dev/null 2>&1 &
+pid=$!
+sleep 0.3
+
+# mostly short lines to a crowd of readers, some pastes, a few huge lines
+$LOADGEN -c 100 -S 20 -s 64 -n 5000 127.0.0.1 $PORT
+$LOADGEN -c 50 -S 10 -s 1024 -n 2000 127.0.0.1 $PORT
+$LOADGEN -c 20 -S 2 -s 262144 -n 20 127.0.0.1 $PORT
+
+kill -TERM $pid
+wait $pid
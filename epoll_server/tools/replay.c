@@ -0,0 +1,373 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "utils/xalloc.h"
+
+/*
+ * Replay of a capture file (epoll_server -E): every recorded connection is
+ * opened, sends lines of the recorded lengths and closes at the recorded
+ * times, divided by the speed. The payloads are not recorded, the lines are
+ * made of 'x'. WebSocket connections are replayed as plain TCP clients.
+ * Everything the server sends is read and dropped.
+ */
+
+#define CHUNK 65536
+
+struct conn
+{
+    int sock; /* -1 before the connect and after the close */
+    size_t *lines; /* lengths of the lines not fully sent yet */
+    size_t first; /* index of the line being sent */
+    size_t nb; /* end of lines */
+    size_t cap; /* allocated length of lines */
+    size_t off; /* bytes of lines[first] already sent */
+    int closing; /* close once the lines are sent */
+};
+
+struct replay
+{
+    int epli;
+    struct conn *conns; /* by number of connection */
+    size_t nb_conns;
+    const char *ip;
+    const char *port;
+    size_t connects;
+    size_t lines;
+    size_t bytes;
+    size_t received;
+    size_t lost; /* lines of connections the server closed */
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int dial(const char *ip, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *addr = NULL;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(ip, port, &hints, &addr) != 0)
+        errx(1, "fail getting address");
+
+    int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock == -1 || connect(sock, addr->ai_addr, addr->ai_addrlen) == -1)
+        err(1, "cannot connect to %s:%s", ip, port);
+    freeaddrinfo(addr);
+
+    int flags = fcntl(sock, F_GETFL);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    return sock;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-x speed] capture ip port\n"
+            "  -x speed  1 for the recorded pace (default), 10 ten times "
+            "faster,\n"
+            "            0 as fast as possible\n",
+            name);
+    exit(1);
+}
+
+static struct conn *get_conn(struct replay *rp, uint32_t id)
+{
+    if (id >= rp->nb_conns)
+    {
+        size_t nb = rp->nb_conns ? rp->nb_conns : 64;
+        while (nb <= id)
+            nb *= 2;
+        rp->conns = xrealloc(rp->conns, nb * sizeof(struct conn));
+        memset(rp->conns + rp->nb_conns, 0,
+               (nb - rp->nb_conns) * sizeof(struct conn));
+        for (size_t i = rp->nb_conns; i < nb; i++)
+            rp->conns[i].sock = -1;
+        rp->nb_conns = nb;
+    }
+    return &rp->conns[id];
+}
+
+static void open_conn(struct replay *rp, uint32_t id)
+{
+    struct conn *c = get_conn(rp, id);
+    if (c->sock != -1)
+        return;
+    c->sock = dial(rp->ip, rp->port);
+    c->first = c->nb = c->off = 0;
+    c->closing = 0;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = id };
+    epoll_ctl(rp->epli, EPOLL_CTL_ADD, c->sock, &ev);
+    rp->connects++;
+}
+
+static void close_conn(struct replay *rp, struct conn *c)
+{
+    rp->lost += c->nb - c->first;
+    close(c->sock);
+    c->sock = -1;
+    c->first = c->nb = c->off = 0;
+}
+
+/* send what the socket takes, watch EPOLLOUT while lines are left */
+static void pump(struct replay *rp, uint32_t id)
+{
+    static char chunk[CHUNK];
+    struct conn *c = &rp->conns[id];
+    while (c->first < c->nb)
+    {
+        /* lay the next lines out in the chunk */
+        size_t len = 0;
+        size_t line = c->first;
+        size_t off = c->off;
+        while (len < CHUNK && line < c->nb)
+        {
+            size_t part = c->lines[line] - off;
+            if (part > CHUNK - len)
+                part = CHUNK - len;
+            memset(chunk + len, 'x', part);
+            if (off + part == c->lines[line])
+            {
+                chunk[len + part - 1] = '\n';
+                line++;
+                off = 0;
+            }
+            else
+                off += part;
+            len += part;
+        }
+
+        ssize_t w = send(c->sock, chunk, len, MSG_NOSIGNAL);
+        if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (w == -1)
+        {
+            close_conn(rp, c);
+            return;
+        }
+        for (size_t sent = w; sent != 0;)
+        {
+            size_t part = c->lines[c->first] - c->off;
+            if (part > sent)
+                part = sent;
+            c->off += part;
+            sent -= part;
+            if (c->off == c->lines[c->first])
+            {
+                c->first++;
+                c->off = 0;
+            }
+        }
+    }
+
+    if (c->first == c->nb && c->closing)
+    {
+        close_conn(rp, c);
+        return;
+    }
+    struct epoll_event ev = {
+        .events = c->first < c->nb ? EPOLLIN | EPOLLOUT : EPOLLIN,
+        .data.u32 = id
+    };
+    epoll_ctl(rp->epli, EPOLL_CTL_MOD, c->sock, &ev);
+}
+
+static void add_line(struct replay *rp, uint32_t id, size_t len)
+{
+    struct conn *c = get_conn(rp, id);
+    if (c->sock == -1 || c->closing)
+    {
+        rp->lost++;
+        return;
+    }
+    if (c->nb == c->cap)
+    {
+        /* reuse the sent part before growing */
+        memmove(c->lines, c->lines + c->first,
+                (c->nb - c->first) * sizeof(size_t));
+        c->nb -= c->first;
+        c->first = 0;
+        if (c->nb == c->cap)
+        {
+            c->cap = c->cap ? c->cap * 2 : 16;
+            c->lines = xrealloc(c->lines, c->cap * sizeof(size_t));
+        }
+    }
+    c->lines[c->nb++] = len;
+    rp->lines++;
+    rp->bytes += len;
+    if (c->nb - c->first == 1)
+        pump(rp, id);
+}
+
+static void replay_event(struct replay *rp, const struct capture_record_t *rec)
+{
+    uint32_t type = rec->info >> CAPTURE_TYPE_SHIFT;
+    size_t len = rec->info & CAPTURE_LEN_MASK;
+    struct conn *c = NULL;
+    switch (type)
+    {
+    case CAPTURE_CONNECT:
+        open_conn(rp, rec->conn);
+        break;
+    case CAPTURE_LINE:
+        /* the ring may have lost the connect */
+        if (rec->conn >= rp->nb_conns || rp->conns[rec->conn].sock == -1)
+            open_conn(rp, rec->conn);
+        if (len != 0)
+            add_line(rp, rec->conn, len);
+        break;
+    case CAPTURE_DISCONNECT:
+        c = get_conn(rp, rec->conn);
+        if (c->sock == -1)
+            break;
+        c->closing = 1;
+        if (c->first == c->nb)
+            close_conn(rp, c);
+        break;
+    default:
+        break;
+    }
+}
+
+/* serve the sockets for at most timeout milliseconds */
+static void poll_conns(struct replay *rp, int timeout)
+{
+    static char sink[CHUNK];
+    struct epoll_event events[256];
+    int nb = epoll_wait(rp->epli, events, 256, timeout);
+    for (int i = 0; i < nb; i++)
+    {
+        uint32_t id = events[i].data.u32;
+        struct conn *c = &rp->conns[id];
+        if (c->sock == -1)
+            continue;
+        if (events[i].events & EPOLLOUT)
+            pump(rp, id);
+        if (c->sock == -1 || !(events[i].events & (EPOLLIN | EPOLLHUP)))
+            continue;
+        ssize_t r = recv(c->sock, sink, sizeof(sink), 0);
+        if (r > 0)
+            rp->received += r;
+        else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            close_conn(rp, c);
+    }
+}
+
+static int pending(const struct replay *rp)
+{
+    for (size_t i = 0; i < rp->nb_conns; i++)
+        if (rp->conns[i].sock != -1 && rp->conns[i].first < rp->conns[i].nb)
+            return 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "x:")) != -1)
+    {
+        char *end = NULL;
+        switch (opt)
+        {
+        case 'x':
+            speed = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || speed < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3)
+        usage(argv[0]);
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+        err(1, "cannot open %s", argv[optind]);
+    if ((size_t)st.st_size < sizeof(struct capture_header_t))
+        errx(1, "%s is not a capture", argv[optind]);
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        err(1, "mmap");
+    close(fd);
+
+    const struct capture_header_t *hdr = map;
+    if (hdr->magic != CAPTURE_MAGIC
+        || hdr->record_size != sizeof(struct capture_record_t) || hdr->cap == 0
+        /* divided, a huge cap cannot wrap the product around */
+        || hdr->cap > ((size_t)st.st_size - sizeof(struct capture_header_t))
+                / hdr->record_size)
+        errx(1, "%s is not a capture", argv[optind]);
+    const struct capture_record_t *ring = (const void *)(hdr + 1);
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > hdr->cap ? head - hdr->cap : 0;
+
+    struct replay rp;
+    memset(&rp, 0, sizeof(struct replay));
+    rp.epli = epoll_create1(0);
+    rp.ip = argv[optind + 1];
+    rp.port = argv[optind + 2];
+
+    uint64_t start = now_ns();
+    uint64_t origin = head != first ? ring[first % hdr->cap].ns : 0;
+    uint64_t max_lag = 0;
+    for (uint64_t i = first; i < head; i++)
+    {
+        const struct capture_record_t *rec = &ring[i % hdr->cap];
+        uint64_t due = start;
+        if (speed != 0)
+            due += (rec->ns - origin) / speed;
+        for (uint64_t now = now_ns(); now < due; now = now_ns())
+            poll_conns(&rp, (due - now + 999999) / 1000000);
+        uint64_t lag = now_ns() - due;
+        if (lag > max_lag)
+            max_lag = lag;
+        replay_event(&rp, rec);
+        if (speed == 0)
+            poll_conns(&rp, 0);
+    }
+    while (pending(&rp))
+        poll_conns(&rp, 100);
+    /* let the last broadcasts come back */
+    poll_conns(&rp, 100);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    for (size_t i = 0; i < rp.nb_conns; i++)
+    {
+        if (rp.conns[i].sock != -1)
+            close(rp.conns[i].sock);
+        free(rp.conns[i].lines);
+    }
+    free(rp.conns);
+    munmap(map, st.st_size);
+
+    printf("%llu records, %zu connections, %zu lines, %zu bytes sent, "
+           "%zu received\n",
+           (unsigned long long)(head - first), rp.connects, rp.lines,
+           rp.bytes, rp.received);
+    printf("%.3f s, max lag %.3f ms, %zu lines lost\n", elapsed,
+           max_lag / 1e6, rp.lost);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Compare copying sends with MSG_ZEROCOPY sends for growing line sizes.
+# Usage: tools/zerocopy_crossover.sh [clients] [port]
+# The crossover is the first size where the zerocopy MB/s beats the copy one.
+# Loopback always copies the pages in the end, run it across a real NIC.
+
+CLIENTS=${1:-20}
+PORT=${2:-7400}
+SERVER=./epoll_server
+LOADGEN=./tools/loadgen
+
+run()
+{
+    $SERVER $1 127.0.0.1 $PORT >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    $LOADGEN -c $CLIENTS -s $2 -n $3 127.0.0.1 $PORT | sed 's/.*MB\/s //'
+    kill $pid
+    wait $pid 2>/dev/null
+    PORT=$((PORT + 1))
+}
+
+printf "%10s %12s %12s\n" size copy_MB/s zerocopy_MB/s
+for size in 1024 4096 16384 65536 262144 1048576; do
+    lines=$((64 * 1048576 / size))
+    [ $lines -gt 20000 ] && lines=20000
+    copy=$(run "" $size $lines)
+    zc=$(run "-z 1" $size $lines)
+    printf "%10s %12s %12s\n" $size "$copy" "$zc"
+done
@@ -0,0 +1,27 @@
+#include "trace.h"
+
+#include <time.h>
+
+#ifdef WITH_USDT
+
+/* raised by the tracers through the ELF notes of the probes */
+#define SEMAPHORE(name)                                                        \
+    unsigned short TRACE_SEMAPHORE(name)                                       \
+        __attribute__((section(".probes"))) = 0
+
+SEMAPHORE(accept);
+SEMAPHORE(recv);
+SEMAPHORE(frame);
+SEMAPHORE(fanout);
+SEMAPHORE(enqueue);
+SEMAPHORE(flush);
+SEMAPHORE(disconnect);
+
+#endif /* WITH_USDT */
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,76 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/**
+ * \brief Static tracepoints of the "chat" provider
+ *
+ * Built with make USDT=1, which needs <sys/sdt.h>. Every probe is a nop
+ * guarded by a semaphore the tracer raises when it attaches, so the
+ * arguments, the timestamp included, are only computed while traced.
+ * Without USDT=1 the probes are compiled out.
+ *
+ * accept(fd, listener, ns)                  a client was added
+ * recv(fd, bytes, ns)                       bytes read from a client
+ * frame(fd, bytes, ns)                      a line of a client is complete
+ * fanout(messages, clients, ns)             the batch starts its fan-out
+ * enqueue(fd, bytes, queued_bytes, queued)  a message joined an output queue
+ * flush(fd, bytes, queued_bytes, ns)        a flush wrote bytes
+ * disconnect(fd, queued_bytes, ns)          a client left
+ *
+ * The timestamps are CLOCK_MONOTONIC nanoseconds, nsecs in bpftrace.
+ */
+#ifdef WITH_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(name) chat_##name##_semaphore
+
+#define TRACE_ACTIVE(name) __builtin_expect(TRACE_SEMAPHORE(name) != 0, 0)
+
+#define TRACE3(name, a, b, c)                                                 \
+    do                                                                         \
+    {                                                                          \
+        if (TRACE_ACTIVE(name))                                                \
+            DTRACE_PROBE3(chat, name, a, b, c);                                \
+    } while (0)
+
+#define TRACE4(name, a, b, c, d)                                              \
+    do                                                                         \
+    {                                                                          \
+        if (TRACE_ACTIVE(name))                                                \
+            DTRACE_PROBE4(chat, name, a, b, c, d);                             \
+    } while (0)
+
+extern unsigned short TRACE_SEMAPHORE(accept);
+extern unsigned short TRACE_SEMAPHORE(recv);
+extern unsigned short TRACE_SEMAPHORE(frame);
+extern unsigned short TRACE_SEMAPHORE(fanout);
+extern unsigned short TRACE_SEMAPHORE(enqueue);
+extern unsigned short TRACE_SEMAPHORE(flush);
+extern unsigned short TRACE_SEMAPHORE(disconnect);
+
+#else
+
+#define TRACE3(name, a, b, c)                                                 \
+    do                                                                         \
+    {                                                                          \
+    } while (0)
+
+#define TRACE4(name, a, b, c, d)                                              \
+    do                                                                         \
+    {                                                                          \
+    } while (0)
+
+#endif /* WITH_USDT */
+
+/**
+ * \brief Timestamp of the probes
+ *
+ * \return CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t trace_now(void);
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,275 @@
+#include "transport.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils/xalloc.h"
+
+static ssize_t socket_recv(void *ctx, int fd, void *buf, size_t len)
+{
+    (void)ctx;
+    return recv(fd, buf, len, 0);
+}
+
+static ssize_t socket_writev(void *ctx, int fd, const struct iovec *iov,
+                             int nb)
+{
+    (void)ctx;
+    return writev(fd, iov, nb);
+}
+
+static int socket_ctl(void *ctx, int epoll_instance, int op, int fd,
+                      uint32_t events)
+{
+    (void)ctx;
+    struct epoll_event evt = { 0 };
+    evt.data.fd = fd;
+    evt.events = events;
+    return epoll_ctl(epoll_instance, op, fd, op == EPOLL_CTL_DEL ? NULL : &evt);
+}
+
+static void socket_shutdown(void *ctx, int fd)
+{
+    (void)ctx;
+    shutdown(fd, SHUT_RDWR);
+}
+
+static int socket_close(void *ctx, int fd)
+{
+    (void)ctx;
+    return close(fd);
+}
+
+const struct transport_t socket_transport = {
+    socket_recv, socket_writev, socket_ctl, socket_shutdown, socket_close, NULL,
+};
+
+static struct mem_socket_t *mem_socket(struct mem_transport_t *mem, int fd)
+{
+    if ((size_t)fd >= mem->by_fd_cap || !mem->by_fd[fd].open)
+        errx(1, "fd %d is not a memory client", fd);
+    return &mem->by_fd[fd];
+}
+
+/* listed until mem_poll() finds it has nothing to report */
+static void mem_list(struct mem_transport_t *mem, int fd)
+{
+    struct mem_socket_t *sock = &mem->by_fd[fd];
+    if (sock->listed)
+        return;
+    if (mem->nb_ready == mem->ready_cap)
+    {
+        mem->ready_cap = mem->ready_cap ? mem->ready_cap * 2 : 64;
+        mem->ready =
+            xrealloc_tag(MEM_OTHER, mem->ready, mem->ready_cap * sizeof(int));
+    }
+    mem->ready[mem->nb_ready++] = fd;
+    sock->listed = 1;
+}
+
+static int mem_readable(const struct mem_socket_t *sock)
+{
+    return (sock->events & EPOLLIN)
+        && (sock->input_off != sock->input_len || sock->eof);
+}
+
+static ssize_t mem_recv(void *ctx, int fd, void *buf, size_t len)
+{
+    struct mem_transport_t *mem = ctx;
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    mem->reads++;
+    size_t left = sock->input_len - sock->input_off;
+    if (left == 0)
+    {
+        if (sock->eof)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len > left)
+        len = left;
+    memcpy(buf, sock->input + sock->input_off, len);
+    sock->input_off += len;
+    if (sock->input_off == sock->input_len)
+        sock->input_off = sock->input_len = 0;
+    return len;
+}
+
+static ssize_t mem_writev(void *ctx, int fd, const struct iovec *iov, int nb)
+{
+    struct mem_transport_t *mem = ctx;
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    if (sock->shut)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 0; i < nb; i++)
+        len += iov[i].iov_len;
+    if (mem->record)
+    {
+        if (sock->output_len + len > sock->output_cap)
+        {
+            size_t cap = sock->output_cap ? sock->output_cap : 256;
+            while (cap < sock->output_len + len)
+                cap *= 2;
+            sock->output = xrealloc_tag(MEM_OTHER, sock->output, cap);
+            sock->output_cap = cap;
+        }
+        for (int i = 0; i < nb; i++)
+        {
+            memcpy(sock->output + sock->output_len, iov[i].iov_base,
+                   iov[i].iov_len);
+            sock->output_len += iov[i].iov_len;
+        }
+    }
+    mem->writes++;
+    mem->bytes_out += len;
+    return len;
+}
+
+static int mem_ctl(void *ctx, int epoll_instance, int op, int fd,
+                   uint32_t events)
+{
+    (void)epoll_instance;
+    struct mem_transport_t *mem = ctx;
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    sock->events = op == EPOLL_CTL_DEL ? 0 : events;
+    if (mem_readable(sock))
+        mem_list(mem, fd);
+    return 0;
+}
+
+static void mem_shutdown(void *ctx, int fd)
+{
+    struct mem_transport_t *mem = ctx;
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    sock->shut = 1;
+    sock->eof = 1;
+    sock->input_off = sock->input_len = 0;
+    if (mem_readable(sock))
+        mem_list(mem, fd);
+}
+
+static int mem_close(void *ctx, int fd)
+{
+    struct mem_transport_t *mem = ctx;
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    xfree_tag(MEM_INPUT, sock->input);
+    xfree_tag(MEM_OTHER, sock->output);
+    /* still listed, mem_poll() skips it until the fd is connected again */
+    int listed = sock->listed;
+    memset(sock, 0, sizeof(struct mem_socket_t));
+    sock->listed = listed;
+    return close(fd);
+}
+
+void mem_transport_init(struct mem_transport_t *mem)
+{
+    memset(mem, 0, sizeof(struct mem_transport_t));
+    mem->transport.recv = mem_recv;
+    mem->transport.writev = mem_writev;
+    mem->transport.ctl = mem_ctl;
+    mem->transport.shutdown = mem_shutdown;
+    mem->transport.close = mem_close;
+    mem->transport.ctx = mem;
+}
+
+void mem_transport_free(struct mem_transport_t *mem)
+{
+    for (size_t fd = 0; fd < mem->by_fd_cap; fd++)
+    {
+        if (mem->by_fd[fd].open)
+            mem_close(mem, fd);
+    }
+    xfree_tag(MEM_OTHER, mem->by_fd);
+    xfree_tag(MEM_OTHER, mem->ready);
+}
+
+int mem_connect(struct mem_transport_t *mem)
+{
+    int fd = open("/dev/null", O_RDONLY);
+    if (fd == -1)
+        err(1, "cannot open /dev/null");
+    if ((size_t)fd >= mem->by_fd_cap)
+    {
+        size_t cap = mem->by_fd_cap ? mem->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        mem->by_fd = xrealloc_tag(MEM_OTHER, mem->by_fd,
+                                  cap * sizeof(struct mem_socket_t));
+        memset(mem->by_fd + mem->by_fd_cap, 0,
+               (cap - mem->by_fd_cap) * sizeof(struct mem_socket_t));
+        mem->by_fd_cap = cap;
+    }
+    mem->by_fd[fd].open = 1;
+    return fd;
+}
+
+void mem_send(struct mem_transport_t *mem, int fd, const void *data,
+              size_t len)
+{
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    if (sock->eof)
+        return;
+    if (sock->input_len + len > sock->input_cap)
+    {
+        size_t cap = sock->input_cap ? sock->input_cap : 256;
+        while (cap < sock->input_len + len)
+            cap *= 2;
+        sock->input = xrealloc_tag(MEM_INPUT, sock->input, cap);
+        sock->input_cap = cap;
+    }
+    memcpy(sock->input + sock->input_len, data, len);
+    sock->input_len += len;
+    if (mem_readable(sock))
+        mem_list(mem, fd);
+}
+
+void mem_hangup(struct mem_transport_t *mem, int fd)
+{
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    sock->eof = 1;
+    if (mem_readable(sock))
+        mem_list(mem, fd);
+}
+
+const char *mem_output(struct mem_transport_t *mem, int fd, size_t *len)
+{
+    struct mem_socket_t *sock = mem_socket(mem, fd);
+    *len = sock->output_len;
+    sock->output_len = 0;
+    return sock->output;
+}
+
+int mem_poll(struct mem_transport_t *mem, struct epoll_event *events,
+             int max)
+{
+    int nb = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < mem->nb_ready; i++)
+    {
+        int fd = mem->ready[i];
+        struct mem_socket_t *sock = &mem->by_fd[fd];
+        /* level-triggered, a client left readable is reported again */
+        if (!sock->open || !mem_readable(sock))
+        {
+            sock->listed = 0;
+            continue;
+        }
+        mem->ready[kept++] = fd;
+        if (nb < max)
+        {
+            events[nb].events = EPOLLIN;
+            events[nb].data.fd = fd;
+            nb++;
+        }
+    }
+    mem->nb_ready = kept;
+    return nb;
+}
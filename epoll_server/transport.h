@@ -0,0 +1,172 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * \brief Socket calls of the engine on the clients
+ *
+ * The operations follow the system calls they stand for, errno included:
+ * -1 and EAGAIN when nothing can be read or written, 0 from recv at the end
+ * of the stream. The socket backend makes the calls, the memory backend
+ * runs the engine without the kernel for the microbenchmarks. Accepting,
+ * TLS and MSG_ZEROCOPY stay on the sockets.
+ */
+struct transport_t
+{
+    /** recv(2) */
+    ssize_t (*recv)(void *ctx, int fd, void *buf, size_t len);
+
+    /** writev(2) */
+    ssize_t (*writev)(void *ctx, int fd, const struct iovec *iov, int nb);
+
+    /** epoll_ctl(2) of the client on the epoll instance */
+    int (*ctl)(void *ctx, int epoll_instance, int op, int fd, uint32_t events);
+
+    /** shutdown(2) of both directions */
+    void (*shutdown)(void *ctx, int fd);
+
+    /** close(2) */
+    int (*close)(void *ctx, int fd);
+
+    void *ctx; /**< given back to every operation */
+};
+
+/**
+ * \brief The backend of the real sockets, the default of the tables
+ */
+extern const struct transport_t socket_transport;
+
+/**
+ * \brief Client of the memory backend
+ */
+struct mem_socket_t
+{
+    char *input; /**< bytes the client sent that the engine did not read */
+
+    size_t input_len; /**< end of the bytes in input */
+
+    size_t input_off; /**< bytes of input already read */
+
+    size_t input_cap; /**< allocated size of input */
+
+    char *output; /**< bytes the engine wrote, if the backend records them */
+
+    size_t output_len; /**< bytes in output */
+
+    size_t output_cap; /**< allocated size of output */
+
+    uint32_t events; /**< interest of the engine, 0 when not watched */
+
+    unsigned open : 1; /**< the fd is a client of the backend */
+
+    unsigned listed : 1; /**< in the ready list */
+
+    unsigned eof : 1; /**< the client closed, recv returns 0 */
+
+    unsigned shut : 1; /**< the engine shut the socket down */
+};
+
+/**
+ * \brief Clients simulated in memory
+ *
+ * The clients are descriptors of /dev/null, so that their numbers do not
+ * collide with the other descriptors of the engine, but no call is made
+ * on them. The engine reads what mem_send() gave, its writes are counted
+ * and dropped unless record is set, a client is always writable.
+ * mem_poll() stands for epoll_wait(2), level-triggered like the server
+ * uses it.
+ */
+struct mem_transport_t
+{
+    struct transport_t transport; /**< the operations, to give the tables */
+
+    struct mem_socket_t *by_fd; /**< state of every client fd */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    int *ready; /**< clients that may be readable, checked by mem_poll() */
+
+    size_t nb_ready; /**< number of elements in ready */
+
+    size_t ready_cap; /**< allocated length of ready */
+
+    uint64_t reads; /**< recv calls */
+
+    uint64_t writes; /**< writev calls */
+
+    uint64_t bytes_out; /**< bytes the engine wrote */
+
+    int record; /**< keep the writes in the output of the clients */
+};
+
+/**
+ * \brief Initialize a memory backend without clients
+ *
+ * \param mem: the backend
+ */
+void mem_transport_init(struct mem_transport_t *mem);
+
+/**
+ * \brief Close the clients left and free the backend
+ *
+ * \param mem: the backend
+ */
+void mem_transport_free(struct mem_transport_t *mem);
+
+/**
+ * \brief Connect a new client
+ *
+ * \param mem: the backend
+ *
+ * \return Its fd, to add to the engine
+ */
+int mem_connect(struct mem_transport_t *mem);
+
+/**
+ * \brief Send bytes to the engine from a client
+ *
+ * \param mem: the backend
+ * \param fd: the client
+ * \param data: the bytes
+ * \param len: length of data
+ */
+void mem_send(struct mem_transport_t *mem, int fd, const void *data,
+              size_t len);
+
+/**
+ * \brief Close a client from its side, the engine reads the end of stream
+ *
+ * \param mem: the backend
+ * \param fd: the client
+ */
+void mem_hangup(struct mem_transport_t *mem, int fd);
+
+/**
+ * \brief Take what the engine wrote to a client, when the backend records
+ *
+ * \param mem: the backend
+ * \param fd: the client
+ * \param len: receives the number of bytes
+ *
+ * \return The bytes, valid until the next call on the client
+ */
+const char *mem_output(struct mem_transport_t *mem, int fd, size_t *len);
+
+/**
+ * \brief Report the clients the engine would read from
+ *
+ * \param mem: the backend
+ * \param events: receives EPOLLIN events carrying the fds
+ * \param max: length of events
+ *
+ * \return The number of events, 0 once the engine read everything
+ */
+int mem_poll(struct mem_transport_t *mem, struct epoll_event *events,
+             int max);
+
+#endif /* !TRANSPORT_H_ */
@@ -0,0 +1,440 @@
+#include "upgrade.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "epoll-server.h"
+#include "utils/xalloc.h"
+
+/**
+ * \brief First word of a handover, changed with the layout of the records
+ */
+#define UPGRADE_MAGIC 0x43484135
+
+#define CLIENT_STREAMING 0x1
+#define CLIENT_DISCARDING 0x2
+#define CLIENT_ZEROCOPY 0x4
+#define CLIENT_NO_ZEROCOPY 0x8
+#define CLIENT_CLOSING 0x10
+#define CLIENT_SEQUENCED 0x20
+#define CLIENT_SESSION 0x40
+#define CLIENT_WEBSOCKET 0x80
+#define CLIENT_PRESENCE 0x100
+
+/**
+ * \brief Sent with the listeners at the start of a handover
+ */
+struct upgrade_hello_t
+{
+    uint32_t magic; /**< UPGRADE_MAGIC */
+
+    uint32_t nb_clients; /**< number of client records that follow */
+
+    uint32_t nb_listeners; /**< chat listeners, peer and WebSocket ones */
+
+    uint32_t chat; /**< number of chat listeners, the first ones */
+
+    uint32_t peer; /**< 1 if the peer listener follows the chat ones */
+
+    uint32_t websocket; /**< number of WebSocket listeners, the last ones */
+
+    uint64_t seq; /**< sequence number of the latest broadcast */
+};
+
+/**
+ * \brief State of a client, followed by its partial line and pending output
+ */
+struct client_record_t
+{
+    uint32_t flags; /**< CLIENT_* bits */
+
+    uint32_t zc_next; /**< id of the next zerocopy send of the socket */
+
+    uint32_t nb_read; /**< bytes of the partial line, in buffer or streamed */
+
+    uint32_t partial_len; /**< bytes of partial line that follow */
+
+    uint64_t out_len; /**< bytes of pending output that follow */
+
+    char nick[NICK_MAX + 1]; /**< the nickname of the client, or empty */
+
+    uint8_t session[SESSION_TOKEN]; /**< token of its session, if any */
+
+    struct ws_conn_t ws; /**< decoding state of a WebSocket client */
+};
+
+static int write_full(int sock, const void *data, size_t len)
+{
+    const char *cur = data;
+    while (len != 0)
+    {
+        ssize_t w = send(sock, cur, len, MSG_NOSIGNAL);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w == -1)
+            return -1;
+        cur += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int read_full(int sock, void *data, size_t len)
+{
+    char *cur = data;
+    while (len != 0)
+    {
+        ssize_t r = recv(sock, cur, len, 0);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        cur += r;
+        len -= r;
+    }
+    return 0;
+}
+
+union fd_control
+{
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_BATCH)];
+};
+
+static int send_fds(int sock, const void *data, size_t len, const int *fds,
+                    size_t nb)
+{
+    union fd_control control;
+    struct iovec iov = { (void *)data, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nb);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nb);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nb);
+
+    ssize_t w = 0;
+    while ((w = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        continue;
+    if (w == -1)
+        return -1;
+    return write_full(sock, (const char *)data + w, len - w);
+}
+
+/* the sockets ride on the first byte of data, the rest is read normally */
+static int recv_fds(int sock, void *data, size_t len, int *fds, size_t max)
+{
+    union fd_control control;
+    struct iovec iov = { data, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t r = 0;
+    while ((r = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+        continue;
+    if (r <= 0 || (msg.msg_flags & MSG_CTRUNC))
+        return -1;
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL || cm->cmsg_level != SOL_SOCKET
+        || cm->cmsg_type != SCM_RIGHTS)
+        return -1;
+    size_t nb = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (nb > max)
+        return -1;
+    memcpy(fds, CMSG_DATA(cm), sizeof(int) * nb);
+    if (read_full(sock, (char *)data + r, len - r) == -1)
+        return -1;
+    return nb;
+}
+
+int upgrade_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        errx(1, "upgrade socket path too long");
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        errx(1, "cannot create upgrade socket");
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1
+        || listen(sock, 1) == -1)
+        errx(1, "cannot listen on upgrade socket %s", path);
+    return sock;
+}
+
+int upgrade_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        errx(1, "upgrade socket path too long");
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        errx(1, "cannot create upgrade socket");
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un))
+        == -1)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int send_client(struct server_t *server, int sock,
+                       const struct connection_t *cc)
+{
+    struct client_record_t rec;
+    memset(&rec, 0, sizeof(struct client_record_t));
+    rec.flags = (cc->streaming ? CLIENT_STREAMING : 0)
+        | (cc->discarding ? CLIENT_DISCARDING : 0)
+        | (cc->zerocopy ? CLIENT_ZEROCOPY : 0)
+        | (cc->no_zerocopy ? CLIENT_NO_ZEROCOPY : 0)
+        | (cc->closing ? CLIENT_CLOSING : 0)
+        | (cc->sequenced ? CLIENT_SEQUENCED : 0)
+        | (cc->websocket ? CLIENT_WEBSOCKET : 0)
+        | (presence_subscribed(&server->presence, cc->client_socket)
+               ? CLIENT_PRESENCE
+               : 0);
+    rec.zc_next = cc->zc_next;
+    rec.nb_read = cc->nb_read;
+    rec.partial_len = cc->buffer ? cc->nb_read : 0;
+    rec.out_len = pending_output(cc);
+    const char *nick = nick_of(&server->nicks, cc->client_socket);
+    if (nick != NULL)
+        strcpy(rec.nick, nick);
+    const struct session_t *session =
+        session_of(&server->sessions, cc->client_socket);
+    if (session != NULL)
+    {
+        rec.flags |= CLIENT_SESSION;
+        memcpy(rec.session, session->token, SESSION_TOKEN);
+    }
+    if (cc->websocket)
+        rec.ws = *ws_get(&server->websockets, cc->client_socket);
+    if (write_full(sock, &rec, sizeof(struct client_record_t)) == -1
+        || write_full(sock, cc->buffer, rec.partial_len) == -1)
+        return -1;
+
+    const struct outq_t *out = cc->out;
+    for (uint32_t i = 0; out != NULL && i < out->count; i++)
+    {
+        const struct message_t *msg = out->ring[(out->first + i) % out->cap];
+        size_t off = i == 0 ? out->off : 0;
+        if (write_full(sock, msg->data + off, msg->len - off) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* OpenSSL sessions stay behind, the kernel ones belong to the socket */
+static int movable(const struct connection_t *cc)
+{
+    return !cc->handshaking && !cc->tls_read && !cc->tls_write;
+}
+
+int upgrade_send(struct server_t *server, int sock)
+{
+    struct timeval timeout = { UPGRADE_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct client_table_t *table = &server->clients;
+    struct upgrade_hello_t hello;
+    memset(&hello, 0, sizeof(struct upgrade_hello_t));
+    hello.magic = UPGRADE_MAGIC;
+    for (size_t i = 0; i < table->count; i++)
+        hello.nb_clients += movable(table->all[i]);
+    hello.seq = server->history.seq;
+    int listeners[MAX_LISTENERS + 1];
+    for (size_t i = 0; i < server->nb_listeners; i++)
+    {
+        if (!server->listeners[i].websocket)
+            listeners[hello.nb_listeners++] = server->listeners[i].sock;
+    }
+    hello.chat = hello.nb_listeners;
+    if (server->fed.listen_sock != -1)
+    {
+        listeners[hello.nb_listeners++] = server->fed.listen_sock;
+        hello.peer = 1;
+    }
+    for (size_t i = 0; i < server->nb_listeners; i++)
+    {
+        if (server->listeners[i].websocket)
+            listeners[hello.nb_listeners++] = server->listeners[i].sock;
+    }
+    hello.websocket = hello.nb_listeners - hello.chat - hello.peer;
+    if (send_fds(sock, &hello, sizeof(hello), listeners, hello.nb_listeners)
+        == -1)
+        return -1;
+
+    size_t next = 0;
+    for (uint32_t sent = 0; sent < hello.nb_clients;)
+    {
+        uint32_t count = 0;
+        const struct connection_t *batch[UPGRADE_BATCH];
+        int socks[UPGRADE_BATCH];
+        for (; count < UPGRADE_BATCH && next < table->count; next++)
+        {
+            if (!movable(table->all[next]))
+                continue;
+            batch[count] = table->all[next];
+            socks[count] = batch[count]->client_socket;
+            count++;
+        }
+        if (send_fds(sock, &count, sizeof(count), socks, count) == -1)
+            return -1;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (send_client(server, sock, batch[i]) == -1)
+                return -1;
+        }
+        sent += count;
+    }
+
+    char ack = 0;
+    if (read_full(sock, &ack, 1) == -1 || ack != 'U')
+        return -1;
+    return 0;
+}
+
+static void *read_alloc(int sock, size_t len)
+{
+    char *data = xmalloc_tag(MEM_OTHER, len ? len : 1);
+    if (read_full(sock, data, len) == -1)
+        errx(1, "upgrade interrupted");
+    return data;
+}
+
+static void receive_client(struct server_t *server, int sock, int fd)
+{
+    struct client_record_t rec;
+    if (read_full(sock, &rec, sizeof(struct client_record_t)) == -1)
+        errx(1, "upgrade interrupted");
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == -1)
+        addr.ss_family = AF_UNSPEC;
+    struct connection_t *cc = add_client(&server->clients, fd);
+    limiter_add(&server->limiter, fd, (struct sockaddr *)&addr);
+    poller_socket(&server->poller, fd, &server->metrics);
+    server->metrics.clients++;
+
+    cc->streaming = (rec.flags & CLIENT_STREAMING) != 0;
+    cc->discarding = (rec.flags & CLIENT_DISCARDING) != 0;
+    cc->zerocopy = (rec.flags & CLIENT_ZEROCOPY) != 0;
+    cc->no_zerocopy = (rec.flags & CLIENT_NO_ZEROCOPY) != 0;
+    cc->closing = (rec.flags & CLIENT_CLOSING) != 0;
+    cc->sequenced = (rec.flags & CLIENT_SEQUENCED) != 0;
+    server->nb_sequenced += cc->sequenced;
+    cc->websocket = (rec.flags & CLIENT_WEBSOCKET) != 0;
+    if (cc->websocket)
+        *ws_add(&server->websockets, fd) = rec.ws;
+    cc->zc_next = rec.zc_next;
+    rec.nick[NICK_MAX] = '\0';
+    /* the subscribers already know the users taken over, no join */
+    if (nick_valid(rec.nick, strlen(rec.nick)))
+        nick_set(&server->nicks, fd, rec.nick, strlen(rec.nick));
+    if (rec.flags & CLIENT_PRESENCE)
+        presence_subscribe(&server->presence, fd);
+    if (rec.flags & CLIENT_SESSION)
+        session_open(&server->sessions, fd, rec.session);
+
+    if (rec.partial_len != 0)
+    {
+        char *partial = read_alloc(sock, rec.partial_len);
+        save_data(&server->clients, cc, partial, rec.partial_len);
+        xfree_tag(MEM_OTHER, partial);
+    }
+    else
+        cc->nb_read = rec.nb_read;
+    if (rec.out_len != 0)
+    {
+        char *output = read_alloc(sock, rec.out_len);
+        struct message_t *msg = message_new(output, rec.out_len);
+        queue_message(&server->clients, cc, msg);
+        message_unref(msg);
+        xfree_tag(MEM_OTHER, output);
+        cc->want_write = 1;
+    }
+
+    struct epoll_event evt = { 0 };
+    evt.data.fd = fd;
+    evt.events = EPOLLIN | (cc->want_write ? EPOLLOUT : 0);
+    if (epoll_ctl(server->epoll_instance, EPOLL_CTL_ADD, fd, &evt) == -1)
+        errx(1, "cannot add to epoll instance client fd");
+}
+
+int upgrade_receive(struct server_t *server, int sock)
+{
+    struct upgrade_hello_t hello;
+    int listeners[MAX_LISTENERS + 1];
+    int nb = recv_fds(sock, &hello, sizeof(hello), listeners,
+                      MAX_LISTENERS + 1);
+    if (nb < 1 || hello.magic != UPGRADE_MAGIC
+        || (uint32_t)nb != hello.nb_listeners || hello.peer > 1
+        || hello.chat == 0 || hello.chat + hello.websocket > MAX_LISTENERS
+        || hello.chat + hello.peer + hello.websocket != hello.nb_listeners)
+        errx(1, "invalid upgrade handover");
+    for (int i = 0; i < nb; i++)
+    {
+        if (hello.peer && (uint32_t)i == hello.chat)
+            continue;
+        struct listener_t *listener =
+            &server->listeners[server->nb_listeners++];
+        listener->sock = listeners[i];
+        listener->websocket = (uint32_t)i >= hello.chat + hello.peer;
+    }
+    int peer_listen = hello.peer ? listeners[hello.chat] : -1;
+    /* the history stays behind, resumes from before the handover resync */
+    server->history.seq = hello.seq;
+
+    /* connections of the old process are kept whatever the address limit */
+    size_t max_per_ip = server->limiter.max_per_ip;
+    server->limiter.max_per_ip = 0;
+    uint32_t received = 0;
+    while (received < hello.nb_clients)
+    {
+        uint32_t count = 0;
+        int socks[UPGRADE_BATCH];
+        int nb_socks = recv_fds(sock, &count, sizeof(count), socks,
+                                UPGRADE_BATCH);
+        if (nb_socks == -1 || (uint32_t)nb_socks != count)
+            errx(1, "invalid upgrade handover");
+        for (uint32_t i = 0; i < count; i++)
+            receive_client(server, sock, socks[i]);
+        received += count;
+    }
+    server->limiter.max_per_ip = max_per_ip;
+
+    if (write_full(sock, "U", 1) == -1)
+        errx(1, "upgrade not acknowledged");
+    close(sock);
+    return peer_listen;
+}
@@ -0,0 +1,66 @@
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+struct server_t;
+
+/**
+ * \brief Clients whose sockets are sent in one SCM_RIGHTS message
+ */
+#define UPGRADE_BATCH 128
+
+/**
+ * \brief Seconds the old process waits on the new one before resuming
+ */
+#define UPGRADE_TIMEOUT 5
+
+/**
+ * \brief Create the Unix socket new processes connect to for an upgrade
+ *
+ * \param path: the path of the socket, replaced if it exists
+ *
+ * \return The listening socket
+ */
+int upgrade_listen(const char *path);
+
+/**
+ * \brief Connect to the process serving on an upgrade socket
+ *
+ * \param path: the path of the socket
+ *
+ * \return The connected socket, -1 if no process listens on path
+ */
+int upgrade_connect(const char *path);
+
+/**
+ * \brief Hand the listeners and the clients over to a new process
+ *
+ * \param server: the server state, with no message left in its batch
+ * \param sock: the socket accepted from the upgrade listener
+ *
+ * \return 0 once the new process acknowledged, -1 if it failed or timed out
+ *
+ * The sockets travel with SCM_RIGHTS, along with the partial line, the
+ * pending output, the nickname and the flags of every client. Nothing is modified, so the
+ * server may go on serving after a failure. After a success it must exit
+ * without closing or shutting down the sockets. The TLS clients whose
+ * session OpenSSL holds, handshaking or not offloaded to the kernel, are
+ * left out and closed with the old process.
+ */
+int upgrade_send(struct server_t *server, int sock);
+
+/**
+ * \brief Take over the listeners and the clients of an old process
+ *
+ * \param server: the server state, initialized apart from its listeners
+ * \param sock: the socket returned by upgrade_connect()
+ *
+ * \return The peer listener of the old process, -1 if it had none
+ *
+ * The chat listener and the WebSocket one, if any, are set in server. The
+ * clients are registered in the epoll instance of server with their
+ * partial line and pending output restored. Exits on failure, in which case
+ * the old process resumes.
+ */
+int upgrade_receive(struct server_t *server, int sock);
+
+#endif /* UPGRADE_H_ */
@@ -1,6 +1,8 @@
 #include "xalloc.h"
 
 #include <err.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <stdlib.h>
 
 void *xmalloc(size_t size)
@@ -29,3 +31,176 @@ void *xrealloc(void *ptr, size_t size)
 
     return res;
 }
+
+/*
+** Counters of a thread, only written by it. The other threads read them
+** with relaxed loads under threads_lock, so a sum may miss the latest
+** allocations but never sees a torn value. The live bytes of a thread go
+** negative when it frees what another one allocated.
+*/
+struct mem_thread_t
+{
+    int64_t live[MEM_TAGS];
+    uint64_t allocs[MEM_TAGS];
+    uint64_t alloc_bytes[MEM_TAGS];
+    struct mem_thread_t *next;
+};
+
+static __thread struct mem_thread_t *local;
+
+/* the threads alive that allocated */
+static struct mem_thread_t *threads;
+
+/* the counts of the threads that exited, so that they stay in the sums */
+static struct mem_thread_t retired;
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t exit_key;
+
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static uint64_t peaks[MEM_TAGS];
+
+static const char *const tag_names[MEM_TAGS] = {
+    "connections", "input", "output",   "messages", "history", "sessions",
+    "filter",      "peers", "tasks",    "tls",      "other",
+};
+
+/* at the exit of a thread, its counts move to retired */
+static void retire(void *record)
+{
+    struct mem_thread_t *t = record;
+    pthread_mutex_lock(&threads_lock);
+    struct mem_thread_t **prev = &threads;
+    while (*prev != t)
+        prev = &(*prev)->next;
+    *prev = t->next;
+    for (int tag = 0; tag < MEM_TAGS; tag++)
+    {
+        retired.live[tag] += t->live[tag];
+        retired.allocs[tag] += t->allocs[tag];
+        retired.alloc_bytes[tag] += t->alloc_bytes[tag];
+    }
+    pthread_mutex_unlock(&threads_lock);
+    local = NULL;
+    free(t);
+}
+
+static void create_exit_key(void)
+{
+    if (pthread_key_create(&exit_key, retire) != 0)
+        errx(1, "Impossible to create the thread exit key");
+}
+
+static struct mem_thread_t *counters(void)
+{
+    if (local == NULL)
+    {
+        pthread_once(&exit_once, create_exit_key);
+        local = xcalloc(1, sizeof(struct mem_thread_t));
+        pthread_mutex_lock(&threads_lock);
+        local->next = threads;
+        threads = local;
+        pthread_mutex_unlock(&threads_lock);
+        pthread_setspecific(exit_key, local);
+    }
+    return local;
+}
+
+static void account(enum mem_tag_t tag, size_t old, size_t new)
+{
+    struct mem_thread_t *t = counters();
+    __atomic_store_n(&t->live[tag], t->live[tag] + (int64_t)(new - old),
+                     __ATOMIC_RELAXED);
+    if (new > old)
+    {
+        __atomic_store_n(&t->allocs[tag], t->allocs[tag] + 1,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&t->alloc_bytes[tag],
+                         t->alloc_bytes[tag] + (new - old), __ATOMIC_RELAXED);
+    }
+}
+
+void *xmalloc_tag(enum mem_tag_t tag, size_t size)
+{
+    void *res = xmalloc(size);
+    account(tag, 0, malloc_usable_size(res));
+    return res;
+}
+
+void *xcalloc_tag(enum mem_tag_t tag, size_t nmemb, size_t size)
+{
+    void *res = xcalloc(nmemb, size);
+    account(tag, 0, malloc_usable_size(res));
+    return res;
+}
+
+void *xrealloc_tag(enum mem_tag_t tag, void *ptr, size_t size)
+{
+    size_t old = malloc_usable_size(ptr);
+    void *res = xrealloc(ptr, size);
+    account(tag, old, malloc_usable_size(res));
+    return res;
+}
+
+void xfree_tag(enum mem_tag_t tag, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    account(tag, malloc_usable_size(ptr), 0);
+    free(ptr);
+}
+
+/* called with threads_lock held */
+static uint64_t live_bytes(enum mem_tag_t tag)
+{
+    int64_t live = retired.live[tag];
+    for (struct mem_thread_t *t = threads; t != NULL; t = t->next)
+        live += __atomic_load_n(&t->live[tag], __ATOMIC_RELAXED);
+    /* a free seen before its allocation */
+    return live > 0 ? live : 0;
+}
+
+static void sample(void)
+{
+    for (int tag = 0; tag < MEM_TAGS; tag++)
+    {
+        uint64_t live = live_bytes(tag);
+        if (live > peaks[tag])
+            peaks[tag] = live;
+    }
+}
+
+void xalloc_sample(void)
+{
+    pthread_mutex_lock(&threads_lock);
+    sample();
+    pthread_mutex_unlock(&threads_lock);
+}
+
+void xalloc_stats(struct mem_stats_t *stats)
+{
+    pthread_mutex_lock(&threads_lock);
+    sample();
+    for (int tag = 0; tag < MEM_TAGS; tag++)
+    {
+        stats[tag].live = live_bytes(tag);
+        stats[tag].peak = peaks[tag];
+        stats[tag].allocs = retired.allocs[tag];
+        stats[tag].alloc_bytes = retired.alloc_bytes[tag];
+        for (struct mem_thread_t *t = threads; t != NULL; t = t->next)
+        {
+            stats[tag].allocs +=
+                __atomic_load_n(&t->allocs[tag], __ATOMIC_RELAXED);
+            stats[tag].alloc_bytes +=
+                __atomic_load_n(&t->alloc_bytes[tag], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+const char *xalloc_tag_name(enum mem_tag_t tag)
+{
+    return tag_names[tag];
+}
@@ -2,6 +2,37 @@
 #define XMALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+/**
+** \brief Subsystems the memory of the server is accounted to.
+*/
+enum mem_tag_t
+{
+    MEM_CONNECTIONS, /**< connection_t and the per-fd state of the modules */
+    MEM_INPUT, /**< partial lines and the chunks deferred behind a stream */
+    MEM_OUTPUT, /**< output queues, zerocopy pins and direct replies */
+    MEM_MESSAGES, /**< message payloads and the batches of an iteration */
+    MEM_HISTORY, /**< ring of the broadcasts kept for the sessions */
+    MEM_SESSIONS, /**< sessions and nicknames */
+    MEM_FILTER, /**< term lists and automatons of the filter */
+    MEM_PEERS, /**< links to the other servers */
+    MEM_TASKS, /**< executor tasks and the pipeline queues */
+    MEM_TLS, /**< OpenSSL contexts and sessions */
+    MEM_OTHER, /**< event arrays, multicast buffers, upgrade transfers */
+    MEM_TAGS
+};
+
+/**
+** \brief Allocation counters of a tag, summed over the threads.
+*/
+struct mem_stats_t
+{
+    uint64_t live; /**< bytes currently allocated */
+    uint64_t peak; /**< highest live bytes seen by xalloc_sample() */
+    uint64_t allocs; /**< allocations and growing reallocations */
+    uint64_t alloc_bytes; /**< bytes of those allocations */
+};
 
 /**
 ** \brief Malloc wrapper that exit on failure.
@@ -29,4 +60,75 @@ void *xcalloc(size_t nmemb, size_t size);
 */
 void *xrealloc(void *ptr, size_t size);
 
+/**
+** \brief Malloc wrapper that exit on failure and accounts to a tag.
+**
+** The sizes counted are those malloc(3) really reserved. The counters are
+** thread-local, an allocation costs no atomic operation nor lock.
+** Memory allocated with a tag must be freed with xfree_tag() and the same
+** tag, the untagged wrappers are not accounted.
+**
+** \param tag The subsystem of the memory.
+** \param size The size to malloc.
+** \return The malloc return.
+*/
+void *xmalloc_tag(enum mem_tag_t tag, size_t size);
+
+/**
+** \brief Calloc wrapper that exit on failure and accounts to a tag.
+**
+** \param tag The subsystem of the memory.
+** \param nmemb The number of elements.
+** \param size The size to calloc.
+** \return The calloc return.
+*/
+void *xcalloc_tag(enum mem_tag_t tag, size_t nmemb, size_t size);
+
+/**
+** \brief Realloc wrapper that exit on failure and accounts to a tag.
+**
+** \param tag The subsystem of the memory.
+** \param ptr The mem pointer, allocated with the same tag or NULL.
+** \param size The size to realloc.
+** \return The realloc return.
+*/
+void *xrealloc_tag(enum mem_tag_t tag, void *ptr, size_t size);
+
+/**
+** \brief Free memory allocated with a tag.
+**
+** The thread freeing may not be the one that allocated, the live bytes are
+** only right once summed over the threads.
+**
+** \param tag The tag given to the allocation.
+** \param ptr The mem pointer, or NULL.
+*/
+void xfree_tag(enum mem_tag_t tag, void *ptr);
+
+/**
+** \brief Update the peaks with the current live bytes.
+**
+** Called once per iteration of the event loop, it reads the counters of
+** every thread.
+*/
+void xalloc_sample(void);
+
+/**
+** \brief Read the counters of every tag.
+**
+** The threads that exited count through a shared record their counters
+** were added to.
+**
+** \param stats Filled with MEM_TAGS entries, indexed by tag.
+*/
+void xalloc_stats(struct mem_stats_t *stats);
+
+/**
+** \brief Name of a tag in the metrics.
+**
+** \param tag The tag.
+** \return A lowercase name, "connections" for MEM_CONNECTIONS.
+*/
+const char *xalloc_tag_name(enum mem_tag_t tag);
+
 #endif /* !XALLOC_H */
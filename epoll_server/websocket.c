@@ -0,0 +1,484 @@
+#include "websocket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utils/xalloc.h"
+
+/**
+ * \brief Appended to the key of the client before hashing, RFC 6455
+ */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_BAD_REQUEST                                                         \
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+#define WS_BAD_VERSION                                                         \
+    "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\n"           \
+    "Content-Length: 0\r\nConnection: close\r\n\r\n"
+
+static uint32_t rotl(uint32_t x, int n)
+{
+    return x << n | x >> (32 - n);
+}
+
+static void sha1_block(uint32_t state[5], const uint8_t *block)
+{
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+            | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+    for (int i = 0; i < 80; i++)
+    {
+        uint32_t f = 0;
+        uint32_t k = 0;
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/* the keys are short, the whole message fits in a few blocks */
+static void sha1(const uint8_t *data, size_t len, uint8_t digest[20])
+{
+    uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                          0xc3d2e1f0 };
+    size_t full = len / 64 * 64;
+    for (size_t i = 0; i < full; i += 64)
+        sha1_block(state, data + i);
+
+    uint8_t tail[128] = { 0 };
+    size_t rest = len - full;
+    memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++)
+        tail[tail_len - 1 - i] = bits >> (8 * i);
+    for (size_t i = 0; i < tail_len; i += 64)
+        sha1_block(state, tail + i);
+
+    for (int i = 0; i < 5; i++)
+    {
+        digest[4 * i] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
+
+static void base64(const uint8_t *data, size_t len, char *out)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < len)
+            v |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len)
+            v |= data[i + 2];
+        out[o++] = digits[v >> 18 & 0x3f];
+        out[o++] = digits[v >> 12 & 0x3f];
+        out[o++] = i + 1 < len ? digits[v >> 6 & 0x3f] : '=';
+        out[o++] = i + 2 < len ? digits[v & 0x3f] : '=';
+    }
+    out[o] = '\0';
+}
+
+static char fold(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* case-insensitive search of a token in a header value */
+static int contains(const char *value, size_t len, const char *token)
+{
+    size_t token_len = strlen(token);
+    for (size_t i = 0; i + token_len <= len; i++)
+    {
+        size_t j = 0;
+        while (j < token_len && fold(value[i + j]) == token[j])
+            j++;
+        if (j == token_len)
+            return 1;
+    }
+    return 0;
+}
+
+/* value of a header of the request, trimmed */
+static const char *header(const char *request, size_t len, const char *name,
+                          size_t *value_len)
+{
+    size_t name_len = strlen(name);
+    const char *end = request + len;
+    const char *line = memchr(request, '\n', len);
+    while (line != NULL && ++line < end)
+    {
+        const char *eol = memchr(line, '\n', end - line);
+        size_t line_len = eol ? (size_t)(eol - line) : (size_t)(end - line);
+        if (line_len > name_len && line[name_len] == ':'
+            && contains(line, name_len, name))
+        {
+            const char *value = line + name_len + 1;
+            const char *stop = line + line_len;
+            while (value < stop && (*value == ' ' || *value == '\t'))
+                value++;
+            while (stop > value
+                   && (stop[-1] == '\r' || stop[-1] == ' ' || stop[-1] == '\t'))
+                stop--;
+            *value_len = stop - value;
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+struct ws_conn_t *ws_add(struct ws_table_t *table, int fd)
+{
+    if ((size_t)fd >= table->by_fd_cap)
+    {
+        size_t cap = table->by_fd_cap ? table->by_fd_cap : 64;
+        while (cap <= (size_t)fd)
+            cap *= 2;
+        table->by_fd = xrealloc_tag(MEM_CONNECTIONS, table->by_fd,
+                                    cap * sizeof(struct ws_conn_t *));
+        memset(table->by_fd + table->by_fd_cap, 0,
+               (cap - table->by_fd_cap) * sizeof(struct ws_conn_t *));
+        table->by_fd_cap = cap;
+    }
+    struct ws_conn_t *ws =
+        xcalloc_tag(MEM_CONNECTIONS, 1, sizeof(struct ws_conn_t));
+    table->by_fd[fd] = ws;
+    table->count++;
+    return ws;
+}
+
+struct ws_conn_t *ws_get(const struct ws_table_t *table, int fd)
+{
+    return (size_t)fd < table->by_fd_cap ? table->by_fd[fd] : NULL;
+}
+
+void ws_remove(struct ws_table_t *table, int fd)
+{
+    struct ws_conn_t *ws = ws_get(table, fd);
+    if (ws == NULL)
+        return;
+    xfree_tag(MEM_CONNECTIONS, ws);
+    table->by_fd[fd] = NULL;
+    table->count--;
+}
+
+size_t ws_request_end(const char *data, size_t len)
+{
+    for (size_t i = 3; i < len; i++)
+    {
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n'
+            && data[i - 3] == '\r')
+            return i + 1;
+    }
+    return 0;
+}
+
+int ws_handshake(const char *request, size_t len, char *reply)
+{
+    size_t upgrade_len = 0;
+    size_t key_len = 0;
+    size_t version_len = 0;
+    const char *upgrade = header(request, len, "upgrade", &upgrade_len);
+    const char *key = header(request, len, "sec-websocket-key", &key_len);
+    const char *version =
+        header(request, len, "sec-websocket-version", &version_len);
+    if (len < 4 || memcmp(request, "GET ", 4) != 0 || upgrade == NULL
+        || !contains(upgrade, upgrade_len, "websocket") || key == NULL
+        || key_len == 0 || key_len > 64)
+    {
+        strcpy(reply, WS_BAD_REQUEST);
+        return -1;
+    }
+    if (version == NULL || version_len != 2 || memcmp(version, "13", 2) != 0)
+    {
+        strcpy(reply, WS_BAD_VERSION);
+        return -1;
+    }
+
+    uint8_t concat[64 + sizeof(WS_GUID)];
+    memcpy(concat, key, key_len);
+    memcpy(concat + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+    uint8_t digest[20];
+    sha1(concat, key_len + sizeof(WS_GUID) - 1, digest);
+    char accept[32];
+    base64(digest, sizeof(digest), accept);
+    return snprintf(reply, WS_MAX_REPLY,
+                    "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: %s\r\n\r\n",
+                    accept);
+}
+
+void ws_unmask(char *data, size_t len, const uint8_t key[4], uint64_t offset)
+{
+    /* the key turned so that its first byte applies to data[0] */
+    uint8_t turned[8];
+    for (int i = 0; i < 8; i++)
+        turned[i] = key[(offset + i) & 3];
+    size_t i = 0;
+#ifdef __SSE2__
+    uint32_t word = 0;
+    memcpy(&word, turned, sizeof(word));
+    __m128i mask = _mm_set1_epi32(word);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(block, mask));
+    }
+#endif
+    uint64_t wide = 0;
+    memcpy(&wide, turned, sizeof(wide));
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t block = 0;
+        memcpy(&block, data + i, sizeof(block));
+        block ^= wide;
+        memcpy(data + i, &block, sizeof(block));
+    }
+    for (; i < len; i++)
+        data[i] ^= turned[i & 3];
+}
+
+static size_t header_size(const struct ws_conn_t *ws)
+{
+    if (ws->head_len < 2)
+        return 2;
+    size_t len7 = ws->head[1] & 0x7f;
+    return 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+}
+
+static int start_frame(struct ws_conn_t *ws)
+{
+    uint8_t b0 = ws->head[0];
+    uint8_t b1 = ws->head[1];
+    /* no extension is negotiated */
+    if ((b0 & 0x70) != 0)
+        return -1;
+    ws->fin = b0 >> 7;
+    ws->opcode = b0 & 0x0f;
+
+    size_t pos = 2;
+    uint64_t len = b1 & 0x7f;
+    if (len == 126)
+    {
+        len = (uint64_t)ws->head[2] << 8 | ws->head[3];
+        pos = 4;
+    }
+    else if (len == 127)
+    {
+        len = 0;
+        for (int i = 0; i < 8; i++)
+            len = len << 8 | ws->head[2 + i];
+        if (len >> 63)
+            return -1;
+        pos = 10;
+    }
+    memcpy(ws->key, ws->head + pos, 4);
+
+    if (ws->opcode >= WS_CLOSE)
+    {
+        if (!ws->fin || len > WS_MAX_CONTROL || ws->opcode > WS_PONG)
+            return -1;
+    }
+    else if (ws->opcode == WS_CONTINUATION)
+    {
+        if (!ws->in_message)
+            return -1;
+    }
+    else if (ws->opcode > WS_BINARY || ws->in_message)
+        return -1;
+
+    ws->left = len;
+    ws->offset = 0;
+    ws->ctl_len = 0;
+    ws->in_frame = 1;
+    return 0;
+}
+
+long ws_input(struct ws_conn_t *ws, char *data, size_t len,
+              ws_data_fn on_data, ws_control_fn on_control, void *arg)
+{
+    long frames = 0;
+    while (len != 0)
+    {
+        if (!ws->in_frame)
+        {
+            while (len != 0 && ws->head_len < header_size(ws))
+            {
+                ws->head[ws->head_len++] = *data++;
+                len--;
+            }
+            /* an unmasked frame has no key to wait for */
+            if (ws->head_len >= 2 && (ws->head[1] & 0x80) == 0)
+                return -1;
+            if (ws->head_len < header_size(ws))
+                break;
+            if (start_frame(ws) == -1)
+                return -1;
+        }
+
+        size_t n = ws->left < len ? ws->left : len;
+        ws_unmask(data, n, ws->key, ws->offset);
+        if (ws->opcode >= WS_CLOSE)
+        {
+            memcpy(ws->ctl + ws->ctl_len, data, n);
+            ws->ctl_len += n;
+        }
+        else if (n != 0)
+            on_data(arg, data, n, 0);
+        ws->left -= n;
+        ws->offset += n;
+        data += n;
+        len -= n;
+        if (ws->left != 0)
+            break;
+
+        ws->in_frame = 0;
+        ws->head_len = 0;
+        if (ws->opcode >= WS_CLOSE)
+        {
+            if (on_control(arg, ws->opcode, ws->ctl, ws->ctl_len) == -1)
+                return -1;
+            continue;
+        }
+        frames++;
+        ws->in_message = !ws->fin;
+        if (ws->fin)
+            on_data(arg, NULL, 0, 1);
+    }
+    return frames;
+}
+
+static struct message_t *frame(int b0, const char *payload, size_t len)
+{
+    size_t head = len < 126 ? 2 : len < 65536 ? 4 : 10;
+    struct message_t *msg = message_new(NULL, head + len);
+    uint8_t *out = (uint8_t *)msg->data;
+    out[0] = b0;
+    if (len < 126)
+        out[1] = len;
+    else if (len < 65536)
+    {
+        out[1] = 126;
+        out[2] = len >> 8;
+        out[3] = len;
+    }
+    else
+    {
+        out[1] = 127;
+        for (int i = 0; i < 8; i++)
+            out[9 - i] = (uint64_t)len >> (8 * i);
+    }
+    memcpy(out + head, payload, len);
+    return msg;
+}
+
+/* well formed UTF-8, no overlong form, surrogate or code point past U+10FFFF */
+static int valid_utf8(const unsigned char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        unsigned char c = data[i];
+        size_t n = 0;
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xbf;
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+        if (c >= 0xc2 && c <= 0xdf)
+            n = 1;
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+            n = 2;
+            lo = c == 0xe0 ? 0xa0 : 0x80;
+            hi = c == 0xed ? 0x9f : 0xbf;
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            n = 3;
+            lo = c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xf4 ? 0x8f : 0xbf;
+        }
+        else
+            return 0;
+        if (len - i <= n || data[i + 1] < lo || data[i + 1] > hi)
+            return 0;
+        for (size_t k = 2; k <= n; k++)
+        {
+            if (data[i + k] < 0x80 || data[i + k] > 0xbf)
+                return 0;
+        }
+        i += n + 1;
+    }
+    return 1;
+}
+
+struct message_t *ws_frame(const struct message_t *msg, int first)
+{
+    int fin = msg->len != 0 && msg->data[msg->len - 1] == '\n';
+    int opcode = WS_CONTINUATION;
+    /* a chunk may end inside a character, only whole lines are checked */
+    if (first && fin
+        && valid_utf8((const unsigned char *)msg->data, msg->len - 1))
+        opcode = WS_TEXT;
+    else if (first)
+        opcode = WS_BINARY;
+    return frame((fin ? 0x80 : 0) | opcode, msg->data, msg->len - fin);
+}
+
+struct message_t *ws_control(int opcode, const char *payload, size_t len)
+{
+    return frame(0x80 | opcode, payload, len);
+}
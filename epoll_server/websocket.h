@@ -0,0 +1,221 @@
+#ifndef WEBSOCKET_H_
+#define WEBSOCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+/**
+ * \brief Longest handshake request, longer ones are refused
+ */
+#define WS_MAX_HANDSHAKE 8192
+
+/**
+ * \brief Longest handshake reply
+ */
+#define WS_MAX_REPLY 256
+
+/**
+ * \brief Sent to the WebSocket connections refused by the admission limits
+ */
+#define WS_UNAVAILABLE                                                         \
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"               \
+    "Connection: close\r\n\r\n"
+
+/**
+ * \brief Sent when the handshake request exceeds WS_MAX_HANDSHAKE
+ */
+#define WS_TOO_LARGE                                                           \
+    "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\n"  \
+    "Connection: close\r\n\r\n"
+
+/**
+ * \brief Longest payload of a control frame
+ */
+#define WS_MAX_CONTROL 125
+
+#define WS_CONTINUATION 0x0
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xa
+
+/**
+ * \brief Receives the payload of the data frames, unmasked
+ *
+ * \param data: the pointer given to ws_input()
+ * \param payload: the bytes, NULL if len is 0
+ * \param len: the number of bytes
+ * \param end: the message ends with these bytes
+ */
+typedef void (*ws_data_fn)(void *data, const char *payload, size_t len,
+                           int end);
+
+/**
+ * \brief Receives the control frames once they are complete
+ *
+ * \param data: the pointer given to ws_input()
+ * \param opcode: WS_CLOSE, WS_PING or WS_PONG
+ * \param payload: the bytes, unmasked
+ * \param len: the number of bytes
+ *
+ * \return 0 to go on, -1 to stop reading the connection
+ */
+typedef int (*ws_control_fn)(void *data, int opcode, const char *payload,
+                             size_t len);
+
+/**
+ * \brief Decoding state of a WebSocket connection
+ *
+ * Frames are decoded as the bytes arrive, whatever the recv(2) boundaries:
+ * the header is gathered in head, the payload is unmasked in place and
+ * handed over at once. The struct holds no pointer so that a hot upgrade
+ * can copy it.
+ */
+struct ws_conn_t
+{
+    uint8_t open; /**< the handshake is done */
+
+    uint8_t joining; /**< waits for the start of a broadcast line */
+
+    uint8_t in_frame; /**< the header of the current frame was read */
+
+    uint8_t in_message; /**< a fragmented data message is not finished */
+
+    uint8_t opcode; /**< opcode of the current frame */
+
+    uint8_t fin; /**< the current frame ends its message */
+
+    uint8_t head_len; /**< bytes gathered in head */
+
+    uint8_t head[14]; /**< header of the next frame */
+
+    uint8_t key[4]; /**< masking key of the current frame */
+
+    uint8_t ctl_len; /**< bytes gathered in ctl */
+
+    uint64_t left; /**< payload bytes of the current frame still to come */
+
+    uint64_t offset; /**< payload bytes of the current frame unmasked */
+
+    char ctl[WS_MAX_CONTROL]; /**< payload of the current control frame */
+};
+
+/**
+ * \brief The WebSocket connections by socket fd
+ */
+struct ws_table_t
+{
+    struct ws_conn_t **by_fd; /**< state of every socket fd, or NULL */
+
+    size_t by_fd_cap; /**< length of by_fd */
+
+    size_t count; /**< number of connections */
+};
+
+/**
+ * \brief Track a new WebSocket connection
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ *
+ * \return The state of the connection, waiting for the handshake
+ */
+struct ws_conn_t *ws_add(struct ws_table_t *table, int fd);
+
+/**
+ * \brief State of a WebSocket connection
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ *
+ * \return The state, NULL if the client is not a WebSocket one
+ */
+struct ws_conn_t *ws_get(const struct ws_table_t *table, int fd);
+
+/**
+ * \brief Forget a WebSocket connection
+ *
+ * \param table: the table
+ * \param fd: the socket of the client
+ */
+void ws_remove(struct ws_table_t *table, int fd);
+
+/**
+ * \brief Find the end of a handshake request
+ *
+ * \param data: the bytes received so far
+ * \param len: the number of bytes
+ *
+ * \return The length of the request with its empty line, 0 if incomplete
+ */
+size_t ws_request_end(const char *data, size_t len);
+
+/**
+ * \brief Answer a handshake request
+ *
+ * \param request: the request, up to its empty line
+ * \param len: the length of request
+ * \param reply: buffer of WS_MAX_REPLY bytes receiving the answer
+ *
+ * \return The length of the answer, -1 if the request is not a WebSocket
+ * upgrade, in which case reply holds an HTTP error
+ */
+int ws_handshake(const char *request, size_t len, char *reply);
+
+/**
+ * \brief XOR a payload with its masking key
+ *
+ * \param data: the payload, unmasked in place
+ * \param len: the number of bytes
+ * \param key: the masking key of the frame
+ * \param offset: position of data in the payload of the frame
+ *
+ * Sixteen bytes are unmasked at a time with SSE2, eight otherwise.
+ */
+void ws_unmask(char *data, size_t len, const uint8_t key[4], uint64_t offset);
+
+/**
+ * \brief Decode the frames of received bytes
+ *
+ * \param ws: the state of the connection, open
+ * \param data: the bytes, unmasked in place
+ * \param len: the number of bytes
+ * \param on_data: receives the data frames
+ * \param on_control: receives the control frames
+ * \param arg: data pointer of the callbacks
+ *
+ * \return The number of data frames, -1 on a protocol error or when
+ * on_control asked to stop
+ */
+long ws_input(struct ws_conn_t *ws, char *data, size_t len,
+              ws_data_fn on_data, ws_control_fn on_control, void *arg);
+
+/**
+ * \brief Wrap a broadcast message in a data frame
+ *
+ * \param msg: the message, a line or a chunk of a cut through line
+ * \param first: the message starts its line
+ *
+ * \return A new message, a continuation frame unless first and ending the
+ * WebSocket message with the '\n' of the line, which it leaves out
+ *
+ * A whole line of valid UTF-8 goes in a text frame. The other lines, and the
+ * cut through lines whose chunks may split a character, go in binary frames.
+ */
+struct message_t *ws_frame(const struct message_t *msg, int first);
+
+/**
+ * \brief Build a control frame
+ *
+ * \param opcode: WS_CLOSE, WS_PING or WS_PONG
+ * \param payload: up to WS_MAX_CONTROL bytes
+ * \param len: the number of bytes
+ *
+ * \return A new message
+ */
+struct message_t *ws_control(int opcode, const char *payload, size_t len);
+
+#endif /* WEBSOCKET_H_ */
@@ -0,0 +1,146 @@
+#include "zerocopy.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <linux/errqueue.h>
+
+#include "utils/xalloc.h"
+
+int zerocopy_eligible(const struct client_table_t *table,
+                      const struct connection_t *connection,
+                      const struct message_t *msg)
+{
+    return table->zerocopy_threshold != 0
+        && msg->len >= table->zerocopy_threshold && !connection->no_zerocopy;
+}
+
+static void pin(struct connection_t *connection, struct message_t *msg)
+{
+    struct outq_t *out = connection->out;
+    if (out->pin_count == out->pin_cap)
+    {
+        uint32_t cap = out->pin_cap ? out->pin_cap * 2 : 8;
+        struct message_t **pins =
+            xmalloc_tag(MEM_OUTPUT, cap * sizeof(struct message_t *));
+        for (uint32_t i = 0; i < out->pin_count; i++)
+            pins[i] = out->pins[(out->pin_first + i) % out->pin_cap];
+        xfree_tag(MEM_OUTPUT, out->pins);
+        out->pins = pins;
+        out->pin_cap = cap;
+        out->pin_first = 0;
+    }
+    if (out->pin_count == 0)
+        out->pin_id = connection->zc_next;
+
+    out->pins[(out->pin_first + out->pin_count) % out->pin_cap] =
+        message_ref(msg);
+    out->pin_count++;
+    connection->zc_next = (connection->zc_next + 1) & ZC_ID_MASK;
+}
+
+static ssize_t copy_send(struct client_table_t *table,
+                         struct connection_t *connection,
+                         struct message_t *msg, size_t off)
+{
+    table->zc_fallbacks++;
+    return send(connection->client_socket, msg->data + off, msg->len - off,
+                MSG_NOSIGNAL);
+}
+
+ssize_t zerocopy_send(struct client_table_t *table,
+                      struct connection_t *connection, struct message_t *msg,
+                      size_t off)
+{
+    if (!connection->zerocopy)
+    {
+        int enable = 1;
+        if (setsockopt(connection->client_socket, SOL_SOCKET, SO_ZEROCOPY,
+                       &enable, sizeof(int))
+            == -1)
+        {
+            connection->no_zerocopy = 1;
+            return copy_send(table, connection, msg, off);
+        }
+        connection->zerocopy = 1;
+    }
+
+    ssize_t w = send(connection->client_socket, msg->data + off,
+                     msg->len - off, MSG_NOSIGNAL | MSG_ZEROCOPY);
+    if (w == -1 && errno == ENOBUFS)
+        return copy_send(table, connection, msg, off);
+    if (w >= 0)
+    {
+        pin(connection, msg);
+        table->zc_sends++;
+        table->zc_bytes += w;
+    }
+    return w;
+}
+
+static void complete_range(struct outq_t *out, uint32_t lo, uint32_t hi)
+{
+    uint32_t span = (hi - lo) & ZC_ID_MASK;
+    for (uint32_t i = 0; i < out->pin_count; i++)
+    {
+        uint32_t id = (out->pin_id + i) & ZC_ID_MASK;
+        struct message_t **slot = &out->pins[(out->pin_first + i) % out->pin_cap];
+        if (*slot != NULL && ((id - lo) & ZC_ID_MASK) <= span)
+        {
+            message_unref(*slot);
+            *slot = NULL;
+        }
+    }
+    while (out->pin_count != 0 && out->pins[out->pin_first] == NULL)
+    {
+        out->pin_first = (out->pin_first + 1) % out->pin_cap;
+        out->pin_id = (out->pin_id + 1) & ZC_ID_MASK;
+        out->pin_count--;
+    }
+}
+
+int zerocopy_complete(struct client_table_t *table,
+                      struct connection_t *connection)
+{
+    char control[128];
+    while (1)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(connection->client_socket, &msg, MSG_ERRQUEUE) == -1)
+            break;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(struct sock_extended_err));
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                return -1;
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                table->zc_copied++;
+            if (connection->out != NULL)
+                complete_range(connection->out, serr.ee_info & ZC_ID_MASK,
+                               serr.ee_data & ZC_ID_MASK);
+        }
+    }
+    release_output(table, connection);
+    return 0;
+}
+
+void zerocopy_drop(struct connection_t *connection)
+{
+    struct outq_t *out = connection->out;
+    for (uint32_t i = 0; i < out->pin_count; i++)
+    {
+        struct message_t *msg = out->pins[(out->pin_first + i) % out->pin_cap];
+        if (msg != NULL)
+            message_unref(msg);
+    }
+    out->pin_count = 0;
+}
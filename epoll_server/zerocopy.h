@@ -0,0 +1,62 @@
+#ifndef ZEROCOPY_H_
+#define ZEROCOPY_H_
+
+#include <sys/types.h>
+
+#include "connection.h"
+
+/**
+ * \brief Tell if a message must be sent with MSG_ZEROCOPY
+ *
+ * \param table: the table with all the clients
+ * \param connection: the recipient
+ * \param msg: the message
+ *
+ * \return 1 if the message reaches the threshold and the socket accepts
+ * SO_ZEROCOPY, 0 otherwise
+ */
+int zerocopy_eligible(const struct client_table_t *table,
+                      const struct connection_t *connection,
+                      const struct message_t *msg);
+
+/**
+ * \brief Send the rest of a message with MSG_ZEROCOPY
+ *
+ * \param table: the table with all the clients
+ * \param connection: the recipient
+ * \param msg: the message at the head of the output queue
+ * \param off: bytes of the message already sent
+ *
+ * \return The sendmsg(2) result
+ *
+ * SO_ZEROCOPY is enabled on the first call. Every successful call pins a
+ * reference on the message until the kernel reports the completion of its
+ * notification id, the pages stay shared with the socket until then. When the
+ * socket refuses SO_ZEROCOPY or runs out of optmem the message is copied.
+ */
+ssize_t zerocopy_send(struct client_table_t *table,
+                      struct connection_t *connection, struct message_t *msg,
+                      size_t off);
+
+/**
+ * \brief Read the completion notifications of the error queue of a socket
+ *
+ * \param table: the table with all the clients
+ * \param connection: the client whose socket reported EPOLLERR
+ *
+ * \return 0 on success, -1 if the error queue holds a real socket error
+ *
+ * The messages pinned by the completed sends are released and the output
+ * queue is given back to the pool once nothing is pending anymore.
+ */
+int zerocopy_complete(struct client_table_t *table,
+                      struct connection_t *connection);
+
+/**
+ * \brief Release every pinned message of a client being closed
+ *
+ * \param connection: the client
+ */
+void zerocopy_drop(struct connection_t *connection);
+
+#endif /* ZEROCOPY_H_ */